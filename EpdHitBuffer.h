@@ -0,0 +1,111 @@
+/**
+ * \brief EPD hits of the current event as flat arrays
+ *
+ * The EpdHit branch is read in MakeClass mode straight into the arrays
+ * below, so no StPicoEpdHit objects are streamed. The quantities of the
+ * StPicoEpdHit accessors are decoded once per event by Decode():
+ *   id()       = mId, negative for the east side
+ *   position() = |mId/100|, supersector 1-12
+ *   tile()     = |mId%100|, tile 1-31
+ *   row()      = tile()/2 + 1, ring 1-16
+ *   adc()      = mQTdata & 0x0FFF
+ *   nMIP()     = mnMIP
+ *
+ * TChain sets the object address of the branch again for each new tree,
+ * so Update() has to be called after every LoadTree() and before the
+ * entry is read. Update() also grows the arrays to the largest # of hits of
+ * an entry of the tree (TBranchElement::GetMaximum(), as in MakeClass), so
+ * GetEntry() never writes past them.
+ */
+
+#ifndef EpdHitBuffer_h
+#define EpdHitBuffer_h
+
+#include "TChain.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TBranchElement.h"
+#include "TObjArray.h"
+#include "TString.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+class EpdHitBuffer {
+public:
+  static const Int_t kMaxHits = 1000; // initial size of the arrays, 744 EPD tiles
+
+  Int_t nHits;
+  // EpdHit leaves
+  std::vector<Short_t> id;
+  std::vector<Int_t>   qtData;
+  std::vector<Float_t> nMip;
+  // Decoded by Decode()
+  std::vector<Int_t>   ew;       // 0: east, 1: west
+  std::vector<Int_t>   position; // supersector
+  std::vector<Int_t>   tile;
+  std::vector<Int_t>   ring;
+  std::vector<Int_t>   adc;
+
+  EpdHitBuffer(TChain *chain) : nHits(0), mChain(chain), mTreeNumber(-1) { Reserve(kMaxHits); }
+
+  Int_t Capacity() const { return (Int_t)id.size(); }
+
+  // Room for n hits. The leaves are bound again by the next Update() if the arrays have moved.
+  void Reserve(Int_t n){
+    if(n <= Capacity()) return;
+    id.resize(n); qtData.resize(n); nMip.resize(n);
+    ew.resize(n); position.resize(n); tile.resize(n); ring.resize(n); adc.resize(n);
+    mTreeNumber = -1;
+  }
+
+  // Rebind the EpdHit leaves if the chain has moved to a new tree
+  Bool_t Update(){
+    if(mChain->GetTreeNumber() == mTreeNumber) return kTRUE;
+    mTreeNumber = mChain->GetTreeNumber();
+    nHits = 0;
+    TTree *tree = mChain->GetTree();
+    TBranchElement *branch = (tree) ? (TBranchElement*)tree->GetBranch("EpdHit") : NULL;
+    if(!branch){
+      std::cout << "EpdHitBuffer: no EpdHit branch in tree " << mTreeNumber << std::endl;
+      return kFALSE;
+    }
+    Reserve(branch->GetMaximum());
+    mTreeNumber = mChain->GetTreeNumber(); // the addresses below are the ones after Reserve()
+    branch->SetMakeClass(kTRUE);
+    branch->SetAddress(&nHits); // the TClonesArray branch holds the # of hits in MakeClass mode
+    TIter next(branch->GetListOfBranches());
+    while(TBranchElement *leaf = (TBranchElement*)next()){
+      TString name = leaf->GetName();
+      void *address = NULL;
+      if(name == "EpdHit.mId")          address = &id[0];
+      else if(name == "EpdHit.mQTdata") address = &qtData[0];
+      else if(name == "EpdHit.mnMIP")   address = &nMip[0];
+      if(!address){ // e.g. TObject members, not needed
+        tree->SetBranchStatus(name, 0);
+        continue;
+      }
+      leaf->SetMakeClass(kTRUE);
+      leaf->SetAddress(address);
+    }
+    return kTRUE;
+  }
+
+  // Derive the StPicoEpdHit quantities of the hits of the current entry
+  void Decode(){
+    for(Int_t iHit=0; iHit<nHits; iHit++){
+      ew[iHit]       = (id[iHit] < 0) ? 0 : 1;
+      position[iHit] = std::abs(id[iHit] / 100);
+      tile[iHit]     = std::abs(id[iHit] % 100);
+      ring[iHit]     = tile[iHit] / 2 + 1;
+      adc[iHit]      = qtData[iHit] & 0x0FFF;
+    }
+  }
+
+private:
+  TChain *mChain;
+  Int_t   mTreeNumber; // tree of the chain the addresses are set for
+};
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * \brief Merges the output files of several PicoAnalyzer processes
+ *
+ * Used by PicoParallel.sh for .picoDst.result.root, EpCorrection_OUTPUT_ and
+ * PhiMesonAna_OUTPUT_. Histograms and profiles of the same name are added up,
+ * as hadd would do, except the eta weights (Order1etaWeight, v1WtaWt), which
+ * are configuration of the job and are taken once from the first file.
+ * Trees (SkippedEntries of skipbad=1) get the rows of all files.
+ * The objects are merged one name at a time: read from every input, added up,
+ * written and deleted, so at most one object per input is in memory.
+ * All inputs must hold the same object names. Otherwise nothing is written and
+ * kFALSE is returned, as for an input that can not be opened; the scripts run
+ * the macro through gSystem->Exit() so that this is the exit status.
+ * The inputs are given as a space separated list or as a file (*.list) with
+ * one name per line.
+ *
+ *   root -b -q -l -e '.L MergeAnalyzerOutputs.cxx+' \
+ *        -e 'gSystem->Exit(MergeAnalyzerOutputs("merged.root","part0.root part1.root") ? 0 : 1)'
+ */
+
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "TROOT.h"
+#include "TSystem.h"
+#include "TFile.h"
+#include "TKey.h"
+#include "TList.h"
+#include "TH1.h"
+#include "TTree.h"
+#include "TString.h"
+#include "TObjString.h"
+#include "TObjArray.h"
+
+const char* _unmergedObjects[2] = {"Order1etaWeight", "v1WtaWt"}; // same in every process
+
+// Names of the objects of a file, each once
+void ObjectNames(TFile *file, std::set<std::string> &names){
+  TIter next(file->GetListOfKeys());
+  while(TKey *key = (TKey*)next()) names.insert(key->GetName());
+}
+
+Bool_t MergeAnalyzerOutputs(TString mergedName, TString inputNames)
+{
+  std::vector<TString> names;
+  if(inputNames.EndsWith(".list")){
+    std::ifstream list(inputNames.Data());
+    std::string line;
+    while(std::getline(list, line)){
+      TString name = TString(line.c_str()).Strip(TString::kBoth);
+      if(!name.IsNull()) names.push_back(name);
+    }
+  } else {
+    TObjArray *tokens = inputNames.Tokenize(" ");
+    for(int i=0; i<tokens->GetEntries(); i++) names.push_back(((TObjString*)tokens->At(i))->GetString());
+    delete tokens;
+  }
+  std::vector<TFile*> inputs;
+  for(unsigned int i=0; i<names.size(); i++){
+    TString inputName = names[i];
+    TFile *input = TFile::Open(inputName, "READ");
+    if(!input || input->IsZombie()){
+      std::cout << "Merge: " << inputName << " can not be opened" << std::endl;
+      delete input;
+      for(unsigned int j=0; j<inputs.size(); j++) delete inputs[j];
+      return kFALSE;
+    }
+    inputs.push_back(input);
+  }
+  if(inputs.empty()) return kFALSE;
+  std::set<std::string> objectNames; // of the first input, every other one must have the same
+  ObjectNames(inputs[0], objectNames);
+  for(unsigned int iInput=1; iInput<inputs.size(); iInput++){
+    std::set<std::string> inputObjects;
+    ObjectNames(inputs[iInput], inputObjects);
+    if(inputObjects == objectNames) continue;
+    for(std::set<std::string>::const_iterator it=objectNames.begin(); it!=objectNames.end(); ++it){
+      if(!inputObjects.count(*it)) std::cout << "Merge: " << *it << " is missing in " << inputs[iInput]->GetName() << std::endl;
+    }
+    for(std::set<std::string>::const_iterator it=inputObjects.begin(); it!=inputObjects.end(); ++it){
+      if(!objectNames.count(*it)) std::cout << "Merge: " << *it << " is missing in " << inputs[0]->GetName() << std::endl;
+    }
+    std::cout << "Merge: the inputs do not have the same objects, " << mergedName << " is not written" << std::endl;
+    for(unsigned int i=0; i<inputs.size(); i++) delete inputs[i];
+    return kFALSE;
+  }
+
+  TFile *mergedFile = new TFile(mergedName,"RECREATE");
+  Bool_t merged = kTRUE;
+  std::set<std::string> done; // keys are listed highest cycle first
+  TIter next(inputs[0]->GetListOfKeys());
+  while(TKey *key = (TKey*)next()){
+    if(!done.insert(key->GetName()).second) continue;
+    TObject *obj = key->ReadObj();
+    Bool_t isMerged = obj->InheritsFrom(TH1::Class()) || obj->InheritsFrom(TTree::Class());
+    for(int i=0; i<2; i++){
+      if(strcmp(key->GetName(), _unmergedObjects[i]) == 0) isMerged = kFALSE;
+    }
+    if(isMerged){
+      TList others;
+      for(unsigned int iInput=1; iInput<inputs.size() && merged; iInput++){
+        TObject *other = inputs[iInput]->Get(key->GetName());
+        if(other) others.Add(other);
+        else { // listed, but it can not be read
+          std::cout << "Merge: " << key->GetName() << " can not be read from " << inputs[iInput]->GetName() << std::endl;
+          merged = kFALSE;
+        }
+      }
+      if(!merged){
+        others.Delete();
+        delete obj;
+        break;
+      }
+      if(obj->InheritsFrom(TTree::Class())){
+        mergedFile->cd();
+        others.AddFirst(obj);
+        TTree *mergedTree = TTree::MergeTrees(&others);
+        if(mergedTree){
+          mergedTree->Write();
+          delete mergedTree;
+        }
+        others.Delete(); // obj included
+        continue;
+      }
+      ((TH1*)obj)->Merge(&others);
+      others.Delete();
+    }
+    mergedFile->WriteTObject(obj);
+    delete obj;
+  }
+  mergedFile->Close();
+  delete mergedFile;
+  if(merged) std::cout << "Merged " << inputs.size() << " files into " << mergedName << std::endl;
+  else gSystem->Unlink(mergedName); // no partial sum
+  for(unsigned int i=0; i<inputs.size(); i++) delete inputs[i];
+  return merged;
+}
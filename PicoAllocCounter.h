@@ -0,0 +1,112 @@
+/**
+ * \brief Heap allocation counter of the event loop of PicoAnalyzer()
+ *
+ * The buffers of the event loop (good tracks, PID track lists, EPD-3 sub-event
+ * Q-vectors) are allocated once per worker and reused, so once they have grown
+ * to the largest event the analysis of an event should not touch the heap.
+ * To check it, compile with the counter on:
+ *   root4star -b -q -l -e 'gSystem->AddIncludePath("-DPICO_COUNT_ALLOCS")' -e '.x PicoAnalyzer.cxx+(...)'
+ * The global operator new and delete are then replaced by counting ones, and
+ * every worker reports at the end of its event loop the allocations per event
+ * made after the whole entry was read (reading itself allocates in ROOT I/O),
+ * from the track preprocessing on, for the events that pass the event cuts,
+ * not counting the first kWarmUpEvents events, with the number of events that
+ * allocated at all and the most allocations of one event. An allocation that
+ * only a few events make is a buffer growing past its largest size so far; one
+ * that every event makes is a leftover to remove. Include this header in one
+ * translation unit only. The replacement takes effect only where the
+ * allocations of the analysis resolve to it (an executable, or a library
+ * linked with -Bsymbolic); if it does not, the report says so.
+ */
+
+#ifndef PicoAllocCounter_h
+#define PicoAllocCounter_h
+
+#include "Rtypes.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#ifdef PICO_COUNT_ALLOCS
+static thread_local Long64_t gPicoHeapAllocs = 0; // of this thread
+
+void* operator new(size_t size){
+  gPicoHeapAllocs++;
+  void *p = malloc((size) ? size : 1);
+  if(!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size){ return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  gPicoHeapAllocs++;
+  return malloc((size) ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+#endif
+
+class PicoAllocCounter {
+public:
+  static const Long64_t kWarmUpEvents = 100; // the buffers grow during the first events
+
+  PicoAllocCounter() : mStart(-1), mEvents(0), mSteadyEvents(0), mSteadyAllocs(0), mAllocEvents(0), mMaxAllocs(0) {}
+
+  // Allocations of this thread so far, 0 without PICO_COUNT_ALLOCS
+  static Long64_t Count(){
+#ifdef PICO_COUNT_ALLOCS
+    return gPicoHeapAllocs;
+#else
+    return 0;
+#endif
+  }
+  // kTRUE if the allocations of this translation unit are counted
+  static Bool_t Enabled(){
+    Long64_t before = Count();
+    char * volatile p = new char;
+    delete p;
+    return Count() != before;
+  }
+
+  // The whole entry is read (with lazy=1 the Track and EpdHit branches too), its analysis starts
+  void Begin(){ mStart = Count(); }
+  // The analysis of the event ended (or it was cut), called before the next event is read
+  void End(){
+    if(mStart < 0) return;
+    if(++mEvents > kWarmUpEvents){
+      Long64_t allocs = Count() - mStart;
+      mSteadyEvents++;
+      mSteadyAllocs += allocs;
+      if(allocs > 0) mAllocEvents++;
+      if(allocs > mMaxAllocs) mMaxAllocs = allocs;
+    }
+    mStart = -1;
+  }
+
+  void Print(Int_t workerId) const {
+#ifdef PICO_COUNT_ALLOCS
+    if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+    if(!Enabled()){
+      std::cout << "Heap allocation counter: operator new is not replaced in this build, nothing counted" << std::endl;
+      return;
+    }
+    std::cout << "Heap allocations in the event loop: " << mSteadyAllocs << " in " << mSteadyEvents
+              << " events after the first " << kWarmUpEvents << " ("
+              << ((mSteadyEvents > 0) ? (Double_t)mSteadyAllocs/mSteadyEvents : 0.0) << " per event), "
+              << mAllocEvents << " events allocated, at most " << mMaxAllocs << " in one event" << std::endl;
+#endif
+  }
+
+private:
+  Long64_t mStart;        // Count() at Begin(), -1 outside of an event
+  Long64_t mEvents;       // analysed
+  Long64_t mSteadyEvents; // after the warm-up
+  Long64_t mSteadyAllocs;
+  Long64_t mAllocEvents;  // after the warm-up, with at least one allocation
+  Long64_t mMaxAllocs;    // of one event after the warm-up
+};
+
+#endif
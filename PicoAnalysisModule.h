@@ -0,0 +1,185 @@
+/**
+ * \brief Observable modules fed by the event loop of PicoAnalyzer()
+ *
+ * The event loop hands every event to a PicoModuleChain. Its first entries
+ * are the shared stages of PicoAnalyzer.cxx, which fill PicoEventProducts and
+ * may drop the event:
+ *   eventSelector     -> event      : eventInfo, runId, vertex, bField (events passing the event cuts only)
+ *   trackPreprocessor -> tracks     : decoded track columns, good tracks, EPD hits
+ *                        centrality : centrality bin 1 (0-5%) ... 9 (70-80%), after the pile-up cut
+ *   epdQvector        -> epdQ       : raw Q-vectors of the EPD east sub-events, eta and phi of the EPD hits
+ *   tpcQvector        -> pid        : proton, K+ and K- track indices
+ *                        tpcQ       : raw Q-vectors of the TPC sub-events
+ *   epdEventPlane     -> epdEP      : raw and shifted EPD east event planes, resolutions
+ *   tpcEventPlane     -> tpcEP      : raw and shifted TPC event planes
+ * The event plane stages correct the Q-vectors of the event themselves, or,
+ * with epbatch=N, take the angles computed for a block of events at once
+ * (epBlockEvent >= 0, see PicoEpBatch.h).
+ * The observable modules follow, and run only for the events the stages keep.
+ * Every entry declares the products it reads and the ones it adds, and is run
+ * in the order of registration; PicoModuleChain::Add() refuses an entry
+ * whose inputs no earlier entry provides. The flow profiles, the proton v1
+ * and the phi meson analyses of PicoAnalyzer.cxx are modules themselves.
+ *
+ * Further observables are added without touching the event loop, from a
+ * macro run before PicoAnalyzer():
+ *   AddAnalysisModuleFactory([](PicoModuleChain &modules, TFile *output){
+ *     TH1D *h = new TH1D("hist_myPsi","",100,0,7); // booked in output, merged and written as the others
+ *     modules.Add("myPsi", {"epdEP","centrality"}, {}, [=](const PicoEventProducts &ev){
+ *       if(ev.psiEpdEastRaw[1] != -999.0) h->Fill(ev.psiEpdEastShifted[1]);
+ *     });
+ *   });
+ * The factories are called by every event loop worker with its own
+ * .picoDst.result.root output, so each worker has its own histograms.
+ */
+
+#ifndef PicoAnalysisModule_h
+#define PicoAnalysisModule_h
+
+#include "TFile.h"
+#include "TVector3.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "EpdHitBuffer.h"
+#include "PicoTrackColumns.h"
+#include "PicoFlowSkim.h"
+
+// Products of the shared stages of the current event, valid during PicoModuleChain::Process()
+struct PicoEventProducts {
+  // event
+  const PicoEventInfo *eventInfo;
+  Int_t    runId;
+  TVector3 vertex;
+  Float_t  bField;
+  Int_t    epOrder; // event plane order of the job
+  // tracks
+  PicoTrackColumns   *tracks;
+  const std::vector<Int_t> *goodTracks; // indices of the tracks passing the track cuts
+  const EpdHitBuffer *epdHits;
+  // centrality
+  Int_t    centrality;
+  // pid
+  const std::vector<Int_t> *protons;
+  const std::vector<Int_t> *kaonsPlus;
+  const std::vector<Int_t> *kaonsMinus;
+  // epdQ, [EPD eta range 0-4]
+  const Int_t    *nEpdEast;          // hits in the sub-event
+  const Double_t (*qEpdEastRaw)[2];  // [x,y]
+  const Double_t *epdEta;            // of the EPD hits, by hit index
+  const Double_t *epdPhi;
+  // tpcQ, [TPC eta range 0-1]
+  const Int_t    *nTpc;              // tracks in the sub-event
+  const Double_t (*qTpcRaw)[2];      // [x,y]
+  // epdEP, [EPD eta range 0-4], -999 if the sub-event is empty
+  const Double_t *psiEpdEastRaw;
+  const Double_t *psiEpdEastShifted;
+  const Double_t (*resolution)[9];   // [v1,v2][centrality-1], of EPD-1
+  // tpcEP, [TPC eta range 0-1]
+  const Double_t *psiTpcRaw;
+  const Double_t *psiTpcShifted;
+  Int_t epBlockEvent; // of the event plane block (epbatch=N), -1: the event is corrected on its own
+};
+
+struct PicoAnalysisModule {
+  std::string name;
+  std::vector<std::string> inputs;
+  std::vector<std::string> outputs;
+  std::function<void(const PicoEventProducts&)> process;
+  std::function<void()> finish; // after the event loop, may be empty
+  std::function<Bool_t(PicoEventProducts&)> stage; // of a shared stage instead of process, kFALSE drops the event
+};
+
+class PicoModuleChain {
+public:
+  Bool_t Add(const std::string &name, const std::vector<std::string> &inputs, const std::vector<std::string> &outputs,
+             std::function<void(const PicoEventProducts&)> process, std::function<void()> finish = std::function<void()>()){
+    PicoAnalysisModule module;
+    module.name    = name;
+    module.inputs  = inputs;
+    module.outputs = outputs;
+    module.process = process;
+    module.finish  = finish;
+    return Add(module);
+  }
+
+  // A shared stage, it fills its outputs in the products
+  Bool_t AddStage(const std::string &name, const std::vector<std::string> &inputs, const std::vector<std::string> &outputs,
+                  std::function<Bool_t(PicoEventProducts&)> stage){
+    PicoAnalysisModule module;
+    module.name    = name;
+    module.inputs  = inputs;
+    module.outputs = outputs;
+    module.stage   = stage;
+    return Add(module);
+  }
+
+  // kFALSE if a stage dropped the event, the entries after it are not run.
+  // Entries first ... end-1 only, end < 0: to the last one
+  Bool_t Process(PicoEventProducts &products, Int_t first = 0, Int_t end = -1) const {
+    if(end < 0 || end > (Int_t)mModules.size()) end = mModules.size();
+    for(Int_t i=first; i<end; i++){
+      if(!mModules[i].stage){
+        mModules[i].process(products);
+      } else if(!mModules[i].stage(products)){
+        return kFALSE;
+      }
+    }
+    return kTRUE;
+  }
+
+  // Position of the entry in the chain, -1 if it is not in it
+  Int_t Find(const std::string &name) const {
+    for(unsigned int i=0; i<mModules.size(); i++){
+      if(mModules[i].name == name) return i;
+    }
+    return -1;
+  }
+
+  void Finish() const {
+    for(unsigned int i=0; i<mModules.size(); i++){
+      if(mModules[i].finish) mModules[i].finish();
+    }
+  }
+
+  void Print() const {
+    for(unsigned int i=0; i<mModules.size(); i++){
+      std::cout << "Analysis module " << i << ": " << mModules[i].name << " (";
+      for(unsigned int j=0; j<mModules[i].inputs.size(); j++) std::cout << ((j) ? ", " : "") << mModules[i].inputs[j];
+      std::cout << ")";
+      for(unsigned int j=0; j<mModules[i].outputs.size(); j++) std::cout << ((j) ? ", " : " -> ") << mModules[i].outputs[j];
+      std::cout << std::endl;
+    }
+  }
+
+private:
+  Bool_t Add(const PicoAnalysisModule &module){
+    for(unsigned int i=0; i<module.inputs.size(); i++){
+      if(std::find(mProducts.begin(), mProducts.end(), module.inputs[i]) != mProducts.end()) continue;
+      std::cout << "Analysis module " << module.name << ": input " << module.inputs[i] << " is not provided, the module is not run" << std::endl;
+      return kFALSE;
+    }
+    mModules.push_back(module);
+    mProducts.insert(mProducts.end(), module.outputs.begin(), module.outputs.end());
+    return kTRUE;
+  }
+
+  std::vector<PicoAnalysisModule> mModules;
+  std::vector<std::string> mProducts; // of the entries added so far
+};
+
+// Modules of the user, added to the chain of every event loop worker
+typedef std::function<void(PicoModuleChain&, TFile*)> PicoModuleFactory;
+inline std::vector<PicoModuleFactory>& AnalysisModuleFactories(){
+  static std::vector<PicoModuleFactory> factories;
+  return factories;
+}
+inline void AddAnalysisModuleFactory(PicoModuleFactory factory){
+  AnalysisModuleFactories().push_back(factory);
+}
+
+#endif
@@ -32,19 +32,36 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 #include <iterator>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 #include <stdio.h>
 
 // ROOT headers
 #include "TROOT.h"
 #include "TFile.h"
+#include "TMemFile.h"
 #include "TChain.h"
+#include "TBranch.h"
 #include "TTree.h"
+#include "TTreeCache.h"
+#include "TStopwatch.h"
+#include "TEnv.h"
 #include "TSystem.h"
 #include "TH1.h"
 #include "TH2.h"
 #include "TMath.h"
 #include "TString.h"
+#include "TObjString.h"
+#include "TObjArray.h"
+#include "TList.h"
+#include "TParameter.h"
+#include "TClonesArray.h"
+#include "TEntryList.h"
 #include "TVector2.h"
 #include "TVector3.h"
 #include "TH1D.h"
@@ -72,6 +89,24 @@
 #include "StRoot/StEpdUtil/StEpdGeom.h"
 #include "StRoot/StEpdUtil/StEpdEpFinder.h"
 #include "StRoot/StEpdUtil/StEpdEpInfo.h"
+#include "EpdHitBuffer.h"
+#include "PicoTrackColumns.h"
+#include "PicoEventCuts.h"
+#include "PicoTagIndex.h"
+#include "PicoFlowSkim.h"
+#include "PicoQvector.h"
+#include "PicoShardManifest.h"
+#include "PicoSkipLog.h"
+#include "PicoEventPipeline.h"
+#include "PicoAnalysisModule.h"
+#include "PicoAllocCounter.h"
+#include "PicoRandom.h"
+#include "PicoEpKernels.h"
+#include "PicoEpBatch.h"
+#include "PicoWatchFolder.h"
+#include "PicoStageCache.h"
+#include "PicoNextFile.h"
+#include "PicoEpdTileTable.h"
 
 // Define global constants
 // const Int_t daynumber     = 6;
@@ -88,18 +123,407 @@ const Double_t _y_mid = -2.03; // mid rapidity
 // const Int_t order         = 20;
 // const Int_t twoorder      = 2 * order;
 Double_t GetPsi(Double_t Qx, Double_t Qy, Int_t order);
+struct PicoReadTrace;
+struct PicoReadTotals;
+
+// Run options of PicoAnalyzer(), given as a comma separated list, e.g. "threads=8,block=5000"
+struct PicoAnalyzerOptions {
+  Int_t    nThreads;  // threads=N : # of event loop workers, each with its own reader and histograms
+  Long64_t blockSize; // block=N   : # of entries a worker takes from the chain at a time
+  Bool_t   lazyRead;  // lazy=1    : read the Event branch first, the other branches only after the event cuts
+  UInt_t   randomSeed;   // seed=N     : key of the rotation background random numbers, see PicoRandom.h
+  TString  traceFile;    // trace=FILE : writes the read profile of the analysis to FILE, see TraceReadProfile()
+  Long64_t traceEntries; // tracen=N   : # of entries the event loop of trace=FILE reads
+  TString  profileFile;  // profile=FILE : read profile, disables the branches and leaves listed in FILE
+  std::vector<TString> disabledBranches; // from the read profile, applied after the default SetStatus
+  Double_t profileBaseBytes; // bytes per event read by the trace run, without the profile, 0 = unknown
+  PicoReadTrace  *readTrace;  // of trace=FILE, NULL = no trace
+  PicoReadTotals *readTotals; // bytes and events read by the event loops of the job, NULL = not counted
+  Long64_t cacheSize;         // cache=MB   : TTreeCache size for the branches read by the analysis, 0 = ROOT default
+  Int_t    cacheLearnEntries; // learn=N    : # of entries of the TTreeCache learning phase
+  Bool_t   asyncPrefetch;     // prefetch=1 : asynchronous prefetching of the cached baskets
+  TString  tagFile;           // tags=FILE  : event tag index of TagIndexBuilder.cxx, read only the entries passing the event cuts
+  TEntryList *entryList;      // from the tag index, NULL = whole chain
+  TString  skimFile;          // skim=FILE  : write the flow skim of the picoDst to FILE instead of running the analysis
+  Bool_t   skimInput;         // input=skim : inFile is a flow skim (or a list of them), see PicoFlowSkim.h
+  Bool_t   qvectorTree;       // qvec=1     : write the raw Q-vectors of every good event to Qvector_OUTPUT_, see PicoQvector.h
+  Long64_t firstEntry;        // first=N    : first event to read (of the entry list, if any)
+  Long64_t lastEntry;         // last=N     : last event to read, included, -1 = to the end
+  TString  manifestFile;      // manifest=FILE : shard manifest of ShardFileList.cxx, read the work units of job=N only
+  Int_t    shardJob;          // job=N
+  Long64_t checkpointEvents;  // checkpoint=N : every N events, snapshot the serial event loop and resume from it, 0 = off
+  Bool_t   skipBad;           // skipbad=1  : log and skip unreadable entries and files instead of ending the event loop
+  Int_t    pipelineDepth;     // pipeline=N : read the events ahead on a producer thread, N events at most, 0 = off
+  TString  watchDir;          // watch=DIR  : streaming mode, analyse the picoDst files of DIR as they are written
+  Int_t    watchSettle;       // settle=S   : a file of DIR not modified for S seconds is complete
+  Int_t    publishSeconds;    // publish=S  : publish the histograms every S seconds in streaming mode
+  TString  publishDir;        // publishdir=DIR : where they are published
+  PicoWatchFolder *watchFolder; // of watch=DIR, NULL = no streaming
+  TString  stageDir;          // stage=DIR  : copy the next input files to the local DIR ahead of reading them
+  Double_t stageGB;           // stagegb=G  : disk budget of DIR in GB
+  Int_t    stageAhead;        // stageahead=N : # of files staged after the one being read
+  PicoStageCache *stageCache; // of stage=DIR, shared by the workers, NULL = no staging
+  Bool_t   openAhead;         // openahead=1 : open the next file of the chain on a thread while the current one is read
+  PicoNextFileOpener *nextFileOpener; // of openahead=1, shared by the workers, NULL = off
+  Int_t    epBatchSize;       // epbatch=N : correct the event planes of N events at a time (PicoEpBatch.h), needs pipeline, 0 = off
+  Bool_t   epBatchCheck;      // epcheck=1 : check the event planes of the blocks against the event by event correction
+  PicoAnalyzerOptions() : nThreads(1), blockSize(2000), lazyRead(kFALSE), randomSeed(0), traceEntries(1000),
+                          profileBaseBytes(0), readTrace(NULL), readTotals(NULL),
+                          cacheSize(0), cacheLearnEntries(100), asyncPrefetch(kFALSE), entryList(NULL), skimInput(kFALSE),
+                          qvectorTree(kFALSE), firstEntry(0), lastEntry(-1), shardJob(0), checkpointEvents(0),
+                          skipBad(kFALSE), pipelineDepth(0), watchSettle(60), publishSeconds(300), publishDir("published"),
+                          watchFolder(NULL), stageGB(50), stageAhead(2), stageCache(NULL),
+                          openAhead(kFALSE), nextFileOpener(NULL), epBatchSize(0), epBatchCheck(kFALSE) {}
+};
+PicoAnalyzerOptions ParseAnalyzerOptions(TString options);
+void AnalyzerEventRange(const PicoAnalyzerOptions *opt, Long64_t events2read, Long64_t &first, Long64_t &end);
+void SetAnalyzerBranchStatus(StPicoDstReader *picoReader, const PicoAnalyzerOptions *opt);
+
+// Hands out consecutive blocks of chain entries to the event loop workers
+struct PicoEntryQueue {
+  std::atomic<Long64_t> mNext;
+  Long64_t mEnd; // one past the last entry to read
+  Long64_t mBlockSize;
+  PicoEntryQueue(Long64_t first, Long64_t end, Long64_t blockSize) : mNext(first), mEnd(end), mBlockSize(blockSize) {}
+  Bool_t Take(Long64_t &first, Long64_t &end){
+    first = mNext.fetch_add(mBlockSize);
+    if(first >= mEnd) return kFALSE;
+    end = std::min(first + mBlockSize, mEnd);
+    return kTRUE;
+  }
+  // watch=DIR: the chain has grown to end entries after the queue ran out (serial job)
+  void Extend(Long64_t end){
+    mNext = mEnd;
+    mBlockSize = std::max(end - mEnd, (Long64_t)1);
+    mEnd = end;
+  }
+};
+
+// Two-stage read of a chain entry: the Event branch alone, then the remaining enabled
+// branches only for the events passing the event cuts
+struct PicoLazyReader {
+  TChain *mChain;
+  Int_t   mTreeNumber; // tree of the chain the branch pointers belong to
+  TBranch *mEventBranch;
+  std::vector<TBranch*> mOtherBranches;
+  Long64_t mLocalEntry;
+  Long64_t mNEventReads, mNFullReads; // bookkeeping for the end-of-job summary
+  Long64_t mEventBytes, mOtherBytes;
+  PicoLazyReader(TChain *chain) : mChain(chain), mTreeNumber(-1), mEventBranch(NULL), mLocalEntry(-1),
+                                  mNEventReads(0), mNFullReads(0), mEventBytes(0), mOtherBytes(0) {}
+  Bool_t ReadEvent(Long64_t entry);
+  Bool_t ReadOthers();
+  void   Print() const;
+};
+
+// TTreeCache of the chain and its read statistics, file by file
+void SetupAnalyzerCache(TChain *chain, const PicoAnalyzerOptions *opt);
+struct PicoCacheMonitor {
+  Int_t    mTreeNumber;
+  TString  mFileName;       // the original name of a staged copy
+  PicoStageCache *mStageCache; // of stage=DIR, NULL = no staging
+  Long64_t mFileBytes;      // bytes read from the current file so far
+  Int_t    mFileReadCalls;  // read calls on the current file so far
+  Long64_t mFileCacheBytes, mFileMissBytes; // read through the TTreeCache of the current file / missing it
+  Int_t    mFileCacheCalls, mFileMissCalls;
+  Int_t    mNFiles;
+  Long64_t mTotalBytes;
+  Int_t    mTotalReadCalls;
+  Long64_t mTotalCacheBytes, mTotalMissBytes;
+  Int_t    mTotalCacheCalls, mTotalMissCalls;
+  PicoCacheMonitor() : mTreeNumber(-1), mStageCache(NULL), mFileBytes(0), mFileReadCalls(0), mFileCacheBytes(0), mFileMissBytes(0),
+                       mFileCacheCalls(0), mFileMissCalls(0), mNFiles(0), mTotalBytes(0), mTotalReadCalls(0),
+                       mTotalCacheBytes(0), mTotalMissBytes(0), mTotalCacheCalls(0), mTotalMissCalls(0) {}
+  void Update(TChain *chain);
+  void EndFile();
+  void Print(TChain *chain);
+};
+// Branches and leaves read by the event loop of trace=FILE: a (sub)branch is read once it
+// holds an entry. Collected before the reader leaves a tree and at the end of the loop.
+struct PicoReadTrace {
+  std::set<std::string> mEnabled; // switched on when collected
+  std::set<std::string> mRead;
+  std::vector<std::string> mOrder; // as they are first enabled, for the profile
+  std::map<std::string,std::string> mParentOf; // branch of a sub-branch
+  void Collect(TTree *tree) { if(tree) Collect(tree->GetListOfBranches()); }
+  void Collect(TObjArray *branches);
+};
+// Bytes read from the input files, events read and the waits at the file boundaries,
+// summed over the event loops of the job
+struct PicoReadTotals {
+  std::mutex mMutex;
+  Long64_t   mBytes, mEvents;
+  Int_t      mTreeLoads;        // LoadTree() calls that entered the next file of a reader
+  Double_t   mTreeLoadSeconds;  // the readers waited for them
+  PicoReadTotals() : mBytes(0), mEvents(0), mTreeLoads(0), mTreeLoadSeconds(0) {}
+  void Add(Long64_t bytes, Long64_t events, Int_t treeLoads, Double_t treeLoadSeconds){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBytes  += bytes;
+    mEvents += events;
+    mTreeLoads       += treeLoads;
+    mTreeLoadSeconds += treeLoadSeconds;
+  }
+};
+// One event of the chain into the event, track and EPD buffers, for the event loop or the
+// producer thread of pipeline=N. Read() returns PicoEventRecord::kRead or the PicoSkipLog reason.
+struct PicoEventReader {
+  TChain            *mChain;
+  TClonesArray      *mPicoEvent;   // picoDst input
+  PicoFlowSkimEntry *mSkimEntry;   // skim input
+  TEntryList        *mEntryList;   // NULL = the chain entries
+  PicoLazyReader    *mLazyReader;  // NULL = read the whole entry
+  PicoCacheMonitor  *mCacheMonitor;// NULL = no cache statistics
+  PicoStageCache    *mStageCache;  // NULL = no staging
+  PicoNextFileOpener *mNextFile;   // NULL = no opening ahead
+  PicoReadTrace     *mReadTrace;   // NULL = no trace
+  Int_t              mTreeNumber;  // tree of the last entry read, -2 = none yet
+  Long64_t mBytesRead, mFileBytes; // of the files done / of the current file, up to the last entry
+  Long64_t mEventsRead;
+  Int_t    mTreeLoads;       // of a next file, the first file of the reader is not counted
+  Double_t mTreeLoadSeconds;
+  PicoEventInfo     *mInfo;
+  PicoTrackColumns  *mTracks;
+  EpdHitBuffer      *mEpdHits;
+  Long64_t mBadFileFirst, mBadFileEnd; // chain entries of a file that can not be opened
+  PicoEventReader() : mChain(NULL), mPicoEvent(NULL), mSkimEntry(NULL), mEntryList(NULL), mLazyReader(NULL), mCacheMonitor(NULL),
+                      mStageCache(NULL), mNextFile(NULL), mReadTrace(NULL), mTreeNumber(-2), mBytesRead(0), mFileBytes(0),
+                      mEventsRead(0), mTreeLoads(0), mTreeLoadSeconds(0), mInfo(NULL), mTracks(NULL), mEpdHits(NULL), mBadFileFirst(0), mBadFileEnd(0) {}
+  Int_t Read(Long64_t iEvent, Long64_t &iEntry);
+  void  EndEntry(); // takes the reads of the last entry, the lazy reader reads after Read()
+};
+void PicoEventProducer(PicoEventReader *reader, PicoEntryQueue *entryQueue, PicoRecordQueue *records);
+TFile* OpenAnalyzerOutput(const TString &name, Int_t workerId);
+void KeepPartialOutput(TFile *file);
+// Snapshot of the serial event loop in <output name>.checkpoint.root: the histograms of the
+// three output files, the cut counters, the skipped entries and the next event to read.
+// A job started again with the same arguments continues from it, with the same output.
+struct PicoCheckpoint {
+  static const Int_t kNEvtcut = 5; // mEvtcut
+  static const Int_t kNTrkcut = 6; // mTrkcut
+  TString  mFileName;
+  TString  mSignature;      // arguments of the job, a snapshot of another job is not used
+  Long64_t mNextEvent;      // of the snapshot found by Open()
+  Long64_t mQvectorEntries; // entries of the Q-vector tree at the snapshot, -1 = no tree
+  TString  mFileList;       // watch=DIR: list of the chain files, saved with the snapshot, "" = fixed input
+  PicoCheckpoint(const TString &fileName, const TString &signature) : mFileName(fileName), mSignature(signature),
+                                                                      mNextEvent(-1), mQvectorEntries(-1) {}
+  TString FileListText() const;
+  Bool_t Open();
+  Bool_t Write(Long64_t nextEvent, TFile **outputs, const int *evtcut, const int *trkcut, TTree *qvectorTree,
+               const PicoSkipLog &skipLog);
+  Bool_t Restore(TFile **outputs, int *evtcut, int *trkcut, PicoSkipLog &skipLog);
+  void   Remove();
+};
+Bool_t MergeWorkerOutputs(const std::vector<TFile*> &outputs, const TString &mergedName);
+// Read profile: which branches and leaves of the picoDst the event loop reads
+Bool_t TraceReadProfile(const Char_t *inFile, TString outFile, Int_t inputp1, Int_t inputp2, Int_t inputp3, Int_t inputp4,
+                        const PicoAnalyzerOptions &opt);
+Bool_t LoadReadProfile(const TString &profileFile, std::vector<TString> &disabledBranches, Double_t &baseBytes);
+void PrintReadBytes(const PicoAnalyzerOptions &opt);
+TEntryList* LoadTagEntryList(const Char_t *inFile, const TString &tagFile, Int_t sys_cutN, Int_t sys_varN);
+TEntryList* LoadShardEntryList(const Char_t *inFile, const TString &manifestFile, Int_t job);
+Bool_t WriteFlowSkim(const Char_t *inFile, const PicoAnalyzerOptions &opt);
+Bool_t PicoAnalyzerWorker(const Char_t *inFile, TString outFile,
+                        Int_t inputp1, Int_t inputp2, Int_t inputp3, Int_t inputp4,
+                        const PicoAnalyzerOptions *opt, Int_t workerId,
+                        PicoEntryQueue *entryQueue, TFile **workerOutput);
+std::mutex gReaderInitMutex; // StPicoDstReader::Init() sets the static StPicoDst arrays
 
 //////////////////////////////// Main Function /////////////////////////////////
-void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/files/PicoDst/st_physics_16140033_raw_0000002.picoDst.root",
+// kFALSE if the job failed: its outputs are not written, or only as <output>.partial
+Bool_t PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/files/PicoDst/st_physics_16140033_raw_0000002.picoDst.root",
                       TString outFile = "test_EpdEP",
                       Int_t   inputp1 = 1, // event plane orders: 1st, 2nd order \psi
                       Int_t   inputp2 = 0, // sysErr cut Indexes 0-15
                       Int_t   inputp3 = 0, // sysErr cut variations, each systematic check has 2 or 3 vertions
-                      Int_t   inputp4 = 0 // Iteration of the analysis is. In this analysis, 2 iterations is enough
+                      Int_t   inputp4 = 0, // Iteration of the analysis is. In this analysis, 2 iterations is enough
+                      TString options = "" // run options, see ParseAnalyzerOptions()
                     )
 {
+  PicoAnalyzerOptions opt = ParseAnalyzerOptions(options);
+  PicoEpKernels epKernels;
+  if(!PicoEpKernels::ForOrder<_EpTermsMaxIni>(inputp1, epKernels)){
+    std::cout << "Event plane order " << inputp1 << " is not supported, only 1, 2 and 3 (see PicoEpKernels.h)" << std::endl;
+    return kFALSE;
+  }
+  if(opt.asyncPrefetch) gEnv->SetValue("TFile.AsyncPrefetching", 1); // before any cache is created
+  TString watchList; // files of the watch folder at start-up, replaces inFile
+  if(!opt.watchDir.IsNull()){
+    if(!opt.skimFile.IsNull() || opt.skimInput || !opt.traceFile.IsNull() || !opt.tagFile.IsNull() || !opt.manifestFile.IsNull()
+       || opt.firstEntry > 0 || opt.lastEntry >= 0){
+      std::cout << "watch analyses the picoDst files of " << opt.watchDir << " as they come, it can not be combined with "
+                << "skim, input=skim, trace, tags, manifest, first and last" << std::endl;
+      return kFALSE;
+    }
+    if(opt.nThreads > 1 || opt.pipelineDepth > 0){
+      std::cout << "watch runs the serial event loop, threads and pipeline are ignored" << std::endl;
+      opt.nThreads = 1;
+      opt.pipelineDepth = 0;
+    }
+    watchList = outFile + ".watch.list";
+    opt.watchFolder = new PicoWatchFolder(opt.watchDir, opt.publishDir, opt.watchSettle, opt.publishSeconds, watchList);
+    std::vector<TString> files;
+    if(opt.checkpointEvents > 0 && opt.watchFolder->ReadList(files)){ // the chain of the checkpoint, new files are added later
+      std::cout << "Watch folder: resuming with the " << files.size() << " files of " << watchList << std::endl;
+    } else {
+      std::cout << "Waiting for complete picoDst files in " << opt.watchDir << std::endl;
+      if(!opt.watchFolder->WaitForFiles(files, std::function<void()>())){
+        delete opt.watchFolder;
+        return kFALSE;
+      }
+      opt.watchFolder->WriteList(files, kFALSE);
+    }
+    inFile = watchList.Data();
+  }
+  if(!opt.skimFile.IsNull()){ // skim only
+    return WriteFlowSkim(inFile, opt);
+  }
+  if(opt.skimInput){ // the skim has neither the picoDst branches nor its entries
+    if(!opt.traceFile.IsNull() || !opt.profileFile.IsNull() || !opt.tagFile.IsNull() || !opt.manifestFile.IsNull() || opt.lazyRead){
+      std::cout << "input=skim: trace, profile, tags, manifest and lazy are picoDst options and are ignored" << std::endl;
+    }
+    opt.traceFile = "";
+    opt.profileFile = "";
+    opt.tagFile = "";
+    opt.manifestFile = "";
+    opt.lazyRead = kFALSE;
+  }
+  TString shardList; // file list of the shard job, replaces inFile
+  if(!opt.manifestFile.IsNull()){
+    shardList = ShardJobListName(opt.manifestFile, opt.shardJob);
+    std::cout << "Shard job " << opt.shardJob << " of " << opt.manifestFile << ": reading " << shardList << std::endl;
+    inFile = shardList.Data();
+    if(!opt.tagFile.IsNull()){
+      std::cout << "tags can not be combined with manifest and is ignored" << std::endl;
+      opt.tagFile = "";
+    }
+  }
+  if(!opt.traceFile.IsNull()){ // read profile only
+    return TraceReadProfile(inFile, outFile, inputp1, inputp2, inputp3, inputp4, opt);
+  }
+  if(!opt.profileFile.IsNull()){
+    if(!LoadReadProfile(opt.profileFile, opt.disabledBranches, opt.profileBaseBytes)) return kFALSE;
+  }
+  if(!opt.tagFile.IsNull()) opt.entryList = LoadTagEntryList(inFile, opt.tagFile, inputp2, inputp3);
+  if(!opt.manifestFile.IsNull()){
+    opt.entryList = LoadShardEntryList(inFile, opt.manifestFile, opt.shardJob);
+    if(!opt.entryList) return kFALSE; // the whole list would repeat the work of other jobs
+  }
+  if(!opt.stageDir.IsNull()){
+    ROOT::EnableThreadSafety(); // the staging thread opens files while the event loop reads
+    opt.stageCache = new PicoStageCache(opt.stageDir, (Long64_t)(opt.stageGB*1024*1024*1024), opt.stageAhead);
+  }
+  if(opt.openAhead){
+    ROOT::EnableThreadSafety(); // the opening thread reads file headers while the event loop reads
+    opt.nextFileOpener = new PicoNextFileOpener();
+  }
+  if(opt.pipelineDepth > 0){
+    if(opt.lazyRead) std::cout << "lazy is ignored with pipeline, the producer thread reads whole events" << std::endl;
+    opt.lazyRead = kFALSE;
+    ROOT::EnableThreadSafety(); // the producer threads read while the event loops fill
+  }
+  if(opt.epBatchSize > 0 && opt.pipelineDepth <= 0){ // the records of a block are taken from the pipeline
+    std::cout << "epbatch needs pipeline=N and is ignored" << std::endl;
+    opt.epBatchSize = 0;
+  }
+  if(opt.epBatchSize > 0 && opt.checkpointEvents > 0){ // the events of an open block are neither done nor to be read again
+    std::cout << "checkpoint can not be combined with epbatch and is ignored" << std::endl;
+    opt.checkpointEvents = 0;
+  }
+  if(opt.checkpointEvents > 0 && opt.nThreads > 1){ // the blocks of the workers have no single resume point
+    std::cout << "checkpoint is only done by the serial event loop and is ignored with threads=" << opt.nThreads << std::endl;
+    opt.checkpointEvents = 0;
+  }
+  PicoReadTotals readTotals;
+  opt.readTotals = &readTotals;
+  if(opt.nThreads <= 1){ // serial event loop, writes the output files directly
+    Bool_t complete = PicoAnalyzerWorker(inFile, outFile, inputp1, inputp2, inputp3, inputp4, &opt, -1, NULL, NULL);
+    PrintReadBytes(opt);
+    delete opt.watchFolder;
+    if(opt.stageCache) opt.stageCache->Print();
+    delete opt.stageCache;
+    if(opt.nextFileOpener) opt.nextFileOpener->Print();
+    delete opt.nextFileOpener;
+    return complete;
+  }
+  // ------------------- Multithreaded event loop ---------------------------------
+  // Each worker owns a StPicoDstReader and a full set of histograms in memory files,
+  // and takes blocks of entries from a shared queue. The histograms are merged at the end.
+  ROOT::EnableThreadSafety();
+  Long64_t events2read = 0;
+  if(opt.skimInput){
+    TChain *countChain = MakeFlowSkimChain(inFile);
+    events2read = countChain->GetEntries();
+    delete countChain;
+  } else {
+    std::lock_guard<std::mutex> lock(gReaderInitMutex);
+    StPicoDstReader* countReader = new StPicoDstReader(inFile);
+    countReader->Init();
+    if(countReader->chain()) events2read = countReader->chain()->GetEntries();
+    if(opt.entryList) events2read = opt.entryList->GetN();
+    delete countReader;
+  }
+  Long64_t firstEvent, endEvent;
+  AnalyzerEventRange(&opt, events2read, firstEvent, endEvent);
+  std::cout << "Number of events to read: " << endEvent - firstEvent << " with " << opt.nThreads << " threads" << std::endl;
+  PicoEntryQueue entryQueue(firstEvent, endEvent, opt.blockSize);
+  std::vector<TFile*> workerOutput(3*opt.nThreads, (TFile*)NULL);
+  std::vector<Char_t> workerComplete(opt.nThreads, 0);
+  std::vector<std::thread> workers;
+  for(int iWorker=0; iWorker<opt.nThreads; iWorker++){
+    workers.push_back(std::thread([&, iWorker](){
+      workerComplete[iWorker] = PicoAnalyzerWorker(inFile, outFile, inputp1, inputp2, inputp3, inputp4,
+                                                   &opt, iWorker, &entryQueue, &workerOutput[3*iWorker]);
+    }));
+  }
+  Bool_t complete = kTRUE; // every worker finished its event loop
+  for(unsigned int iWorker=0; iWorker<workers.size(); iWorker++){
+    workers[iWorker].join();
+    if(!workerComplete[iWorker]){
+      std::cout << "Worker " << iWorker << " did not finish its event loop" << std::endl;
+      complete = kFALSE;
+    }
+  }
+  PrintReadBytes(opt);
+  if(opt.stageCache) opt.stageCache->Print();
+  delete opt.stageCache;
+  if(opt.nextFileOpener) opt.nextFileOpener->Print();
+  delete opt.nextFileOpener;
+  // (.picoDst.result.root, EpCorrection_OUTPUT_, PhiMesonAna_OUTPUT_)
+  for(int iOutput=0; iOutput<3; iOutput++){
+    std::vector<TFile*> outputs;
+    for(int iWorker=0; iWorker<opt.nThreads; iWorker++){
+      if(workerOutput[3*iWorker+iOutput]) outputs.push_back(workerOutput[3*iWorker+iOutput]);
+    }
+    if(outputs.empty()){
+      complete = kFALSE;
+      continue;
+    }
+    TString mergedName = outputs[0]->GetName();
+    if(!complete) mergedName += ".partial"; // not taken for the output of a finished job
+    std::cout << "Merging " << outputs.size() << " worker outputs into " << mergedName << std::endl;
+    if(!MergeWorkerOutputs(outputs, mergedName)){
+      std::cout << "Error: the worker outputs can not be merged, " << mergedName << " is not written" << std::endl;
+      complete = kFALSE;
+    }
+    for(unsigned int i=0; i<outputs.size(); i++) delete outputs[i];
+  }
+  return complete;
+}
+
+//////////////////////////////// Event loop worker /////////////////////////////////
+// workerId < 0: serial job. Otherwise the histograms stay in memory files that are handed
+// back through workerOutput[3] for merging, and entries are taken from entryQueue.
+// kFALSE if the event loop did not finish: the serial job writes its outputs as .partial.
+Bool_t PicoAnalyzerWorker(const Char_t *inFile, TString outFile,
+                        Int_t inputp1, Int_t inputp2, Int_t inputp3, Int_t inputp4,
+                        const PicoAnalyzerOptions *opt, Int_t workerId,
+                        PicoEntryQueue *entryQueue, TFile **workerOutput)
+{
 
   Int_t EpOrder = inputp1; // Event plane Fourier expansion order = 1, 2, 3
+  PicoEpKernels ep; // Q-vector, GetPsi and shift code specialized on EpOrder, checked in PicoAnalyzer()
+  PicoEpKernels::ForOrder<_EpTermsMaxIni>(EpOrder, ep);
   Int_t sys_cutN = inputp2; // sysErr cut Indexes 0-15
   Int_t sys_varN = inputp3; // sysErr cut variations, each systematic check has 2 or 3 vertions
   Int_t sys_iterN = inputp4; // Iteration of the analysis is. In this analysis, 2 iterations is enough
@@ -122,24 +546,33 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   // Set transverse momentum range
   Int_t ptBins = 15; Double_t ptLow = 0.0; Double_t ptHigh = 3.0;
   // (0) ================== Read input files and set status =====================
-  StPicoDstReader* picoReader = new StPicoDstReader(inFile);
-  picoReader->Init();
-  std::cout << "Explicit read status for some branches" << std::endl;
-  picoReader->SetStatus("*",0);
-  picoReader->SetStatus("Event",1);
-  picoReader->SetStatus("Track",1);
-  picoReader->SetStatus("BTofHit",1);
-  picoReader->SetStatus("BTofPidTraits",1);
-  picoReader->SetStatus("EpdHit",1);
+  StPicoDstReader* picoReader = NULL;
+  TChain *mPicoDst = NULL;
+  if(opt->skimInput){ // flow skim of WriteFlowSkim(), see PicoFlowSkim.h
+    mPicoDst = MakeFlowSkimChain(inFile);
+  } else {
+    {
+      std::lock_guard<std::mutex> lock(gReaderInitMutex);
+      picoReader = new StPicoDstReader(inFile);
+      picoReader->Init();
+    }
+    std::cout << "Explicit read status for some branches" << std::endl;
+    SetAnalyzerBranchStatus(picoReader, opt);
+    mPicoDst = picoReader->chain();
+  }
 
-  if( !picoReader->chain() ) {
+  if( !mPicoDst ) {
       std::cout << "No chain has been found." << std::endl;
+      delete picoReader;
+      return kFALSE;
   }
 
-  Long64_t eventsInTree = picoReader->tree()->GetEntries();
-  std::cout << "eventsInTree: "  << eventsInTree << std::endl;
+  if(picoReader){
+    Long64_t eventsInTree = picoReader->tree()->GetEntries();
+    std::cout << "eventsInTree: "  << eventsInTree << std::endl;
+  }
   // ------------------ Get event numbers from TChain --------------------------------
-  Long64_t events2read = picoReader->chain()->GetEntries();
+  Long64_t events2read = mPicoDst->GetEntries();
   std::cout << "Number of events to read: " << events2read << std::endl;
 
   // (1) ================= Set up EPD EP info to get EPD event plane ============
@@ -147,6 +580,11 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   // EpdEpOutputName += outFile;
   // EpdEpOutputName += ".root";
   StEpdGeom *mEpdGeom = new StEpdGeom();
+  PicoEpdTileTable epdTiles; // tile centers, see PicoEpdTileTable.h
+  epdTiles.Load(mEpdGeom);
+  delete mEpdGeom;
+  std::vector<Double_t> epdEta(EpdHitBuffer::kMaxHits), epdPhi(EpdHitBuffer::kMaxHits); // of the EPD hits of the event
+  std::vector<Double_t> epdCos(EpdHitBuffer::kMaxHits), epdSin(EpdHitBuffer::kMaxHits); // cos(EpOrder*phi), sin(EpOrder*phi)
   Double_t mThresh = 0.3; // EPD EP by hand
   Double_t mMax = 2.0; // EPD EP by hand
   Double_t etaRange[_nEventTypeBins] = {-5.0,-4.4,-4.35,-3.95,-2.60}; // EPD eta range to set 4 sub EPD EP -5.0,-4.4,-4.35,-3.95,-2.60
@@ -179,6 +617,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     }
   }
   TH2D wt("Order1etaWeight","Order1etaWeight",500,1.5,6.5,5,0,5);
+  wt.SetDirectory(0);
   for (int ix=1; ix<501; ix++){
     for (int iy=1; iy<6; iy++){
       double eta = wt.GetXaxis()->GetBinCenter(ix);
@@ -243,6 +682,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   double lin[9] =        {-0.000479872,-0.000468419,-0.000698331,-0.00136243,-0.00227147,-0.00314487,-0.00381054,-0.00416527,-0.00382669};
   double cub[9] =        {0.000453689,0.000550043,0.00072002,0.00100187,0.00129868,0.00160751,0.0018985,0.00218509,0.00234319};
   TH2D *v1WtaWt = new TH2D("v1WtaWt","v1WtaWt",200,-6.5,-1.5,_Ncentralities,0.5,0.5+_Ncentralities);
+  v1WtaWt->SetDirectory(0);
   for (int ix=1; ix<201; ix++){
     for (int iy=1; iy<10; iy++){
       double eta = v1WtaWt->GetXaxis()->GetBinCenter(ix);
@@ -256,16 +696,39 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     }
   }
 
-  TClonesArray * mEpdHits = new TClonesArray("StPicoEpdHit");
-  unsigned int found;
-  // --------------------- Retrieve EpdHits TClonesArray ----------------------------
-  TChain *mPicoDst = picoReader->chain();
-  mPicoDst->SetBranchStatus("EpdHit*",1,&found);   // note you need the asterisk
-  std::cout << "EpdHit Branch returned found= " << found << std::endl; // ? What is the EpdHit branch ? Check it on StRoot.
-  mPicoDst->SetBranchAddress("EpdHit",&mEpdHits);
+  // --------------------- Retrieve EpdHits into flat arrays ----------------------------
+  EpdHitBuffer epdHits(mPicoDst); // leaves are bound per tree, see EpdHitBuffer::Update()
+  // ------------- Event TClonesArray of this reader ---------------------------------
+  // StPicoDst accessors are static and shared by every reader, so read through own arrays
+  TClonesArray * mPicoEvent = NULL;
+  if(!opt->skimInput){
+    mPicoEvent = new TClonesArray("StPicoEvent");
+    mPicoDst->SetBranchAddress("Event",&mPicoEvent);
+  }
+  PicoEventInfo eventInfo; // event quantities of the current entry, from StPicoEvent or the skim
+  // ------------- Track columns with the BTofPidTraits beta joined -------------------
+  PicoTrackColumns tracks(mPicoDst); // leaves are bound per tree, see PicoTrackColumns::Update()
+  // ------------- Flow skim entry, unpacked into the same columns ------------------
+  PicoFlowSkimEntry skimEntry;
+  if(opt->skimInput) skimEntry.SetAddress(mPicoDst);
+  // ------------- Entries passing the event cuts, from the tag index -----------------
+  TEntryList *mEntryList = NULL;
+  if(opt->entryList){
+    {
+      std::lock_guard<std::mutex> lock(gReaderInitMutex);
+      mEntryList = new TEntryList(*opt->entryList); // the chain takes over its list
+    }
+    mPicoDst->SetEntryList(mEntryList);
+    events2read = mEntryList->GetN();
+    std::cout << "Number of events to read from the tag index: " << events2read << std::endl;
+  }
+  PicoLazyReader lazyReader(mPicoDst);
+  // ------------- TTreeCache for the branches the analysis reads ------------------
+  if(opt->cacheSize > 0) SetupAnalyzerCache(mPicoDst, opt);
+  PicoCacheMonitor cacheMonitor;
   // (2) ================ Output files and histograms ==========================
   outFile.Append(".picoDst.result.root");
-  TFile *outputFile = new TFile(outFile,"recreate");
+  TFile *outputFile = OpenAnalyzerOutput(outFile,workerId);
   // ------------------- Event cuts QA histograms ------------------------------
   TH1D *hist_runId = new TH1D("hist_runId","Event runId",20001,-0.5,20000.5);
   TH1D *hist_eventCuts = new TH1D("hist_eventCuts","# of Events after cuts",10,-0.5,9.5);
@@ -488,7 +951,62 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   // "Shift correction" histograms that we produce and OUTPUT
   TString EpOutputNameIni = "EpCorrection_OUTPUT_";
   EpOutputNameIni += outFile;
-  TFile* mCorrectionOutputFile = new TFile(EpOutputNameIni,"RECREATE");
+  TFile* mCorrectionOutputFile = OpenAnalyzerOutput(EpOutputNameIni,workerId);
+  // Raw Q-vectors per event for QvectorCalib.cxx, one file per worker thread
+  TFile *mQvectorOutputFile = NULL;
+  TTree *mQvectorTree = NULL;
+  PicoQvectorRecord qvector;
+  // ------------- Checkpoint of the serial event loop, see PicoCheckpoint ----------------
+  Bool_t useCheckpoint = (opt->checkpointEvents > 0 && workerId < 0);
+  Long64_t signatureEntries = (opt->watchFolder) ? -1 : events2read; // watch: the chain grows, its file list is checked
+  PicoCheckpoint checkpoint(TString(outFile).ReplaceAll(".picoDst.result.root",".checkpoint.root"),
+                            TString::Format("%s %s %d %d %d %d %lld %lld %lld %d %d %s %s %u", inFile, outFile.Data(),
+                                            inputp1, inputp2, inputp3, inputp4, signatureEntries, opt->firstEntry, opt->lastEntry,
+                                            (int)opt->skimInput, (int)opt->qvectorTree, opt->tagFile.Data(), opt->profileFile.Data(),
+                                            opt->randomSeed));
+  if(opt->watchFolder) checkpoint.mFileList = opt->watchFolder->mListFile;
+  Bool_t resumeCheckpoint = useCheckpoint && checkpoint.Open();
+  if(opt->qvectorTree){
+    TString QvecOutputName = "Qvector_OUTPUT_";
+    QvecOutputName += outFile;
+    if(workerId >= 0) QvecOutputName.ReplaceAll(".root",Form("_worker%d.root",workerId));
+    if(resumeCheckpoint){ // go on with the tree as saved with the snapshot
+      mQvectorOutputFile = new TFile(QvecOutputName,"UPDATE");
+      mQvectorTree = (TTree*)mQvectorOutputFile->Get("Qvector");
+      if(mQvectorTree && mQvectorTree->GetEntries() > checkpoint.mQvectorEntries){
+        // saved after the last snapshot, before its checkpoint file was in place: the entries
+        // from the snapshot on are analysed again, so only the first ones are kept
+        std::cout << QvecOutputName << ": " << mQvectorTree->GetEntries() - checkpoint.mQvectorEntries
+                  << " entries after the checkpoint are removed" << std::endl;
+        qvector.SetAddress(mQvectorTree);
+        TTree *kept = mQvectorTree->CloneTree(0);
+        kept->SetName("QvectorKept"); // not removed with the old tree below
+        for(Long64_t iEntry=0; iEntry<checkpoint.mQvectorEntries; iEntry++){
+          mQvectorTree->GetEntry(iEntry);
+          kept->Fill();
+        }
+        delete mQvectorTree;
+        mQvectorOutputFile->Delete("Qvector;*");
+        kept->SetName("Qvector");
+        mQvectorTree = kept;
+      }
+      if(mQvectorTree && mQvectorTree->GetEntries() == checkpoint.mQvectorEntries){
+        qvector.SetAddress(mQvectorTree);
+      } else {
+        std::cout << QvecOutputName << " does not match the checkpoint, the job starts over" << std::endl;
+        delete mQvectorOutputFile;
+        mQvectorTree = NULL;
+        resumeCheckpoint = kFALSE;
+      }
+    }
+    if(!mQvectorTree){
+      mQvectorOutputFile = new TFile(QvecOutputName,"RECREATE");
+      mQvectorTree = new TTree("Qvector","Raw EPD east and TPC Q-vectors, see PicoQvector.h");
+      qvector.Branch(mQvectorTree);
+    }
+    if(useCheckpoint) mQvectorTree->SetAutoSave(0); // the tree header is only saved with the snapshots
+    mCorrectionOutputFile->cd(); // the histograms below belong to the correction output
+  }
   TProfile2D *mEpdRecenterOutput[_nEventTypeBins]; // EPD EP output, x/y, centrality
   TProfile2D *mTpcRecenterOutput[_nEventTypeBins_tpc]; // TPC EP output, x/y, centrality
   TProfile2D *mEpdShiftOutput_sin[_nEventTypeBins], *mEpdShiftOutput_cos[_nEventTypeBins]; // EPD EP output
@@ -595,7 +1113,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   double centSetB[10]  = {0, 5, 10, 20, 30, 40, 50, 60, 70, 80}; // %
   TString PhiOutputName = "PhiMesonAna_OUTPUT_";
   PhiOutputName += outFile;
-  TFile* PhiMesonAnaOutputFile = new TFile(PhiOutputName,"RECREATE");
+  TFile* PhiMesonAnaOutputFile = OpenAnalyzerOutput(PhiOutputName,workerId);
   TH1D * hist_dip_angle = new TH1D("hist_dip_angle","hist_dip_angle",1000,-1,1.0);
   TH1D * hist_mother_decay_length = new TH1D("hist_mother_decay_length","hist_mother_decay_length",1000,-1.0,4.0);
   TH1D * hist_SE_mass_Phi     = new TH1D("hist_SE_mass_Phi","Same event invariant mass",200,0.9,1.1);
@@ -1031,57 +1549,72 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     }
   }
   // gRandom->SetSeed((unsigned) time(0));
-  gRandom = new TRandom3(0);
+  std::vector<Double_t> rotationRandom; // of the K+K- pairs of the event, from (seed, runId, eventId, pair), see PicoRandom.h
+  rotationRandom.reserve(10000);
   // ------------------ EPD & TPC event plane ab intio Correlations histograms ----------------------------------
-  // (3) =========================== Event loop ====================================
-  for(Long64_t iEvent=0; iEvent<events2read; iEvent++)
-  {
-    // ---------------------- Event reading quality assurance ----------------------
-    if((iEvent+1)%100 == 0) {
-      // gRandom->SetSeed((unsigned)1 /*time(0)+iEvent*/);
-      // gRandom = new TRandom3(0);
-      std::cout << "Working on event #[" << (iEvent+1)<< "/" << events2read << "]" << std::endl;
-    }
-    Bool_t readEvent = picoReader->readPicoEvent(iEvent);
-    if( !readEvent ) {
-        std::cout << "Something went wrong, my Lord! Nothing to analyze..."
-        << std::endl;
-        break;
-    }
-    StPicoDst     *dst = picoReader->picoDst();
-    StPicoEvent *event = dst->event();
-    if( !event ) {
-        std::cout << "Something went wrong, my Lord! Event is hiding from me..."
-        << std::endl;
-        break;
-    }
+  // Buffers of the event loop, reused by every event so the analysis does not allocate
+  std::vector<Int_t> vGoodTracks;               // indices of good tracks for TPC event plane Q-vector loop
+  std::vector<Int_t> v_Proton_tracks;           // Proton tracks for proton v1 analysis
+  std::vector<Int_t> v_KaonPlus_tracks;         // kaon tracks for phi meson analysis
+  std::vector<Int_t> v_KaonPlus_tracks_flexTOF;
+  std::vector<Int_t> v_KaonMinus_tracks;
+  std::vector<Int_t> v_KaonMinus_tracks_flexTOF;
+  std::vector<Int_t>* trackLists[] = {&vGoodTracks, &v_Proton_tracks, &v_KaonPlus_tracks, &v_KaonPlus_tracks_flexTOF,
+                                      &v_KaonMinus_tracks, &v_KaonMinus_tracks_flexTOF};
+  for(unsigned int i=0; i<sizeof(trackLists)/sizeof(trackLists[0]); i++) trackLists[i]->reserve(PicoTrackColumns::kMaxTracks);
+  // EPD-3 sub-event without the hit itself, by position in vEpdSubHits
+  std::vector<Int_t> vEpdSubHits;    // EPD-3 hits, in hit order
+  vEpdSubHits.reserve(EpdHitBuffer::kMaxHits);
+  std::vector<Double_t> QvctrEpdSubX(EpdHitBuffer::kMaxHits), QvctrEpdSubY(EpdHitBuffer::kMaxHits);
+  std::vector<Double_t> PsiRawEpdSub(EpdHitBuffer::kMaxHits);
+  std::vector<Double_t> PsiShiftedEpdSub(EpdHitBuffer::kMaxHits);
+  // phi, cos(EpOrder*phi), sin(EpOrder*phi) of the good tracks, by position in vGoodTracks
+  std::vector<Double_t> tpcPhi(PicoTrackColumns::kMaxTracks), tpcCos(PicoTrackColumns::kMaxTracks), tpcSin(PicoTrackColumns::kMaxTracks);
+  Long64_t iEntry = -1;          // of the chain, of the current event
+  Bool_t   tracksLost = kFALSE;  // the tracks of the event can not be read, the event loop ends
+  PicoAllocCounter allocCounter; // with PICO_COUNT_ALLOCS, see PicoAllocCounter.h
+  PicoSkipLog skipLog; // entries skipped with skipbad=1
+  // EPD east sub-events of the event, [EPD eta range 0-4], filled by epdEventPlane
+  Int_t    N_Epd_east[_nEventTypeBins];      //Count # of hits in each eta region
+  Double_t QrawEastSide[_nEventTypeBins][2]; /// indices: [etaBin][x,y]
+  Double_t PsiEastRaw[_nEventTypeBins];
+  Double_t PsiEastShifted[_nEventTypeBins];
+  // TPC sub-events of the event, [TPC eta range 0-1], filled by tpcQvector and tpcEventPlane
+  Int_t    NTpcAll[_nEventTypeBins_tpc];
+  Double_t QrawTpcAll[_nEventTypeBins_tpc][2]; /// indices:[TPCetaRange] [x,y]
+  Double_t PsiTpcAllRaw[_nEventTypeBins_tpc];
+  Double_t PsiTpcAllShifted[_nEventTypeBins_tpc];
+  // Event planes of the events of a block, epbatch=N, read by the event plane stages at products.epBlockEvent
+  PicoEpSubBlock<_EpTermsMaxIni> epdBlock[_nEventTypeBins], tpcBlock[_nEventTypeBins_tpc];
+  // ------------------ Stages and observable modules, see PicoAnalysisModule.h --------------------------
+  PicoModuleChain modules;
+  // (4) - (8) ================ Shared stages of the event ================================
+  modules.AddStage("eventSelector", {}, {"event"}, [&](PicoEventProducts &ev){
+    const PicoEventInfo &eventInfo = *ev.eventInfo;
     mEvtcut[0]++;// No event cut yet
     // (4) =================== Get event parameters ================================
-    Int_t runId       = event->runId();
-    Int_t nTracks     = dst->numberOfTracks();
+    Int_t runId       = eventInfo.runId;
 
-    const Float_t   f_MagField = event->bField(); // Magnetic field
+    const Float_t   f_MagField = eventInfo.bField; // Magnetic field
     Double_t Day      = (Double_t)runId - 19151028.0; // a day bin
     hist_runId->Fill(Day);
 
-    Double_t primaryVertex_X    = (Double_t)event->primaryVertex().X();
-    Double_t primaryVertex_Y    = (Double_t)event->primaryVertex().Y();
-    Double_t primaryVertex_Z    = (Double_t)event->primaryVertex().Z();
-    Double_t primaryVertex_perp = (Double_t)event->primaryVertex().Perp();
+    Double_t primaryVertex_X    = (Double_t)eventInfo.primaryVertex.X();
+    Double_t primaryVertex_Y    = (Double_t)eventInfo.primaryVertex.Y();
+    Double_t primaryVertex_Z    = (Double_t)eventInfo.primaryVertex.Z();
+    Double_t primaryVertex_perp = (Double_t)eventInfo.primaryVertex.Perp();
     hist_Vz_pri  ->Fill(primaryVertex_Z);
     hist_VyVx_pri->Fill(primaryVertex_X,primaryVertex_Y);
     hist_Vr_pri  ->Fill(primaryVertex_perp);
 
     // ---------------------- trigger selection ---------------------------------
-    std::vector <unsigned int> triggerIDs;
-    triggerIDs.clear();
-    triggerIDs      = event->triggerIds();
+    const std::vector <unsigned int> &triggerIDs = eventInfo.triggerIds;
     bool b_bad_trig = true;
     for(unsigned int i=0; i < triggerIDs.size(); i++)
       {
         Double_t d_trigger = (Double_t)triggerIDs[i] - 620050.0;
         hist_triggerID->Fill(d_trigger);
-        if(triggerIDs[i] == 630052) b_bad_trig = false; // bbce_tofmult1 7.2GeV
+        if(triggerIDs[i] == _goodTriggerId) b_bad_trig = false; // bbce_tofmult1 7.2GeV
       }
 
     // --------------------------- Vertex cut -----------------------------------
@@ -1089,65 +1622,67 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     double      d_xvtx  = -9999.0;
     double      d_yvtx  = -9999.0;
     double  d_vtx_perp  = -9999.0;
-    TVector3       pVtx = event->primaryVertex();
+    TVector3       pVtx = eventInfo.primaryVertex;
     d_zvtx     = pVtx.z();
     d_xvtx     = pVtx.x();
     d_yvtx     = pVtx.y();
     d_vtx_perp = pVtx.Perp();
-    bool b_bad_zvtx   =  ((d_zvtx < 198.0) || (d_zvtx > 202.0)); //FXT_26p5_2018
-    // # Systematic Analysis
-    // sys_cutN == 3; // vz
-    if(sys_cutN == 3){
-      if(sys_varN == 1){
-        b_bad_zvtx   =  ((d_zvtx < 198.4) || (d_zvtx > 201.6));
-      } else if(sys_varN == 2){
-        b_bad_zvtx   =  ((d_zvtx < 197.6) || (d_zvtx > 202.4));
-      }
-    }
+    bool b_bad_zvtx   =  IsBadZVertex(d_zvtx, sys_cutN, sys_varN); //FXT_26p5_2018, see PicoEventCuts.h
     bool b_bad_xvtx   =  ((d_xvtx < -1.0) || (d_xvtx > 1.0)); //FXT_26p5_2018
     bool b_bad_yvtx   =  ((d_yvtx < -3.0) || (d_yvtx > -0.5)); //FXT_26p5_2018
-    bool b_bad_rvtx   =   sqrt(pow(d_xvtx,2)+pow(d_yvtx+2,2))> 2.0;
-    // # Systematic Analysis
-    // sys_cutN == 4; // vr
-    if(sys_cutN == 4){
-      if(sys_varN == 1){
-        b_bad_rvtx   =   sqrt(pow(d_xvtx,2)+pow(d_yvtx+2,2))> 1.6;
-      } else if(sys_varN == 2){
-        b_bad_rvtx   =   sqrt(pow(d_xvtx,2)+pow(d_yvtx+2,2))> 2.4;
-      }
-    }
+    bool b_bad_rvtx   =   IsBadRVertex(VertexR(d_xvtx, d_yvtx), sys_cutN, sys_varN);
     bool b_bad_evt  = b_bad_zvtx || b_bad_trig /*|| b_bad_xvtx || b_bad_yvtx */|| b_bad_rvtx;
-    if(b_bad_evt) continue;
+    if(b_bad_evt) return kFALSE;
+    ev.runId  = runId;
+    ev.vertex = pVtx;
+    ev.bField = f_MagField;
+    return kTRUE;
+  });
+  modules.AddStage("trackPreprocessor", {"event"}, {"tracks","centrality"}, [&](PicoEventProducts &ev){
+    const PicoEventInfo &eventInfo = *ev.eventInfo;
+    Double_t primaryVertex_X    = ev.vertex.X();
+    Double_t primaryVertex_Y    = ev.vertex.Y();
+    Double_t primaryVertex_Z    = ev.vertex.Z();
+    Double_t primaryVertex_perp = ev.vertex.Perp();
+    if(opt->lazyRead && !lazyReader.ReadOthers()) {
+        if(opt->skipBad){ // already in the pre-cut QA histograms
+          skipLog.Add(mPicoDst, iEntry, PicoSkipLog::kReadError);
+          return kFALSE;
+        }
+        std::cout << "Something went wrong, my Lord! Tracks are hiding from me..."
+        << std::endl;
+        tracksLost = kTRUE;
+        return kFALSE;
+    }
+    allocCounter.Begin(); // the whole entry is read, or unpacked from the pipeline
+    tracks.Decode(primaryVertex_X, primaryVertex_Y, primaryVertex_Z);
+    Int_t nTracks     = tracks.nTracks;
+    epdHits.Decode();
     hist_Vz_cut->Fill(primaryVertex_Z);
     hist_Vr_cut->Fill(primaryVertex_perp);
     hist_VyVx_cut->Fill(primaryVertex_X,primaryVertex_Y);
     mEvtcut[1]++; // 1. vertex event cut
 
-    Int_t  refMult = event->refMult(); // refMult
-    Int_t grefMult = event->grefMult();
-    Int_t  tofMult =(Int_t)event->nBTOFMatch();
+    Int_t  refMult = eventInfo.refMult; // refMult
+    Int_t grefMult = eventInfo.grefMult;
+    Int_t  tofMult = eventInfo.nBTOFMatch;
     // (5) =============== Track loop to determine good tracks =================
     int nGoodTracks = 0;
     int nFXTMult = 0;
-    std::vector<StPicoTrack *> vGoodTracks; // vector of good tracks for TPC event plane Q-vector loop
+    vGoodTracks.clear();
     for(Int_t iTrk=0; iTrk<nTracks; iTrk++){
-      StPicoTrack *picoTrack = dst->track(iTrk);
       mTrkcut[0]++; // 0. No track cut
-      if(!picoTrack) continue;
       mTrkcut[1]++; // 1. pico track cut
-      StPicoBTofPidTraits *trait = NULL;
       // ----------------------- Physics values of tracks --------------------------
-      double        tofBeta    = -999.;
-      if(picoTrack->isTofTrack()) trait = dst->btofPidTraits( picoTrack->bTofPidTraitsIndex() );
-      if(trait)        tofBeta = trait->btofBeta();
-      double d_px  = picoTrack->pMom().x();
-      double d_py  = picoTrack->pMom().y();
-      double d_pz  = picoTrack->pMom().z();
-      double d_pT  = picoTrack->pPt();
+      double        tofBeta    = tracks.tofBeta[iTrk];
+      double d_px  = tracks.pMomX[iTrk];
+      double d_py  = tracks.pMomY[iTrk];
+      double d_pz  = tracks.pMomZ[iTrk];
+      double d_pT  = tracks.pt[iTrk];
       double d_mom = sqrt(d_pT*d_pT + d_pz*d_pz);
       double mass2 = d_mom*d_mom*((1.0/(tofBeta*tofBeta))-1.0);
-      Double_t eta = picoTrack->pMom().Eta();
-      Double_t phi    = picoTrack->pMom().Phi();
+      Double_t eta = tracks.eta[iTrk];
+      Double_t phi    = tracks.phi[iTrk];
       if(phi < 0.0            ) phi += 2.0*TMath::Pi();
       if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
       // --------------- QA plots before major track cuts ----------------------
@@ -1158,59 +1693,59 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       hist_mass2->Fill(mass2);
       hist_eta  ->Fill(eta);
       hist_phi  ->Fill(phi);
-      hist_ratio->Fill(((double)picoTrack->nHitsFit() / (double)picoTrack->nHitsPoss()));
-      hist_nHits->Fill((double)picoTrack->nHitsFit());
-      hist_ndEdx->Fill(picoTrack->nHitsDedx());
-      hist_DCA  ->Fill(picoTrack->gDCA(primaryVertex_X,primaryVertex_Y,primaryVertex_Z));
+      hist_ratio->Fill(((double)tracks.nHitsFit[iTrk] / (double)tracks.nHitsPoss[iTrk]));
+      hist_nHits->Fill((double)tracks.nHitsFit[iTrk]);
+      hist_ndEdx->Fill(tracks.nHitsDedx[iTrk]);
+      hist_DCA  ->Fill(tracks.gDCA[iTrk]);
 
-      if(!picoTrack->isPrimary()) continue;
+      if(!tracks.isPrimary[iTrk]) continue;
       nFXTMult++;
       mTrkcut[2]++; // 2. Primary track cut
-      bool    b_bad_dEdx     = (picoTrack->nHitsDedx() <= 0);
+      bool    b_bad_dEdx     = (tracks.nHitsDedx[iTrk] <= 0);
       // # Systematic Analysis
       // sys_cutN == 5; // dedx
       if(sys_cutN == 5){
         if(sys_varN == 1){
-          b_bad_dEdx     = (picoTrack->nHitsDedx() <= 10);
+          b_bad_dEdx     = (tracks.nHitsDedx[iTrk] <= 10);
         } else if(sys_varN == 2){
-          b_bad_dEdx     = (picoTrack->nHitsDedx() <= 20);
+          b_bad_dEdx     = (tracks.nHitsDedx[iTrk] <= 20);
         }
       }
-      bool    b_bad_DCA      = (picoTrack->gDCA(primaryVertex_X,primaryVertex_Y,primaryVertex_Z) >= 3.0);
+      bool    b_bad_DCA      = (tracks.gDCA[iTrk] >= 3.0);
       // # Systematic Analysis
       // sys_cutN == 6; // dca
       if(sys_cutN == 6){
         if(sys_varN == 1){
-          b_bad_DCA      = (picoTrack->gDCA(primaryVertex_X,primaryVertex_Y,primaryVertex_Z) >= 1.0);
+          b_bad_DCA      = (tracks.gDCA[iTrk] >= 1.0);
         } else if(sys_varN == 2){
           b_bad_dEdx     = false; // no DCA cut
         }
       }
-      bool b_not_enough_hits = ((double)picoTrack->nHitsFit()) < 15;
+      bool b_not_enough_hits = ((double)tracks.nHitsFit[iTrk]) < 15;
       // # Systematic Analysis
       // sys_cutN == 7; // nHitsFit
       if(sys_cutN == 7){
         if(sys_varN == 1){
-          b_not_enough_hits = ((double)picoTrack->nHitsFit()) < 10;
+          b_not_enough_hits = ((double)tracks.nHitsFit[iTrk]) < 10;
         } else if(sys_varN == 2){
-          b_not_enough_hits = ((double)picoTrack->nHitsFit()) < 20;
+          b_not_enough_hits = ((double)tracks.nHitsFit[iTrk]) < 20;
         }
       }
-      bool    b_bad_tracking = (((double)picoTrack->nHitsFit() / (double)picoTrack->nHitsPoss()) < 0.51);
+      bool    b_bad_tracking = (((double)tracks.nHitsFit[iTrk] / (double)tracks.nHitsPoss[iTrk]) < 0.51);
       // # Systematic Analysis
       // sys_cutN == 8; // ratio
       if(sys_cutN == 8){
         if(sys_varN == 1){
-          b_bad_tracking = (((double)picoTrack->nHitsFit() / (double)picoTrack->nHitsPoss()) < 0.45);
+          b_bad_tracking = (((double)tracks.nHitsFit[iTrk] / (double)tracks.nHitsPoss[iTrk]) < 0.45);
         } else if(sys_varN == 2){
-          b_bad_tracking = (((double)picoTrack->nHitsFit() / (double)picoTrack->nHitsPoss()) < 0.55);
+          b_bad_tracking = (((double)tracks.nHitsFit[iTrk] / (double)tracks.nHitsPoss[iTrk]) < 0.55);
         }
       }
       bool    b_bad_track    = b_bad_dEdx || b_bad_tracking || b_not_enough_hits || b_bad_DCA;
       if(b_bad_track) continue;
       mTrkcut[3]++; // 3. Bad track cuts
       nGoodTracks++; // nGoodTracks is used to determine centrality later in the event loop
-      vGoodTracks.push_back(picoTrack);
+      vGoodTracks.push_back(iTrk);
       // --------------- QA plots after major track cuts ----------------------
       hist_px_py_cut->Fill(d_px,d_py);
       hist_pz_cut   ->Fill(d_pz);
@@ -1219,10 +1754,10 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       hist_mass2_cut->Fill(mass2);
       hist_eta_cut  ->Fill(eta);
       hist_phi_cut  ->Fill(phi);
-      hist_ratio_cut->Fill(((double)picoTrack->nHitsFit() / (double)picoTrack->nHitsPoss()));
-      hist_nHits_cut->Fill((double)picoTrack->nHitsFit());
-      hist_ndEdx_cut->Fill(picoTrack->nHitsDedx());
-      hist_DCA_cut  ->Fill(picoTrack->gDCA(primaryVertex_X,primaryVertex_Y,primaryVertex_Z));
+      hist_ratio_cut->Fill(((double)tracks.nHitsFit[iTrk] / (double)tracks.nHitsPoss[iTrk]));
+      hist_nHits_cut->Fill((double)tracks.nHitsFit[iTrk]);
+      hist_ndEdx_cut->Fill(tracks.nHitsDedx[iTrk]);
+      hist_DCA_cut  ->Fill(tracks.gDCA[iTrk]);
       if(tofBeta == -999) continue;
       mTrkcut[4]++; // 4. Bad tof track cut, to see how many tracks with tof information
     } // Track loop to determine good tracks
@@ -1230,66 +1765,66 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       hist_trackCuts->SetBinContent(i+1,mTrkcut[i]);
     }
     // (6) ================ Centrality definition ===============================
-    Int_t centrality = 0;
-    bool a_b_cent[9]={false};
     // Int_t cenSection[9]={11,22,37,57,82,113,151,174,245};//10,17,28,41,57,77,100,127,160,245 version 0 cent
-    Int_t cenSection[9]={6,12,22,39,64,100,154,191,241}; // From UC Davis, cut on nFXTMult
-    bool b_pileup   = (nFXTMult >= 241);
-    bool b_low_mult = (nFXTMult < 2);
-    a_b_cent[0]     = (nFXTMult >= cenSection[7] && nFXTMult < cenSection[8]); // 0 - 5%, 240 - 191
-    a_b_cent[1]     = (nFXTMult >= cenSection[6] && nFXTMult < cenSection[7]); // 5 - 10%, 190 - 154
-    a_b_cent[2]     = (nFXTMult >= cenSection[5] && nFXTMult < cenSection[6]); // 10 - 20%, 153 - 100
-    a_b_cent[3]     = (nFXTMult >= cenSection[4]  && nFXTMult < cenSection[5]); // 20 - 30%, 99 - 64
-    a_b_cent[4]     = (nFXTMult >= cenSection[3]  && nFXTMult < cenSection[4]); // 30 - 40%, 63 - 39
-    a_b_cent[5]     = (nFXTMult >= cenSection[2]  && nFXTMult < cenSection[3]); // 40 - 50%, 38 - 22
-    a_b_cent[6]     = (nFXTMult >= cenSection[1]  && nFXTMult < cenSection[2]); // 50 - 60%, 21 - 12
-    a_b_cent[7]     = (nFXTMult >= cenSection[0]  && nFXTMult < cenSection[1]); // 60 - 70%, 11 - 6
-    a_b_cent[8]     = (nFXTMult >= 2  && nFXTMult < cenSection[0]); // 70 - 80% 5 - 2
-    for(int i=0;i<_Ncentralities;i++){
-      if(a_b_cent[i]) centrality = i+1;
-    }
+    // cenSection[9]={6,12,22,39,64,100,154,191,241} From UC Davis, cut on nFXTMult, see PicoEventCuts.h
+    bool b_pileup   = IsPileUp(nFXTMult);
+    bool b_low_mult = IsLowMult(nFXTMult);
+    Int_t centrality = FXTMultCentrality(nFXTMult); // 1: 0 - 5%, 240 - 191 ... 9: 70 - 80% 5 - 2
     hist_cent->Fill(centrality);
     hist_realTrackMult->Fill(nGoodTracks);
     hist_FXTTrackMult->Fill(nFXTMult);
     hist_FXTTrackMult_refmult->Fill(nFXTMult,refMult);
     hist_FXTTrackMult_grefmult->Fill(nFXTMult,grefMult);
     hist_FXTTrackMult_tofmult->Fill(nFXTMult,tofMult);
-    if(b_pileup||b_low_mult) continue; //Pile/lowMult cut
+    if(b_pileup||b_low_mult) return kFALSE; //Pile/lowMult cut
     mEvtcut[2]++; // 2. Pile Up event cut
-
+    ev.centrality = centrality;
+    return kTRUE;
+  });
+  modules.AddStage("epdQvector", {"tracks","centrality"}, {"epdQ"}, [&](PicoEventProducts &ev){
+    const EpdHitBuffer &epdHits = *ev.epdHits;
+    const Int_t centrality = ev.centrality;
     // (7) ================ EPD event plane ====================================
     // (7.1) ------------- EPD ep from Mike Lisa's class StEpdEpFinder // removed due to redundancy
     // (7.2) ------------------- EPD EP by hand ---------------------------------
     // refer to Mike's StEpdEpFinder and Yang's BBC Ep
-    Int_t N_Epd_east[5]={0}; //Count # of hits in each eta region /// indices: [etaBin]
-    Double_t QrawEastSide[5][2]={0};       /// indices: [etaBin][x,y]
-    Double_t QrecenterEastSide[5][2]={0};       /// indices: [etaBin][x,y]
+    if((Int_t)epdEta.size() < epdHits.nHits){ // by EPD hit index, as the hit buffer
+      epdEta.resize(epdHits.nHits);
+      epdPhi.resize(epdHits.nHits);
+      epdCos.resize(epdHits.nHits);
+      epdSin.resize(epdHits.nHits);
+      QvctrEpdSubX.resize(epdHits.nHits);
+      QvctrEpdSubY.resize(epdHits.nHits);
+      PsiRawEpdSub.resize(epdHits.nHits);
+      PsiShiftedEpdSub.resize(epdHits.nHits);
+    }
+    epdTiles.EtaPhi(epdHits, ev.vertex, &epdEta[0], &epdPhi[0]);
+    ev.epdEta = &epdEta[0];
+    ev.epdPhi = &epdPhi[0];
+    ep.harmonics(epdHits.nHits, &epdPhi[0], &epdCos[0], &epdSin[0]); // once per hit, the loops below use them
+    for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){ // the sub-events handed on in the products
+      N_Epd_east[EventTypeId]      = 0;
+      QrawEastSide[EventTypeId][0] = 0.0;
+      QrawEastSide[EventTypeId][1] = 0.0;
+    }
     // Double_t QphiWeightedEastSide[5][2]={0};       /// indices: [etaBin][x,y]
-    Double_t PsiEastRaw[5]={-999.0,-999.0,-999.0,-999.0,-999.0};           /// indices: [etaBin]
-    Double_t PsiEastRecenter[5]={-999.0,-999.0,-999.0,-999.0,-999.0};           /// indices: [etaBin]
-    // Double_t PsiEastPhiWeighted[5]={-999.0,-999.0,-999.0,-999.0,-999.0};       /// indices: [etaBin]
-    Double_t PsiEastShifted[5]={-999.0,-999.0,-999.0,-999.0,-999.0};       /// indices: [etaBin]
-    for (int iEpdHit = 0; iEpdHit < mEpdHits->GetEntries(); iEpdHit++){
-      StPicoEpdHit* epdHit = (StPicoEpdHit*)((*mEpdHits)[iEpdHit]);
+    for (int iEpdHit = 0; iEpdHit < epdHits.nHits; iEpdHit++){
       int tileId,ring,TT,PP,EW,ADC;
       float nMip;
-    	tileId = epdHit->id();
-    	EW = (tileId<0)?0:1;
+    	tileId = epdHits.id[iEpdHit];
+    	EW = epdHits.ew[iEpdHit];
       if(EW!=0) continue; // EPD east event plane needed
-    	ring = epdHit->row();
-    	TT = epdHit->tile();
-    	PP = epdHit->position();
-    	ADC = epdHit->adc();
-    	nMip = epdHit->nMIP();   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
+    	ring = epdHits.ring[iEpdHit];
+    	TT = epdHits.tile[iEpdHit];
+    	PP = epdHits.position[iEpdHit];
+    	ADC = epdHits.adc[iEpdHit];
+    	nMip = epdHits.nMip[iEpdHit];   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
       //      nMip = (TT<10)?(double)ADC/160.0:(double)ADC/115.0;
       if(PP==1 && TT==1) hist_nMip->Fill(nMip);
       if (nMip<mThresh) continue;
       double TileWeight = (nMip<mMax)?nMip:mMax;
-      TVector3 StraightLine = mEpdGeom->TileCenter(tileId) - event->primaryVertex();
-      double phi = StraightLine.Phi();
-      double eta = StraightLine.Eta();
-      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
-      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      double phi = epdPhi[iEpdHit]; // TileCenter(tileId) - primary vertex, 0 to 2pi
+      double eta = epdEta[iEpdHit];
       hist_Epdeta->Fill(eta);
       hist_Epdphi->Fill(phi);
       profile2D_PpVsEta->Fill(eta,PP,TileWeight);
@@ -1328,8 +1863,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           std::cout<<"Centality is "<<centrality<<"\t"<< "eta : " << eta<<"\t"<<"eta weighting: " << v1EtaWeight << std::endl;
         }
         if(etaWeight>0.0) N_Epd_east[EventTypeId]++;
-        double Cosine = cos(phi*(double)EpOrder);
-        double Sine   = sin(phi*(double)EpOrder);
+        double Cosine = epdCos[iEpdHit], Sine = epdSin[iEpdHit];
         QrawEastSide[EventTypeId][0] += etaWeight * v1EtaWeight * TileWeight * Cosine;
         QrawEastSide[EventTypeId][1] += etaWeight * v1EtaWeight * TileWeight * Sine;
 
@@ -1354,201 +1888,72 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     }
 
     // To remove autocorrelation in EPD-3, calculate Qvector for each epd hit in EPD-3: -5.16 <= eta < -3.82
-    std::map<int,TVector2> mpQvctrEpdSub;
-    for (int iEpdHit = 0; iEpdHit < mEpdHits->GetEntries(); iEpdHit++){
-      StPicoEpdHit* epdHit = (StPicoEpdHit*)((*mEpdHits)[iEpdHit]);
+    vEpdSubHits.clear();
+    for (int iEpdHit = 0; iEpdHit < epdHits.nHits; iEpdHit++){
       int tileId,ring,TT,PP,EW,ADC;
       float nMip;
-      tileId = epdHit->id();
-      EW = (tileId<0)?0:1;
+      tileId = epdHits.id[iEpdHit];
+      EW = epdHits.ew[iEpdHit];
       if(EW!=0) continue; // EPD east event plane needed
-      ring = epdHit->row();
-      TT = epdHit->tile();
-      PP = epdHit->position();
-      ADC = epdHit->adc();
-      nMip = epdHit->nMIP();   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
+      ring = epdHits.ring[iEpdHit];
+      TT = epdHits.tile[iEpdHit];
+      PP = epdHits.position[iEpdHit];
+      ADC = epdHits.adc[iEpdHit];
+      nMip = epdHits.nMip[iEpdHit];   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
       //      nMip = (TT<10)?(double)ADC/160.0:(double)ADC/115.0;
       if (nMip<mThresh) continue;
       double TileWeight = (nMip<mMax)?nMip:mMax;
-      TVector3 StraightLine = mEpdGeom->TileCenter(tileId) - event->primaryVertex();
-      double phi = StraightLine.Phi();
-      double eta = StraightLine.Eta();
-      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
-      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      double phi = epdPhi[iEpdHit]; // TileCenter(tileId) - primary vertex, 0 to 2pi
+      double eta = epdEta[iEpdHit];
       //--------------------------------
       // now calculate Q-vectors for each hit in EPD-3
       //--------------------------------
       if(eta>=etaRange[2] && eta < etaRange[3]){ // EPD-3
         double QxEpdSub, QyEpdSub;
-        TVector2 Qvec;
-        double Cosine = cos(phi*(double)EpOrder);
-        double Sine   = sin(phi*(double)EpOrder);
+        double Cosine = epdCos[iEpdHit], Sine = epdSin[iEpdHit];
         QxEpdSub = QrawEastSide[3][0] + TileWeight * Cosine; // Since QrawEastSide[EventTypeId][xy] already times -1.0, here shoud "+ Qx_i" to remove autocorrelation
         QyEpdSub = QrawEastSide[3][1] + TileWeight * Sine; // Since QrawEastSide[EventTypeId][xy] already times -1.0, here should "+ Qy_i" to remove autocorrelation
-        Qvec=TVector2(QxEpdSub,QyEpdSub);
-
-        mpQvctrEpdSub.insert(pair<int, TVector2>(iEpdHit, Qvec));
+        QvctrEpdSubX[vEpdSubHits.size()] = QxEpdSub;
+        QvctrEpdSubY[vEpdSubHits.size()] = QyEpdSub;
+        vEpdSubHits.push_back(iEpdHit);
       }
     } // loop over EPD hits
-    //Print out the map and fill the PsiRawEpdSub map
-    std::map<int, TVector2>::iterator itr;
-    // std::cout << "\nThe map mpPsiRawEpdSub is : \n";
-    // cout << "\tKEY\tELEMENT\n";
-    std::map<int,double> mpPsiRawEpdSub;
-    for (itr = mpQvctrEpdSub.begin(); itr != mpQvctrEpdSub.end(); itr++) { // insert a map of key: iEpdHit, value: PsiRawEpdSub
-        // std::cout << '\t' << itr->first
-        //      << '\t' << (double)(itr->second).X()
-        //      << '\t' << (double)(itr->second).Y() << '\n';
-        if(N_Epd_east[3]<5) continue; // EPD-3
-        Double_t PsiRawEpdSub;
-        if(QrawEastSide[3][0] || QrawEastSide[3][1] ){ // EPD-3
-          PsiRawEpdSub = GetPsi((double)(itr->second).X(),(double)(itr->second).Y(),EpOrder);
-          mpPsiRawEpdSub.insert(pair<int, double>(itr->first, PsiRawEpdSub));
-          hist_Epd_Sub_psi_raw_ini->Fill(PsiRawEpdSub);
-          // std::cout << '\t' << itr->first
-          //      << '\t' << PsiRawEpdSub << '\n';
-        }
-    }
-    // std::cout << std::endl;
-    //---------------------------------
-    // Calculate unshifted EP angles
-    //---------------------------------
-    // for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
-    //   if(N_Epd_east[EventTypeId]<5) continue;
-    //   if(QrawEastSide[EventTypeId][0] || QrawEastSide[EventTypeId][1] ){
-    //     PsiEastRaw[EventTypeId] = GetPsi(QrawEastSide[EventTypeId][0],QrawEastSide[EventTypeId][1],EpOrder);
-    //     // PsiEastPhiWeighted[EventTypeId] = GetPsi(QphiWeightedEastSide[EventTypeId][0],QphiWeightedEastSide[EventTypeId][1],EpOrder);
-    //   }
-    // }
-    for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
-      if(N_Epd_east[EventTypeId]<5) continue;
-      if(QrawEastSide[EventTypeId][0] || QrawEastSide[EventTypeId][1] )
-      {
-        PsiEastRaw[EventTypeId] = GetPsi(QrawEastSide[EventTypeId][0],QrawEastSide[EventTypeId][1],EpOrder);
-        if(PsiEastRaw[EventTypeId]!=-999.0){
-          hist2_Epd_east_Qy_Qx_raw_ini[EventTypeId]->Fill(QrawEastSide[EventTypeId][0],QrawEastSide[EventTypeId][1]);
-          hist_Epd_east_psi_raw_ini[EventTypeId]->Fill(PsiEastRaw[EventTypeId]);
-          // hist_Epd_east_psi_Weighted_ini[EventTypeId]->Fill(PsiEastPhiWeighted[EventTypeId]);
-        } else {
-          cout << "PsiEastRaw  " << EventTypeId << " = " << PsiEastRaw[EventTypeId]<<endl;
-          cout << "Qx raw  " << EventTypeId << " = " << QrawEastSide[EventTypeId][0]<<endl;
-          cout << "Qy raw  " << EventTypeId << " = " << QrawEastSide[EventTypeId][1]<<endl;
-        }
-        // recenter corrections
-        if(mEpdRecenterInput[EventTypeId]==0){
-          QrecenterEastSide[EventTypeId][0] = QrawEastSide[EventTypeId][0];
-          QrecenterEastSide[EventTypeId][1] = QrawEastSide[EventTypeId][1];
-        } else {
-          QrecenterEastSide[EventTypeId][0] = QrawEastSide[EventTypeId][0] - mEpdRecenterInput[EventTypeId]->GetBinContent(1,centrality);
-          QrecenterEastSide[EventTypeId][1] = QrawEastSide[EventTypeId][1] - mEpdRecenterInput[EventTypeId]->GetBinContent(2,centrality);
-        }
-        PsiEastRecenter[EventTypeId] = GetPsi(QrecenterEastSide[EventTypeId][0],QrecenterEastSide[EventTypeId][1],EpOrder);
-        if(PsiEastRaw[EventTypeId]!=-999.0){
-          hist2_Epd_east_Qy_Qx_rec_ini[EventTypeId]->Fill(QrecenterEastSide[EventTypeId][0],QrecenterEastSide[EventTypeId][1]);
-          hist_Epd_east_psi_recenter_ini[EventTypeId]->Fill(PsiEastRecenter[EventTypeId]);
-          // cout << "Psi_raw = " << PsiEastRaw[EventTypeId] << endl;
-          // cout << "Psi_rec = " << PsiEastRecenter[EventTypeId] << endl;
-          // hist_Epd_east_psi_Weighted_ini[EventTypeId]->Fill(PsiEastPhiWeighted[EventTypeId]);
-          // -------------------- "recenter correction histograms Output" ----------------
-          // -------------------- "calculate recenter histograms for a future run" ----------------
-          // Fill the recenter plots for next run
-          mEpdRecenterOutput[EventTypeId]->Fill(1,centrality,QrawEastSide[EventTypeId][0]);
-          mEpdRecenterOutput[EventTypeId]->Fill(2,centrality,QrawEastSide[EventTypeId][1]);
-        }
-        // cout << "QrawEastSide Qx"<<EventTypeId <<" = " << QrawEastSide[EventTypeId][0] << endl;
-        // cout << "QrawEastSide Qy"<< EventTypeId <<" = " << QrawEastSide[EventTypeId][1] << endl;
-        // mEpdRecenterOutput[EventTypeId]->Fill(1,centrality,QrawEastSide[EventTypeId][0]);
-        // mEpdRecenterOutput[EventTypeId]->Fill(2,centrality,QrawEastSide[EventTypeId][1]);
-      }
-    }
-    // --------------------------- " Do the SHIFT thing " ------------------------
-    // Fill the PsiShiftedEpdSub map: Key: iEpdHit, value: PsiShiftedEpdSub
-    std::map<int, double>::iterator itr1;
-    // std::cout << "\nThe map mpPsiShiftedEpdSub is : \n";
-    // cout << "\tKEY\tELEMENT\n";
-    std::map<int,double> mpPsiShiftedEpdSub;
-    for (itr1 = mpPsiRawEpdSub.begin(); itr1 != mpPsiRawEpdSub.end(); itr1++) { // insert a map of key: iEpdHit, value: PsiRawEpdSub
-        Double_t PsiRawEpdSub = (double)itr1->second ;
-        Double_t PsiShiftedEpdSub = PsiRawEpdSub ;
-        if(PsiShiftedEpdSub==-999.0) continue;
-        if (mEpdShiftInput_sin[3] != 0 && mEpdShiftInput_cos[3]!= 0){
-          if(QrawEastSide[3][0] || QrawEastSide[3][1] ){
-            for (int i=1; i<=_EpTermsMaxIni; i++){
-          	  double tmp = (double)(EpOrder*i);
-              double sinAve = mEpdShiftInput_sin[3]->GetBinContent(i,centrality);
-          	  double cosAve = mEpdShiftInput_cos[3]->GetBinContent(i,centrality);
-          	  PsiShiftedEpdSub +=
-          	    2.0*(cosAve*sin(tmp*PsiRawEpdSub) - sinAve*cos(tmp*PsiRawEpdSub))/tmp; // use raw EP rather than Phi weighing EP
-          	}
-            double AngleWrapAround = 2.0*TMath::Pi()/(double)EpOrder;
-             if (PsiShiftedEpdSub<0) PsiShiftedEpdSub += AngleWrapAround;
-              else if (PsiShiftedEpdSub>AngleWrapAround) PsiShiftedEpdSub -= AngleWrapAround;
-
-            mpPsiShiftedEpdSub.insert(pair<int, double>(itr1->first, PsiShiftedEpdSub));
-            hist_Epd_Sub_psi_Shifted_ini->Fill(PsiShiftedEpdSub);
-            // std::cout << '\t' << itr1->first
-            //      << '\t' << PsiShiftedEpdSub << '\n';
-          }
-        }
+    // Fill the PsiRawEpdSub of the EPD-3 hits
+    const Int_t nEpdSubHits = vEpdSubHits.size();
+    const Bool_t epdSubRaw = (N_Epd_east[3]>=5) && (QrawEastSide[3][0] || QrawEastSide[3][1]); // EPD-3
+    if(epdSubRaw){
+      ep.psis(nEpdSubHits, &QvctrEpdSubX[0], &QvctrEpdSubY[0], &PsiRawEpdSub[0]);
+      for (Int_t i = 0; i < nEpdSubHits; i++) hist_Epd_Sub_psi_raw_ini->Fill(PsiRawEpdSub[i]);
     }
-    // std::cout << std::endl;
-    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){ //etaRange {-5.1,-4.2,-3.28,-2.87,-2.60}
-        PsiEastShifted[EventTypeId] = PsiEastRecenter[EventTypeId]; // use raw EP rather than Phi weighing EP
-        if(PsiEastShifted[EventTypeId]==-999.0) continue;
-        if (mEpdShiftInput_sin[EventTypeId] != 0 && mEpdShiftInput_cos[EventTypeId]!= 0){
-          for (int i=1; i<=_EpTermsMaxIni; i++){
-        	  double tmp = (double)(EpOrder*i);
-            double sinAve = mEpdShiftInput_sin[EventTypeId]->GetBinContent(i,centrality);
-        	  double cosAve = mEpdShiftInput_cos[EventTypeId]->GetBinContent(i,centrality);
-        	  PsiEastShifted[EventTypeId] +=
-        	    2.0*(cosAve*sin(tmp*PsiEastRecenter[EventTypeId]) - sinAve*cos(tmp*PsiEastRecenter[EventTypeId]))/tmp; // use raw EP rather than Phi weighing EP
-        	}
-	         double AngleWrapAround = 2.0*TMath::Pi()/(double)EpOrder;
-  	        if (PsiEastShifted[EventTypeId]<0) PsiEastShifted[EventTypeId] += AngleWrapAround;
-  	         else if (PsiEastShifted[EventTypeId]>AngleWrapAround) PsiEastShifted[EventTypeId] -= AngleWrapAround;
-        }
-        hist_Epd_east_psi_Shifted_ini[EventTypeId]->Fill(PsiEastShifted[EventTypeId]);
-      }
-      // --------------------------- Fill the Correlations among EPD sub EPs ------------------------
-      pairs = -1;
-      for(int i = 0; i<3;i++){ // Correlations between EPD EP 1, 2, 3, 4. 6 pairs of correlations
-        for(int j=i+1;j<4;j++){
-          pairs++;
-          if(PsiEastRaw[i+1]!=-999.0&&PsiEastRaw[j+1]!=-999.0){
-            for(int n=0; n<2; n++){
-              profile_correlation_epd_east[n][pairs]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiEastShifted[j+1] )));
-            }
-            correlation2D_epd_east[pairs]->Fill(PsiEastShifted[i+1],PsiEastShifted[j+1]);
-          }
-        }
-      }
-
-    // -------------------- "Shift correction histograms Output" ----------------
-    // -------------------- "calculate shift histograms for a future run" ----------------
-    for (int i=1; i<=_EpTermsMaxIni; i++){
-      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){//etaRange {-5.1,-4.2,-3.28,-2.87,-2.60}
-        double tmp = (double)(EpOrder*i);
-        if(PsiEastRecenter[EventTypeId]==-999.0) continue;
-        mEpdShiftOutput_sin[EventTypeId]->Fill(i,centrality,sin(tmp*PsiEastRecenter[EventTypeId]));// use raw EP rather than Phi weighing EP
-        mEpdShiftOutput_cos[EventTypeId]->Fill(i,centrality,cos(tmp*PsiEastRecenter[EventTypeId]));// use raw EP rather than Phi weighing EP
+    // Fill the PsiShiftedEpdSub of the EPD-3 hits with a raw sub-event EP
+    Double_t shiftSinAve[_EpTermsMaxIni], shiftCosAve[_EpTermsMaxIni];
+    if (epdSubRaw && mEpdShiftInput_sin[3] != 0 && mEpdShiftInput_cos[3]!= 0){
+      PicoEpKernels::ShiftAverages(mEpdShiftInput_sin[3], mEpdShiftInput_cos[3], centrality, _EpTermsMaxIni, shiftSinAve, shiftCosAve);
+      ep.shifts(nEpdSubHits, &PsiRawEpdSub[0], shiftSinAve, shiftCosAve, &PsiShiftedEpdSub[0]); // use raw EP rather than Phi weighing EP
+      for (Int_t i = 0; i < nEpdSubHits; i++){
+        if(PsiShiftedEpdSub[i]!=-999.0) hist_Epd_Sub_psi_Shifted_ini->Fill(PsiShiftedEpdSub[i]);
       }
     }
+    return kTRUE;
+  });
+  modules.AddStage("tpcQvector", {"tracks","centrality","epdQ"}, {"pid","tpcQ"}, [&](PicoEventProducts &ev){
+    PicoTrackColumns &tracks = *ev.tracks;
+    const Int_t centrality = ev.centrality;
+    const Int_t    *N_Epd_east        = ev.nEpdEast;
+    const Double_t (*QrawEastSide)[2] = ev.qEpdEastRaw;
     // (8) ================ TPC event plane : use identedfied particles ====================================
-    // Fill Proton tracks for proton v1 analysis
-    std::vector<StPicoTrack *> v_Proton_tracks;
-    // Fill kaon tracks for phi meson analysis
-    std::vector<StPicoTrack *> v_KaonPlus_tracks;
-    std::vector<StPicoTrack *> v_KaonPlus_tracks_flexTOF;
-    std::vector<StPicoTrack *> v_KaonMinus_tracks;
-    std::vector<StPicoTrack *> v_KaonMinus_tracks_flexTOF;
+    // Fill Proton tracks for proton v1 analysis and kaon tracks for phi meson analysis
+    v_Proton_tracks.clear();
+    v_KaonPlus_tracks.clear();
+    v_KaonPlus_tracks_flexTOF.clear();
+    v_KaonMinus_tracks.clear();
+    v_KaonMinus_tracks_flexTOF.clear();
     // Define TPC EP parameters
-    Int_t NTpcAll[2] = {0};
-    Double_t QrawTpcAll[2][2]={0.0};       /// indices:[TPCetaRange] [x,y]
-    Double_t QrecenterTpcAll[2][2]={0.0};       /// indices:[TPCetaRange] [x,y]
-    Double_t PsiTpcAllRaw[2]={-999.0,-999.0};
-    Double_t PsiTpcAllRecenter[2]={-999.0,-999.0};
-    Double_t PsiTpcAllShifted[2]={-999.0,-999.0};
-    std::vector<std::vector<Double_t> > vQrawTpcAll; // {{Xn,Yn},...} For TPC EP flow, one want to remove current track
+    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){ // handed on in the products
+      NTpcAll[EventTypeId_tpc]       = 0;
+      QrawTpcAll[EventTypeId_tpc][0] = 0.0;
+      QrawTpcAll[EventTypeId_tpc][1] = 0.0;
+    }
     Int_t nProtons=0,nKaonPlus=0,nKaonMinus=0,nPionPlus=0,nPionMinus=0; // PID parameters
     Double_t d_nSigmaKaonCut, d_KaonM2low, d_KaonM2high, d_KaonpTlow;
     // default cuts
@@ -1596,25 +2001,34 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         d_KaonpTlow     = 0.4;
       }
     }
+    // phi and its harmonic of the good tracks, the harmonic once per track
+    if(tpcPhi.size() < vGoodTracks.size()){
+      tpcPhi.resize(vGoodTracks.size());
+      tpcCos.resize(vGoodTracks.size());
+      tpcSin.resize(vGoodTracks.size());
+    }
+    for(unsigned int i=0; i<vGoodTracks.size();i++){
+      Double_t phi = tracks.phi[vGoodTracks[i]];
+      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
+      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      tpcPhi[i] = phi;
+    }
+    ep.harmonics(vGoodTracks.size(), &tpcPhi[0], &tpcCos[0], &tpcSin[0]);
     // TPC Q-vector loop
     for(unsigned int i=0; i<vGoodTracks.size();i++){
-      StPicoTrack* picoTrack = vGoodTracks[i];
-      StPicoBTofPidTraits *trait        = NULL;
+      Int_t iTrk = vGoodTracks[i];
       Short_t charge;
       Double_t pt,pz,eta,ptot,phi;
       Double_t mass2 =-999.0,tofBeta =-999.0;
       Double_t rapWeight = 0.0; // Weight based on rapidity
-      charge = picoTrack->charge();
-      pt     = picoTrack->pPt();
-      pz     = picoTrack->pMom().Z();
-      eta    = picoTrack->pMom().Eta();
-      ptot = picoTrack->pPtot();
-      phi    = picoTrack->pMom().Phi();
-      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
-      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      charge = tracks.charge[iTrk];
+      pt     = tracks.pt[iTrk];
+      pz     = tracks.pMomZ[iTrk];
+      eta    = tracks.eta[iTrk];
+      ptot = tracks.ptot[iTrk];
+      phi    = tpcPhi[i];
       // ---------------- Check if TOF info available --------------------------
-      if(picoTrack->isTofTrack()) trait = dst->btofPidTraits( picoTrack->bTofPidTraitsIndex() );
-      if(trait) tofBeta               = trait->btofBeta();
+      tofBeta               = tracks.tofBeta[iTrk];
       if(tofBeta != -999.0) mass2 = ptot * ptot *( ( 1.0 / ( tofBeta*tofBeta ) ) - 1.0 );
       // ---------------- Particle Physics Variables presumed --------------------------
       Double_t energyProton,energyKaon,energyPion,rapProton,rapKaon,rapPion,mtProton,mtKaon,mtPion;
@@ -1629,15 +2043,15 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       mtKaon   = TMath::Sqrt(pt*pt + _massProton*_massProton);
       mtPion   = TMath::Sqrt(pt*pt + _massProton*_massProton);
       // ------------------------ TPC EP QA plots ------------------------------
-      h2_dEdxVsPq->Fill(charge*ptot,picoTrack->dEdx());
-      h2_dEdxVspTq->Fill(charge*pt,picoTrack->dEdx());
+      h2_dEdxVsPq->Fill(charge*ptot,tracks.dEdx[iTrk]);
+      h2_dEdxVspTq->Fill(charge*pt,tracks.dEdx[iTrk]);
       if(tofBeta!=-999.0){
         h2_beta->Fill(charge*ptot,1.0/tofBeta);
         h2_mass->Fill(charge*ptot,mass2);
       }
       // ------------------------ Particle identifications ------------------------------
       if( // Proton PID: require both TPC and TOF
-        TMath::Abs(picoTrack->nSigmaProton()) < 2.0 &&
+        TMath::Abs(tracks.nSigmaProton[iTrk]) < 2.0 &&
         (tofBeta != -999.0 && mass2 > 0.8 && mass2 < 1.0) &&
         // ((ptot <= 1.0) || (tofBeta != -999.0 && mass2 > 0.7 && mass2 < 1.1)) &&
         pt > 0.4 &&
@@ -1646,7 +2060,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       ){
         particleType=0;// Proton
         nProtons++;
-        v_Proton_tracks.push_back(picoTrack); // push back K+ tracks
+        v_Proton_tracks.push_back(iTrk); // push back K+ tracks
         // Fill histograms
         hist_pt_proton->Fill(pt);
         hist_eta_proton->Fill(eta);
@@ -1655,19 +2069,19 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         hist_rap_eta_proton->Fill(eta,rapProton);
         hist_pt_y_proton->Fill(rapProton,pt,1);
         hist_pt_eta_proton->Fill(eta,pt,1);
-        hist_dEdx_proton->Fill(charge*ptot,picoTrack->dEdx());
+        hist_dEdx_proton->Fill(charge*ptot,tracks.dEdx[iTrk]);
         hist_beta_proton->Fill(charge*ptot,1.0/tofBeta);
         hist_mass_proton->Fill(charge*ptot,mass2);
       } else if( // Kaons PID: require both TPC and TOF
-        TMath::Abs(picoTrack->nSigmaKaon()) < d_nSigmaKaonCut &&
+        TMath::Abs(tracks.nSigmaKaon[iTrk]) < d_nSigmaKaonCut &&
         tofBeta != -999.0 && mass2 > d_KaonM2low && mass2 < d_KaonM2high
         && pt > d_KaonpTlow
       ){
         if(charge > 0){
           particleType=1;// K+
           nKaonPlus++;
-          v_KaonPlus_tracks.push_back(picoTrack); // push back K+ tracks
-          v_KaonPlus_tracks_flexTOF.push_back(picoTrack); // push back K+ tracks
+          v_KaonPlus_tracks.push_back(iTrk); // push back K+ tracks
+          v_KaonPlus_tracks_flexTOF.push_back(iTrk); // push back K+ tracks
           // Fill histograms
           hist_pt_kaonPlus->Fill(pt);
           hist_eta_kaonPlus->Fill(eta);
@@ -1676,14 +2090,14 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_kaonPlus->Fill(eta,rapKaon);
           hist_pt_y_kaonPlus->Fill(rapKaon,pt,1);
           hist_pt_eta_kaonPlus->Fill(eta,pt,1);
-          hist_dEdx_kaonPlus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_kaonPlus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_kaonPlus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_kaonPlus->Fill(charge*ptot,mass2);
         } else { // charge < 0
           particleType=2;// K-
           nKaonMinus++;
-          v_KaonMinus_tracks.push_back(picoTrack); // push back K+ tracks
-          v_KaonMinus_tracks_flexTOF.push_back(picoTrack); // push back K+ tracks
+          v_KaonMinus_tracks.push_back(iTrk); // push back K+ tracks
+          v_KaonMinus_tracks_flexTOF.push_back(iTrk); // push back K+ tracks
           // Fill histograms
           hist_pt_kaonMinus->Fill(pt);
           hist_eta_kaonMinus->Fill(eta);
@@ -1692,12 +2106,12 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_kaonMinus->Fill(eta,rapKaon);
           hist_pt_y_kaonMinus->Fill(rapKaon,pt,1);
           hist_pt_eta_kaonMinus->Fill(eta,pt,1);
-          hist_dEdx_kaonMinus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_kaonMinus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_kaonMinus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_kaonMinus->Fill(charge*ptot,mass2);
         }
       } else if( // Pions PID: require both TPC and TOF
-        TMath::Abs(picoTrack->nSigmaPion()) <  2.0 &&
+        TMath::Abs(tracks.nSigmaPion[iTrk]) <  2.0 &&
         tofBeta != -999.0 && mass2 > -0.01 && mass2 < 0.05 &&
         pt > 0.2  &&
         !(TMath::Abs(mass2)<0.005 && ptot<0.25) // Remove electron influence
@@ -1713,7 +2127,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_pionPlus->Fill(eta,rapPion);
           hist_pt_y_pionPlus->Fill(rapPion,pt,1);
           hist_pt_eta_pionPlus->Fill(eta,pt,1);
-          hist_dEdx_pionPlus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_pionPlus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_pionPlus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_pionPlus->Fill(charge*ptot,mass2);
         } else { // charge < 0
@@ -1727,7 +2141,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_pionMinus->Fill(eta,rapPion);
           hist_pt_y_pionMinus->Fill(rapPion,pt,1);
           hist_pt_eta_pionMinus->Fill(eta,pt,1);
-          hist_dEdx_pionMinus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_pionMinus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_pionMinus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_pionMinus->Fill(charge*ptot,mass2);
         }
@@ -1737,7 +2151,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       // sys_cutN == 16; // TPCpid
       if( // Kaons PID: tracks that only have TPC, no TOF
         // sys_cutN == 16 &&
-        TMath::Abs(picoTrack->nSigmaKaon()) < d_nSigmaKaonCut &&
+        TMath::Abs(tracks.nSigmaKaon[iTrk]) < d_nSigmaKaonCut &&
         // TMath::Abs(picoTrack->nSigmaKaon()) < TMath::Abs(picoTrack->nSigmaElectron()) &&
         // TMath::Abs(picoTrack->nSigmaKaon()) < TMath::Abs(picoTrack->nSigmaPion()) &&
         // TMath::Abs(picoTrack->nSigmaKaon()) < TMath::Abs(picoTrack->nSigmaProton()) &&
@@ -1747,7 +2161,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         if(charge > 0){
           particleType=1;// K+
           nKaonPlus++;
-          v_KaonPlus_tracks_flexTOF.push_back(picoTrack); // push back K+ tracks
+          v_KaonPlus_tracks_flexTOF.push_back(iTrk); // push back K+ tracks
           // Fill histograms
           hist_pt_kaonPlus->Fill(pt);
           hist_eta_kaonPlus->Fill(eta);
@@ -1756,13 +2170,13 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_kaonPlus->Fill(eta,rapKaon);
           hist_pt_y_kaonPlus->Fill(rapKaon,pt,1);
           hist_pt_eta_kaonPlus->Fill(eta,pt,1);
-          hist_dEdx_kaonPlus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_kaonPlus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_kaonPlus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_kaonPlus->Fill(charge*ptot,mass2);
         } else { // charge < 0
           particleType=2;// K-
           nKaonMinus++;
-          v_KaonMinus_tracks_flexTOF.push_back(picoTrack); // push back K- tracks
+          v_KaonMinus_tracks_flexTOF.push_back(iTrk); // push back K- tracks
           // Fill histograms
           hist_pt_kaonMinus->Fill(pt);
           hist_eta_kaonMinus->Fill(eta);
@@ -1771,7 +2185,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           hist_rap_eta_kaonMinus->Fill(eta,rapKaon);
           hist_pt_y_kaonMinus->Fill(rapKaon,pt,1);
           hist_pt_eta_kaonMinus->Fill(eta,pt,1);
-          hist_dEdx_kaonMinus->Fill(charge*ptot,picoTrack->dEdx());
+          hist_dEdx_kaonMinus->Fill(charge*ptot,tracks.dEdx[iTrk]);
           hist_beta_kaonMinus->Fill(charge*ptot,1.0/tofBeta);
           hist_mass_kaonMinus->Fill(charge*ptot,mass2);
         }
@@ -1790,28 +2204,16 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         double etaWeight = (double)wt_tpc.GetBinContent(etaBin,EventTypeId_tpc+1);
         if(EpOrder == 1){ // \psi_1^{TPC}
           if(etaWeight>0.0 && etaTrkWeight /*rapWeight*/!=0) NTpcAll[EventTypeId_tpc]++;
-          double Cosine = cos(phi*(double)EpOrder);
-          double Sine   = sin(phi*(double)EpOrder);
+          double Cosine = tpcCos[i], Sine = tpcSin[i];
           QrawTpcAll[EventTypeId_tpc][0] += etaWeight * etaTrkWeight /*rapWeight*/ * Cosine;
           QrawTpcAll[EventTypeId_tpc][1] += etaWeight * etaTrkWeight /*rapWeight*/ * Sine;
         } else { // \psi_2^{TPC}
           if(etaWeight>0.0) NTpcAll[EventTypeId_tpc]++;
-          double Cosine = cos(phi*(double)EpOrder);
-          double Sine   = sin(phi*(double)EpOrder);
+          double Cosine = tpcCos[i], Sine = tpcSin[i];
           QrawTpcAll[EventTypeId_tpc][0] += etaWeight * pt * Cosine;
           QrawTpcAll[EventTypeId_tpc][1] += etaWeight * pt * Sine;
         }
       }
-      // calculate the v1 in TPC region using EPD EP
-      if(PsiEastRaw[1]!=-999.0){// Using EPD-1
-        // ------------- Fill histograms for the determination of TPC eta range -----
-        profile2D_v1VsEtaTpcOnly->Fill(eta,centrality,etaTrkWeight /*rapWeight*/ * TMath::Cos((phi-PsiEastShifted[1])*(Double_t)EpOrder));
-        profile2D_v1VsEtaTpcOnly_1->Fill(eta,centrality,TMath::Cos((phi-PsiEastShifted[1])*(Double_t)EpOrder));
-      // ------------------- Fill the eta weighting histograms --------------------------
-        profile2D_v1VsCentVsEta->Fill(eta,centrality,TMath::Cos(phi-PsiEastShifted[1])/d_resolution[0][centrality-1]);//Use EPD-1 as primary event plane
-        profile2D_v2VsCentVsEta->Fill(eta,centrality,TMath::Cos(2 * (phi-PsiEastShifted[0])));//Use EPD-full as event plane first
-        profile_v1VsEta[centrality-1]->Fill(eta,TMath::Cos(phi-PsiEastShifted[1])/d_resolution[0][centrality-1]); // [] is from 0 to 8, centrality is from 1 to 9.
-      }
       hist_nTracksVsEta->Fill(eta,centrality);//histograms for the determination of TPC eta range
     } // TPC Q-vector loop
 
@@ -1820,86 +2222,253 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
     // cout << "nKaonPlus " << nKaonPlus<< endl;
     // cout << "nPionPlus " << nPionPlus<< endl;
     // cout << "nPionMinus " << nPionMinus<< endl;
+    if(mQvectorTree){ // raw Q-vectors of both detectors are complete here
+      qvector.runId      = ev.runId;
+      qvector.eventId    = ev.eventInfo->eventId;
+      qvector.vz         = ev.vertex.Z();
+      qvector.centrality = centrality;
+      qvector.order      = EpOrder;
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+        qvector.nEpdEast[EventTypeId]    = N_Epd_east[EventTypeId];
+        qvector.QEpdEast[EventTypeId][0] = QrawEastSide[EventTypeId][0];
+        qvector.QEpdEast[EventTypeId][1] = QrawEastSide[EventTypeId][1];
+      }
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+        qvector.nTpc[EventTypeId_tpc]    = NTpcAll[EventTypeId_tpc];
+        qvector.QTpc[EventTypeId_tpc][0] = QrawTpcAll[EventTypeId_tpc][0];
+        qvector.QTpc[EventTypeId_tpc][1] = QrawTpcAll[EventTypeId_tpc][1];
+      }
+      mQvectorTree->Fill();
+    }
     // Track multiplicity for each particle
     hist_trackmult_proton->Fill(nProtons);
     hist_trackmult_pionPlus->Fill(nPionPlus);
     hist_trackmult_pionMinus->Fill(nPionMinus);
     hist_trackmult_kaonPlus->Fill(nKaonPlus);
     hist_trackmult_kaonMinus->Fill(nKaonMinus);
+    return kTRUE;
+  });
+  modules.AddStage("epdEventPlane", {"epdQ","centrality"}, {"epdEP"}, [&](PicoEventProducts &ev){
+    const Int_t centrality = ev.centrality;
     //---------------------------------
     // Calculate unshifted EP angles
     //---------------------------------
-    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
-      if(NTpcAll[EventTypeId_tpc]<5) continue; // at least 5 tracks to get TPC event plane
-      if(QrawTpcAll[EventTypeId_tpc][0] || QrawTpcAll[EventTypeId_tpc][1] ){ // Qx, Qy cannot be 0 at the same time
-        PsiTpcAllRaw[EventTypeId_tpc] = GetPsi(QrawTpcAll[EventTypeId_tpc][0],QrawTpcAll[EventTypeId_tpc][1],EpOrder);
-        hist2_Tpc_Qy_Qx_raw_ini[EventTypeId_tpc]->Fill(QrawTpcAll[EventTypeId_tpc][0],QrawTpcAll[EventTypeId_tpc][1]);
-        // PsiTpcAllRaw[EventTypeId_tpc] = (1./(Double_t)EpOrder)*TMath::ATan2(QrawTpcAll[EventTypeId_tpc][1],QrawTpcAll[EventTypeId_tpc][0]);
-        // if(PsiTpcAllRaw[EventTypeId_tpc] < 0.0                             )         PsiTpcAllRaw[EventTypeId_tpc] += (1. / (double)EpOrder) * 2.0*TMath::Pi();
-        // if(PsiTpcAllRaw[EventTypeId_tpc] > (1. / (double)EpOrder) * 2.0*TMath::Pi()) PsiTpcAllRaw[EventTypeId_tpc] -= (1. / (double)EpOrder) * 2.0*TMath::Pi();
-        if(PsiTpcAllRaw[EventTypeId_tpc]!=-999.0) hist_tpc_all_psi_raw[EventTypeId_tpc]->Fill(PsiTpcAllRaw[EventTypeId_tpc]);
-        // recenter corrections
-        if(mTpcRecenterInput[EventTypeId_tpc]==0){
-          QrecenterTpcAll[EventTypeId_tpc][0] = QrawTpcAll[EventTypeId_tpc][0];
-          QrecenterTpcAll[EventTypeId_tpc][1] = QrawTpcAll[EventTypeId_tpc][1];
+    // for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
+    //   if(N_Epd_east[EventTypeId]<5) continue;
+    //   if(QrawEastSide[EventTypeId][0] || QrawEastSide[EventTypeId][1] ){
+    //     PsiEastRaw[EventTypeId] = ep.psi(QrawEastSide[EventTypeId][0],QrawEastSide[EventTypeId][1]);
+    //     // PsiEastPhiWeighted[EventTypeId] = ep.psi(QphiWeightedEastSide[EventTypeId][0],QphiWeightedEastSide[EventTypeId][1]);
+    //   }
+    // }
+    // Recentered and shifted by the event itself, or taken from its EP block (epbatch=N)
+    Double_t QrecenterEastSide[5][2]={0};       /// indices: [etaBin][x,y]
+    Double_t PsiEastRecenter[5]={-999.0,-999.0,-999.0,-999.0,-999.0};           /// indices: [etaBin]
+    // Double_t PsiEastPhiWeighted[5]={-999.0,-999.0,-999.0,-999.0,-999.0};       /// indices: [etaBin]
+    for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
+      PicoEpAngles angles;
+      if(ev.epBlockEvent >= 0){
+        epdBlock[EventTypeId].Get(ev.epBlockEvent, angles);
+      } else {
+        PicoEpEventAngles<_EpTermsMaxIni>(ep, N_Epd_east[EventTypeId], QrawEastSide[EventTypeId], mEpdRecenterInput[EventTypeId],
+                                          mEpdShiftInput_sin[EventTypeId], mEpdShiftInput_cos[EventTypeId], centrality, angles);
+      }
+      PsiEastRaw[EventTypeId]           = angles.psiRaw;
+      QrecenterEastSide[EventTypeId][0] = angles.qRecenter[0];
+      QrecenterEastSide[EventTypeId][1] = angles.qRecenter[1];
+      PsiEastRecenter[EventTypeId]      = angles.psiRecenter;
+      PsiEastShifted[EventTypeId]       = angles.psiShifted; // use raw EP rather than Phi weighing EP
+    }
+    for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
+      if(N_Epd_east[EventTypeId]<5) continue;
+      if(QrawEastSide[EventTypeId][0] || QrawEastSide[EventTypeId][1] )
+      {
+        if(PsiEastRaw[EventTypeId]!=-999.0){
+          hist2_Epd_east_Qy_Qx_raw_ini[EventTypeId]->Fill(QrawEastSide[EventTypeId][0],QrawEastSide[EventTypeId][1]);
+          hist_Epd_east_psi_raw_ini[EventTypeId]->Fill(PsiEastRaw[EventTypeId]);
+          // hist_Epd_east_psi_Weighted_ini[EventTypeId]->Fill(PsiEastPhiWeighted[EventTypeId]);
         } else {
-          QrecenterTpcAll[EventTypeId_tpc][0] = QrawTpcAll[EventTypeId_tpc][0] - mTpcRecenterInput[EventTypeId_tpc]->GetBinContent(1,centrality);
-          QrecenterTpcAll[EventTypeId_tpc][1] = QrawTpcAll[EventTypeId_tpc][1] - mTpcRecenterInput[EventTypeId_tpc]->GetBinContent(2,centrality);
+          cout << "PsiEastRaw  " << EventTypeId << " = " << PsiEastRaw[EventTypeId]<<endl;
+          cout << "Qx raw  " << EventTypeId << " = " << QrawEastSide[EventTypeId][0]<<endl;
+          cout << "Qy raw  " << EventTypeId << " = " << QrawEastSide[EventTypeId][1]<<endl;
         }
-        PsiTpcAllRecenter[EventTypeId_tpc] = GetPsi(QrecenterTpcAll[EventTypeId_tpc][0],QrecenterTpcAll[EventTypeId_tpc][1],EpOrder);
-        hist2_Tpc_Qy_Qx_rec_ini[EventTypeId_tpc]->Fill(QrecenterTpcAll[EventTypeId_tpc][0],QrecenterTpcAll[EventTypeId_tpc][1]);
-        if(PsiTpcAllRaw[EventTypeId_tpc]!=-999.0){
-          hist_tpc_all_psi_recenter[EventTypeId_tpc]->Fill(PsiTpcAllRecenter[EventTypeId_tpc]);
-          // cout << "recenter psi TPC: "<<  PsiTpcAllRecenter[EventTypeId_tpc]<<endl;
-          // cout << "raw psi TPC: "<<  PsiTpcAllRaw[EventTypeId_tpc]<<endl;
+        if(PsiEastRaw[EventTypeId]!=-999.0){
+          hist2_Epd_east_Qy_Qx_rec_ini[EventTypeId]->Fill(QrecenterEastSide[EventTypeId][0],QrecenterEastSide[EventTypeId][1]);
+          hist_Epd_east_psi_recenter_ini[EventTypeId]->Fill(PsiEastRecenter[EventTypeId]);
+          // cout << "Psi_raw = " << PsiEastRaw[EventTypeId] << endl;
+          // cout << "Psi_rec = " << PsiEastRecenter[EventTypeId] << endl;
           // hist_Epd_east_psi_Weighted_ini[EventTypeId]->Fill(PsiEastPhiWeighted[EventTypeId]);
           // -------------------- "recenter correction histograms Output" ----------------
           // -------------------- "calculate recenter histograms for a future run" ----------------
           // Fill the recenter plots for next run
-          mTpcRecenterOutput[EventTypeId_tpc]->Fill(1,centrality,QrawTpcAll[EventTypeId_tpc][0]); // Qx raw
-          mTpcRecenterOutput[EventTypeId_tpc]->Fill(2,centrality,QrawTpcAll[EventTypeId_tpc][1]); // Qy raw
-        }
-      }
-    }
-    // --------------------------- " Do the SHIFT thing (TPC) " ------------------------
-    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
-      PsiTpcAllShifted[EventTypeId_tpc] = PsiTpcAllRecenter[EventTypeId_tpc];
-      if(PsiTpcAllShifted[EventTypeId_tpc]==-999.0) continue; // Bad PsiTpcAllRecenter
-      if (mTpcShiftInput_sin[EventTypeId_tpc] != 0 && mTpcShiftInput_cos[EventTypeId_tpc]!= 0){
-        for (int i=1; i<=_EpTermsMaxIni; i++){
-            double tmp = (double)(EpOrder*i);
-            double sinAve = mTpcShiftInput_sin[EventTypeId_tpc]->GetBinContent(i,centrality);
-            double cosAve = mTpcShiftInput_cos[EventTypeId_tpc]->GetBinContent(i,centrality);
-            PsiTpcAllShifted[EventTypeId_tpc] +=
-              2.0*(cosAve*sin(tmp*PsiTpcAllRecenter[EventTypeId_tpc]) - sinAve*cos(tmp*PsiTpcAllRecenter[EventTypeId_tpc]))/tmp;
+          mEpdRecenterOutput[EventTypeId]->Fill(1,centrality,QrawEastSide[EventTypeId][0]);
+          mEpdRecenterOutput[EventTypeId]->Fill(2,centrality,QrawEastSide[EventTypeId][1]);
         }
-           double AngleWrapAround = 2.0*TMath::Pi()/(double)EpOrder;
-            if (PsiTpcAllShifted[EventTypeId_tpc]<0) PsiTpcAllShifted[EventTypeId_tpc] += AngleWrapAround;
-             else if (PsiTpcAllShifted[EventTypeId_tpc]>AngleWrapAround) PsiTpcAllShifted[EventTypeId_tpc] -= AngleWrapAround;
+        // cout << "QrawEastSide Qx"<<EventTypeId <<" = " << QrawEastSide[EventTypeId][0] << endl;
+        // cout << "QrawEastSide Qy"<< EventTypeId <<" = " << QrawEastSide[EventTypeId][1] << endl;
+        // mEpdRecenterOutput[EventTypeId]->Fill(1,centrality,QrawEastSide[EventTypeId][0]);
+        // mEpdRecenterOutput[EventTypeId]->Fill(2,centrality,QrawEastSide[EventTypeId][1]);
       }
-      hist_tpc_all_psi_shifted[EventTypeId_tpc]->Fill(PsiTpcAllShifted[EventTypeId_tpc]);
     }
+    // --------------------------- " Do the SHIFT thing " ------------------------
+    // std::cout << std::endl;
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){ //etaRange {-5.1,-4.2,-3.28,-2.87,-2.60}
+        if(PsiEastRecenter[EventTypeId]==-999.0) continue;
+        hist_Epd_east_psi_Shifted_ini[EventTypeId]->Fill(PsiEastShifted[EventTypeId]);
+      }
+      // --------------------------- Fill the Correlations among EPD sub EPs ------------------------
+      pairs = -1;
+      for(int i = 0; i<3;i++){ // Correlations between EPD EP 1, 2, 3, 4. 6 pairs of correlations
+        for(int j=i+1;j<4;j++){
+          pairs++;
+          if(PsiEastRaw[i+1]!=-999.0&&PsiEastRaw[j+1]!=-999.0){
+            for(int n=0; n<2; n++){
+              profile_correlation_epd_east[n][pairs]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiEastShifted[j+1] )));
+            }
+            correlation2D_epd_east[pairs]->Fill(PsiEastShifted[i+1],PsiEastShifted[j+1]);
+          }
+        }
+      }
+
+    // -------------------- "Shift correction histograms Output" ----------------
+    // -------------------- "calculate shift histograms for a future run" ----------------
+    Double_t shiftSinTerms[_EpTermsMaxIni], shiftCosTerms[_EpTermsMaxIni];
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){//etaRange {-5.1,-4.2,-3.28,-2.87,-2.60}
+      if(PsiEastRecenter[EventTypeId]==-999.0) continue;
+      if(ev.epBlockEvent >= 0) epdBlock[EventTypeId].Terms(ev.epBlockEvent, shiftSinTerms, shiftCosTerms);
+      else ep.shiftTerms(PsiEastRecenter[EventTypeId], shiftSinTerms, shiftCosTerms);// use raw EP rather than Phi weighing EP
+      for (int i=1; i<=_EpTermsMaxIni; i++){
+        mEpdShiftOutput_sin[EventTypeId]->Fill(i,centrality,shiftSinTerms[i-1]);
+        mEpdShiftOutput_cos[EventTypeId]->Fill(i,centrality,shiftCosTerms[i-1]);
+      }
+    }
+    return kTRUE;
+  });
+  modules.AddStage("tpcEventPlane", {"tpcQ","epdEP"}, {"tpcEP"}, [&](PicoEventProducts &ev){
+    const Int_t centrality = ev.centrality;
+    const Int_t    *NTpcAll           = ev.nTpc;
+    const Double_t (*QrawTpcAll)[2]   = ev.qTpcRaw;
+    const Double_t *PsiEastRaw        = ev.psiEpdEastRaw;
+    const Double_t *PsiEastShifted    = ev.psiEpdEastShifted;
+    //---------------------------------
+    // Calculate unshifted EP angles
+    //---------------------------------
+    // Recentered and shifted by the event itself, or taken from its EP block (epbatch=N)
+    Double_t QrecenterTpcAll[2][2]={0.0};       /// indices:[TPCetaRange] [x,y]
+    Double_t PsiTpcAllRecenter[2]={-999.0,-999.0};
+    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
+      PicoEpAngles angles;
+      if(ev.epBlockEvent >= 0){
+        tpcBlock[EventTypeId_tpc].Get(ev.epBlockEvent, angles);
+      } else {
+        PicoEpEventAngles<_EpTermsMaxIni>(ep, NTpcAll[EventTypeId_tpc], QrawTpcAll[EventTypeId_tpc], mTpcRecenterInput[EventTypeId_tpc],
+                                          mTpcShiftInput_sin[EventTypeId_tpc], mTpcShiftInput_cos[EventTypeId_tpc], centrality, angles);
+      }
+      PsiTpcAllRaw[EventTypeId_tpc]       = angles.psiRaw;
+      QrecenterTpcAll[EventTypeId_tpc][0] = angles.qRecenter[0];
+      QrecenterTpcAll[EventTypeId_tpc][1] = angles.qRecenter[1];
+      PsiTpcAllRecenter[EventTypeId_tpc]  = angles.psiRecenter;
+      PsiTpcAllShifted[EventTypeId_tpc]   = angles.psiShifted;
+    }
+    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
+      if(NTpcAll[EventTypeId_tpc]<5) continue; // at least 5 tracks to get TPC event plane
+      if(QrawTpcAll[EventTypeId_tpc][0] || QrawTpcAll[EventTypeId_tpc][1] ){ // Qx, Qy cannot be 0 at the same time
+        hist2_Tpc_Qy_Qx_raw_ini[EventTypeId_tpc]->Fill(QrawTpcAll[EventTypeId_tpc][0],QrawTpcAll[EventTypeId_tpc][1]);
+        // PsiTpcAllRaw[EventTypeId_tpc] = (1./(Double_t)EpOrder)*TMath::ATan2(QrawTpcAll[EventTypeId_tpc][1],QrawTpcAll[EventTypeId_tpc][0]);
+        // if(PsiTpcAllRaw[EventTypeId_tpc] < 0.0                             )         PsiTpcAllRaw[EventTypeId_tpc] += (1. / (double)EpOrder) * 2.0*TMath::Pi();
+        // if(PsiTpcAllRaw[EventTypeId_tpc] > (1. / (double)EpOrder) * 2.0*TMath::Pi()) PsiTpcAllRaw[EventTypeId_tpc] -= (1. / (double)EpOrder) * 2.0*TMath::Pi();
+        if(PsiTpcAllRaw[EventTypeId_tpc]!=-999.0) hist_tpc_all_psi_raw[EventTypeId_tpc]->Fill(PsiTpcAllRaw[EventTypeId_tpc]);
+        hist2_Tpc_Qy_Qx_rec_ini[EventTypeId_tpc]->Fill(QrecenterTpcAll[EventTypeId_tpc][0],QrecenterTpcAll[EventTypeId_tpc][1]);
+        if(PsiTpcAllRaw[EventTypeId_tpc]!=-999.0){
+          hist_tpc_all_psi_recenter[EventTypeId_tpc]->Fill(PsiTpcAllRecenter[EventTypeId_tpc]);
+          // cout << "recenter psi TPC: "<<  PsiTpcAllRecenter[EventTypeId_tpc]<<endl;
+          // cout << "raw psi TPC: "<<  PsiTpcAllRaw[EventTypeId_tpc]<<endl;
+          // hist_Epd_east_psi_Weighted_ini[EventTypeId]->Fill(PsiEastPhiWeighted[EventTypeId]);
+          // -------------------- "recenter correction histograms Output" ----------------
+          // -------------------- "calculate recenter histograms for a future run" ----------------
+          // Fill the recenter plots for next run
+          mTpcRecenterOutput[EventTypeId_tpc]->Fill(1,centrality,QrawTpcAll[EventTypeId_tpc][0]); // Qx raw
+          mTpcRecenterOutput[EventTypeId_tpc]->Fill(2,centrality,QrawTpcAll[EventTypeId_tpc][1]); // Qy raw
+        }
+      }
+    }
+    // --------------------------- " Do the SHIFT thing (TPC) " ------------------------
+    for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
+      if(PsiTpcAllRecenter[EventTypeId_tpc]==-999.0) continue; // Bad PsiTpcAllRecenter
+      hist_tpc_all_psi_shifted[EventTypeId_tpc]->Fill(PsiTpcAllShifted[EventTypeId_tpc]);
+    }
+    // ------------------- Fill the Correlations among TPC EP and EPD sub EPs ------------------------
+    for(int n=0; n<2; n++){
+      profile_correlation_epd_tpc_all[n]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[0] - PsiTpcAllShifted[1] /*- TMath::Pi()/(double)EpOrder*/ )));
+    }
+    correlation2D_epd_tpc_all->Fill(PsiTpcAllShifted[1],PsiEastShifted[0]);
+    for(int i=0;i<4;i++){// Correlaitons between TPC and EPD sub event planes 1,2,3,4
+      if(PsiEastRaw[i+1]!=-999.0&&PsiTpcAllRaw[1]!=-999.0){
+        for(int n=0; n<2; n++){
+          profile_correlation_epd_tpc[n][i]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiTpcAllShifted[1] /*- TMath::Pi()/(double)EpOrder*/ )));
+        }
+        correlation2D_epd_tpc[i]->Fill(PsiTpcAllShifted[1],PsiEastShifted[i+1]);
+      }
+    }
+    // -------------------- "Shift correction histograms (TPC) Output" ----------------
+    // -------------------- "calculate shift histograms for a future run" ----------------
+    Double_t shiftSinTerms[_EpTermsMaxIni], shiftCosTerms[_EpTermsMaxIni];
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      if(PsiTpcAllRecenter[EventTypeId_tpc]==-999.0) continue;
+      if(ev.epBlockEvent >= 0) tpcBlock[EventTypeId_tpc].Terms(ev.epBlockEvent, shiftSinTerms, shiftCosTerms);
+      else ep.shiftTerms(PsiTpcAllRecenter[EventTypeId_tpc], shiftSinTerms, shiftCosTerms);
+      for (int i=1; i<=_EpTermsMaxIni; i++){ // TPC shifted Output
+        mTpcShiftOutput_sin[EventTypeId_tpc]->Fill(i,centrality,shiftSinTerms[i-1]);
+        mTpcShiftOutput_cos[EventTypeId_tpc]->Fill(i,centrality,shiftCosTerms[i-1]);
+      }
+    }
+    return kTRUE;
+  });
+  // (9) ======================= Flow calculation of P, Pi K  =========================
+  modules.Add("flowProfiles", {"tracks","centrality","epdEP","tpcEP"}, {}, [&](const PicoEventProducts &ev){
+    const PicoTrackColumns &tracks = *ev.tracks;
+    const EpdHitBuffer &epdHits = *ev.epdHits;
+    const Int_t centrality = ev.centrality;
+    const Double_t *epdEta = ev.epdEta, *epdPhi = ev.epdPhi;
+    const Double_t *PsiEastRaw       = ev.psiEpdEastRaw;
+    const Double_t *PsiEastShifted   = ev.psiEpdEastShifted;
+    const Double_t *PsiTpcAllRaw     = ev.psiTpcRaw;
+    const Double_t *PsiTpcAllShifted = ev.psiTpcShifted;
+    //---------------------------- Fill the directed flow from TPC region -----
+    for(unsigned int i=0; i<ev.goodTracks->size();i++){
+      Int_t iTrk = (*ev.goodTracks)[i];
+      Double_t eta = tracks.eta[iTrk];
+      Double_t phi = tracks.phi[iTrk];
+      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
+      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      double etaTrkWeight = (eta>=_y_mid) ? 1. : -1.;
+      // calculate the v1 in TPC region using EPD EP
+      if(PsiEastRaw[1]!=-999.0){// Using EPD-1
+        // ------------- Fill histograms for the determination of TPC eta range -----
+        profile2D_v1VsEtaTpcOnly->Fill(eta,centrality,etaTrkWeight /*rapWeight*/ * TMath::Cos((phi-PsiEastShifted[1])*(Double_t)EpOrder));
+        profile2D_v1VsEtaTpcOnly_1->Fill(eta,centrality,TMath::Cos((phi-PsiEastShifted[1])*(Double_t)EpOrder));
+      // ------------------- Fill the eta weighting histograms --------------------------
+        profile2D_v1VsCentVsEta->Fill(eta,centrality,TMath::Cos(phi-PsiEastShifted[1])/d_resolution[0][centrality-1]);//Use EPD-1 as primary event plane
+        profile2D_v2VsCentVsEta->Fill(eta,centrality,TMath::Cos(2 * (phi-PsiEastShifted[0])));//Use EPD-full as event plane first
+        profile_v1VsEta[centrality-1]->Fill(eta,TMath::Cos(phi-PsiEastShifted[1])/d_resolution[0][centrality-1]); // [] is from 0 to 8, centrality is from 1 to 9.
+      }
+    } // TPC track loop
     //---------------------------- Fill the directed flow from EPD (forward) region -----
-    for (int iEpdHit = 0; iEpdHit < mEpdHits->GetEntries(); iEpdHit++){
-      StPicoEpdHit* epdHit = (StPicoEpdHit*)((*mEpdHits)[iEpdHit]);
+    for (int iEpdHit = 0; iEpdHit < epdHits.nHits; iEpdHit++){
       int tileId,ring,TT,PP,EW,ADC;
       float nMip;
-      tileId = epdHit->id();
-      EW = (tileId<0)?0:1;
+      tileId = epdHits.id[iEpdHit];
+      EW = epdHits.ew[iEpdHit];
       if(EW!=0) continue; // EPD east event plane needed
-      ring = epdHit->row();
-      TT = epdHit->tile();
-      PP = epdHit->position();
-      ADC = epdHit->adc();
-      nMip = epdHit->nMIP();   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
+      ring = epdHits.ring[iEpdHit];
+      TT = epdHits.tile[iEpdHit];
+      PP = epdHits.position[iEpdHit];
+      ADC = epdHits.adc[iEpdHit];
+      nMip = epdHits.nMip[iEpdHit];   // malisa 20feb2019 - I have finally made the transition from ADC (next line) to truly nMip, now that calibrations are done.
       //      nMip = (TT<10)?(double)ADC/160.0:(double)ADC/115.0;
       if (nMip<mThresh) continue;
       double TileWeight = (nMip<mMax)?nMip:mMax;
-      TVector3 StraightLine = mEpdGeom->TileCenter(tileId) - event->primaryVertex();
-      double phi = StraightLine.Phi();
-      double eta = StraightLine.Eta();
-      if(phi < 0.0            ) phi += 2.0*TMath::Pi();
-      if(phi > 2.0*TMath::Pi()) phi -= 2.0*TMath::Pi();
+      double phi = epdPhi[iEpdHit]; // TileCenter(tileId) - primary vertex, 0 to 2pi
+      double eta = epdEta[iEpdHit];
 
       //--------------------------------
       // Fill the directed flow into the TProfile2D and TProfile
@@ -1921,51 +2490,28 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         profile_v1VsEta[centrality-1]->Fill(eta,TMath::Cos(phi-PsiEastShifted[1])/d_resolution[0][centrality-1]); // [] is from 0 to 8, centrality is from 1 to 9.
       }
     } // loop over EPD hits
-    // std::cout << std::endl;
-
-    // ------------------- Fill the Correlations among TPC EP and EPD sub EPs ------------------------
-    for(int n=0; n<2; n++){
-      profile_correlation_epd_tpc_all[n]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[0] - PsiTpcAllShifted[1] /*- TMath::Pi()/(double)EpOrder*/ )));
-    }
-    correlation2D_epd_tpc_all->Fill(PsiTpcAllShifted[1],PsiEastShifted[0]);
-    for(int i=0;i<4;i++){// Correlaitons between TPC and EPD sub event planes 1,2,3,4
-      if(PsiEastRaw[i+1]!=-999.0&&PsiTpcAllRaw[1]!=-999.0){
-        for(int n=0; n<2; n++){
-          profile_correlation_epd_tpc[n][i]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiTpcAllShifted[1] /*- TMath::Pi()/(double)EpOrder*/ )));
-        }
-        correlation2D_epd_tpc[i]->Fill(PsiTpcAllShifted[1],PsiEastShifted[i+1]);
-      }
-    }
-    // -------------------- "Shift correction histograms (TPC) Output" ----------------
-    // -------------------- "calculate shift histograms for a future run" ----------------
-    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
-      for (int i=1; i<=_EpTermsMaxIni; i++){ // TPC shifted Output
-        double tmp = (double)(EpOrder*i);
-        if(PsiTpcAllRecenter[EventTypeId_tpc]==-999.0) break;
-        mTpcShiftOutput_sin[EventTypeId_tpc]->Fill(i,centrality,sin(tmp*PsiTpcAllRecenter[EventTypeId_tpc]));
-        mTpcShiftOutput_cos[EventTypeId_tpc]->Fill(i,centrality,cos(tmp*PsiTpcAllRecenter[EventTypeId_tpc]));
-      }
-    }
-    // (9) ======================= Flow calculation of P, Pi K  =========================
+  });
+  modules.Add("protonV1", {"tracks","centrality","pid","epdEP"}, {}, [&](const PicoEventProducts &ev){
+    PicoTrackColumns &tracks = *ev.tracks;
+    const Int_t centrality = ev.centrality;
+    const std::vector<Int_t> &v_Proton_tracks = *ev.protons;
+    const Double_t *PsiEastRaw = ev.psiEpdEastRaw;
+    const Double_t *PsiEastShifted = ev.psiEpdEastShifted;
     for(unsigned int i = 0; i < v_Proton_tracks.size(); i++){
-      StPicoTrack * picoTrack = v_Proton_tracks.at(i); // i-th K+ track
-      if(!picoTrack) continue;
+      Int_t iTrk = v_Proton_tracks.at(i); // i-th proton track
       // Proton Variables
-      double d_charge  = picoTrack->charge();
-      double d_px      = picoTrack->pMom().x();
-      double d_py      = picoTrack->pMom().y();
-      double d_pz      = picoTrack->pMom().z();
-      double d_pT      = picoTrack->pPt();
+      double d_charge  = tracks.charge[iTrk];
+      double d_px      = tracks.pMomX[iTrk];
+      double d_py      = tracks.pMomY[iTrk];
+      double d_pz      = tracks.pMomZ[iTrk];
+      double d_pT      = tracks.pt[iTrk];
       double d_mom     = sqrt(d_pT*d_pT + d_pz*d_pz);
-      StPicoBTofPidTraits *trait = NULL;
-      double d_tofBeta    = -999.;
+      double d_tofBeta    = tracks.tofBeta[iTrk];
       double d_inv_tofBeta    = -999.;
-      if(picoTrack->isTofTrack()) trait = dst->btofPidTraits( picoTrack->bTofPidTraitsIndex() );
-      if(trait)        d_tofBeta = trait->btofBeta();
       double d_M   = _massProton;
       double d_E   = sqrt((d_px*d_px+d_py*d_py+d_pz*d_pz)+_massProton*_massProton);
       double d_y   = ((d_E-d_pz) != 0.0) ? 0.5*TMath::Log( (d_E + d_pz) / (d_E - d_pz) ) : -999.0;
-      Double_t d_phi_azimuth = picoTrack->pMom().Phi();
+      Double_t d_phi_azimuth = tracks.phi[iTrk];
       if(d_phi_azimuth < 0.0            ) d_phi_azimuth += 2.0*TMath::Pi();
       if(d_phi_azimuth > 2.0*TMath::Pi()) d_phi_azimuth -= 2.0*TMath::Pi();
       double d_flow_Proton_raw[2] = {-999.0,-999.0}; // v1, v2 raw flow
@@ -1979,25 +2525,35 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       if(d_flow_Proton_resolution[0]!=-999.0) profile3D_proton_v1->Fill(centrality,d_pT,d_y,d_flow_Proton_raw[0],1.0);
 
     }
+  });
+  // (10) ======================= Phi meson analysis  =========================
+  modules.Add("phiMeson", {"event","tracks","centrality","pid","epdEP"}, {}, [&](const PicoEventProducts &ev){
+    PicoTrackColumns &tracks = *ev.tracks;
+    const Int_t centrality = ev.centrality;
+    const Float_t f_MagField = ev.bField;
+    const TVector3 &pVtx = ev.vertex;
+    const std::vector<Int_t> &v_KaonPlus_tracks = *ev.kaonsPlus;
+    const std::vector<Int_t> &v_KaonMinus_tracks = *ev.kaonsMinus;
+    const Double_t *PsiEastRaw = ev.psiEpdEastRaw;
+    const Double_t *PsiEastShifted = ev.psiEpdEastShifted;
     // cout << "The size of kaonPlus Vector "<< v_KaonPlus_tracks.size()<< endl;
     // cout << "The size of kaonMinus Vector "<< v_KaonMinus_tracks.size()<< endl;
     // (10) ======================= Phi meson analysis  =========================
     double d_cut_mother_decay_length_PHI = 0.5; // must be LESS than this
+    Int_t nKaonPairs = v_KaonPlus_tracks.size() * v_KaonMinus_tracks.size();
+    if((Int_t)rotationRandom.size() < nKaonPairs) rotationRandom.resize(nKaonPairs);
+    PicoPhilox::Uniform(opt->randomSeed, ev.runId, ev.eventInfo->eventId, 0, nKaonPairs, rotationRandom.data());
     for(unsigned int i = 0; i < v_KaonPlus_tracks.size(); i++){
-      StPicoTrack * picoTrack0 = v_KaonPlus_tracks.at(i); // i-th K+ track
-      if(!picoTrack0) continue;
+      Int_t iTrk0 = v_KaonPlus_tracks.at(i); // i-th K+ track
       // K+ Variables
-      double d_charge0  = picoTrack0->charge();
-      double d_px0      = picoTrack0->pMom().x();
-      double d_py0      = picoTrack0->pMom().y();
-      double d_pz0      = picoTrack0->pMom().z();
-      double d_pT0      = picoTrack0->pPt();
+      double d_charge0  = tracks.charge[iTrk0];
+      double d_px0      = tracks.pMomX[iTrk0];
+      double d_py0      = tracks.pMomY[iTrk0];
+      double d_pz0      = tracks.pMomZ[iTrk0];
+      double d_pT0      = tracks.pt[iTrk0];
       double d_mom0     = sqrt(d_pT0*d_pT0 + d_pz0*d_pz0);
-      StPicoBTofPidTraits *trait0 = NULL;
-      double d_tofBeta0    = -999.;
+      double d_tofBeta0    = tracks.tofBeta[iTrk0];
       double d_inv_tofBeta0    = -999.;
-      if(picoTrack0->isTofTrack()) trait0 = dst->btofPidTraits( picoTrack0->bTofPidTraitsIndex() );
-      if(trait0)        d_tofBeta0 = trait0->btofBeta();
       double d_M0   = _massKaon;
       double d_E0   = sqrt((d_px0*d_px0+d_py0*d_py0+d_pz0*d_pz0)+_massKaon*_massKaon);
       double d_y0   = ((d_E0-d_pz0) != 0.0) ? 0.5*TMath::Log( (d_E0 + d_pz0) / (d_E0 - d_pz0) ) : -999.0;
@@ -2010,21 +2566,17 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
         h2_TOF_beta_pq  -> Fill(d_pq0,d_inv_tofBeta0);
       }
       for(unsigned int j = 0; j < v_KaonMinus_tracks.size(); j++){
-        StPicoTrack * picoTrack1 = v_KaonMinus_tracks.at(j); // j-th K- track
-        if(!picoTrack1) continue;
+        Int_t iTrk1 = v_KaonMinus_tracks.at(j); // j-th K- track
         // K- Variables
-        double d_charge1  = picoTrack1->charge();
+        double d_charge1  = tracks.charge[iTrk1];
         if(d_charge0 == d_charge1) continue; // same charge cut
-        double d_px1      = picoTrack1->pMom().x();
-        double d_py1      = picoTrack1->pMom().y();
-        double d_pz1      = picoTrack1->pMom().z();
-        double d_pT1      = picoTrack1->pPt();
+        double d_px1      = tracks.pMomX[iTrk1];
+        double d_py1      = tracks.pMomY[iTrk1];
+        double d_pz1      = tracks.pMomZ[iTrk1];
+        double d_pT1      = tracks.pt[iTrk1];
         double d_mom1     = sqrt(d_pT1*d_pT1 + d_pz1*d_pz1);
-        StPicoBTofPidTraits *trait1 = NULL;
-        double d_tofBeta1    = -999.;
+        double d_tofBeta1    = tracks.tofBeta[iTrk1];
         double d_inv_tofBeta1    = -999.;
-        if(picoTrack1->isTofTrack()) trait1 = dst->btofPidTraits( picoTrack1->bTofPidTraitsIndex() );
-        if(trait1)        d_tofBeta1 = trait1->btofBeta();
         double d_M1   = _massKaon;
         double d_E1   = sqrt((d_px1*d_px1+d_py1*d_py1+d_pz1*d_pz1)+_massKaon*_massKaon);
         double d_y1   = ((d_E1-d_pz1) != 0.0) ? 0.5*TMath::Log( (d_E1 + d_pz1) / (d_E1 - d_pz1) ) : -999.0;
@@ -2047,7 +2599,7 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
                               + d_M1*d_M1
                               + 2.0 *d_E0*d_E1
                               - 2.0 *(d_px0*d_px1+d_py0*d_py1+d_pz0*d_pz1) );
-        Double_t randomNumber = gRandom->Uniform(1);
+        Double_t randomNumber = rotationRandom[i*v_KaonMinus_tracks.size() + j];
         // std::cout << "randomNumber " << randomNumber  << std::endl;
         double d_randAngle = TMath::Pi()*randomNumber;
         // std::cout << "randomAngle " << d_randAngle  << std::endl;
@@ -2102,8 +2654,8 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
           }
         }
         // ---------------- phi-meson cuts: decay length, dip angle ------------
-        StPicoPhysicalHelix    trackhelix0 = picoTrack0->helix(f_MagField);
-        StPicoPhysicalHelix    trackhelix1 = picoTrack1->helix(f_MagField);
+        StPicoPhysicalHelix    trackhelix0 = tracks.Helix(iTrk0,f_MagField);
+        StPicoPhysicalHelix    trackhelix1 = tracks.Helix(iTrk1,f_MagField);
         pair<double,double> pairLengths = trackhelix0.pathLengths(trackhelix1);
         TVector3 v3D_x_daughter0 = trackhelix0.at(pairLengths.first);
         TVector3 v3D_x_daughter1 = trackhelix1.at(pairLengths.second);
@@ -2562,12 +3114,353 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
 
       }
     }
-    v_Proton_tracks.clear();
-    v_KaonPlus_tracks.clear();
-    v_KaonMinus_tracks.clear();
-    v_KaonPlus_tracks_flexTOF.clear();
-    v_KaonMinus_tracks_flexTOF.clear();
+  });
+  { // modules of the user, with their histograms in the .picoDst.result.root output
+    TDirectory *savedDir = gDirectory;
+    outputFile->cd();
+    for(unsigned int i=0; i<AnalysisModuleFactories().size(); i++) AnalysisModuleFactories()[i](modules, outputFile);
+    savedDir->cd();
+  }
+  if(workerId <= 0) modules.Print();
+  PicoEventProducts products; // per event fields are set in the event loop
+  products.eventInfo  = &eventInfo;
+  products.epOrder    = EpOrder;
+  products.tracks     = &tracks;
+  products.goodTracks = &vGoodTracks;
+  products.epdHits    = &epdHits;
+  products.protons    = &v_Proton_tracks;
+  products.kaonsPlus  = &v_KaonPlus_tracks;
+  products.kaonsMinus = &v_KaonMinus_tracks;
+  products.nEpdEast          = N_Epd_east;
+  products.qEpdEastRaw       = QrawEastSide;
+  products.psiEpdEastRaw     = PsiEastRaw;
+  products.psiEpdEastShifted = PsiEastShifted;
+  products.resolution        = d_resolution;
+  products.nTpc              = NTpcAll;
+  products.qTpcRaw           = QrawTpcAll;
+  products.psiTpcRaw         = PsiTpcAllRaw;
+  products.psiTpcShifted     = PsiTpcAllShifted;
+  products.epBlockEvent      = -1;
+  // ------------- Event planes of a block of events, epbatch=N, see PicoEpBatch.h ------------
+  // The records of the pipeline are kept until the block is full. The stages before
+  // the event planes run event by event, the Q-vectors of the events they keep are
+  // corrected at once, then the events are decoded again and the event plane stages
+  // and the observable modules run on the angles of the block.
+  struct EpBlockEvent { // kept by the stages before the event planes
+    Int_t    record; // in epBlockRecords
+    Int_t    runId;
+    TVector3 vertex;
+    Float_t  bField;
+    Int_t    centrality;
+    std::vector<Int_t> goodTracks, protons, kaonsPlus, kaonsMinus;
+    Int_t    nEpdEast[_nEventTypeBins];
+    Double_t qEpdEastRaw[_nEventTypeBins][2];
+    Int_t    nTpc[_nEventTypeBins_tpc];
+    Double_t qTpcRaw[_nEventTypeBins_tpc][2];
+  };
+  const Int_t epStages = modules.Find("epdEventPlane"); // first entry run on the angles of the block
+  std::vector<PicoEventRecord> epBlockRecords(TMath::Max(opt->epBatchSize, 0));
+  std::vector<EpBlockEvent>    epBlockEvents(TMath::Max(opt->epBatchSize, 0));
+  std::vector<Int_t>           epBlockCentBins(TMath::Max(opt->epBatchSize, 0));
+  Int_t epBlockN = 0; // records in the block
+  PicoEpBatchKernels<_EpTermsMaxIni> epBatch;
+  PicoEpCorrectionTable<_EpTermsMaxIni> epdTable[_nEventTypeBins], tpcTable[_nEventTypeBins_tpc];
+  if(opt->epBatchSize > 0){
+    PicoEpBatchKernels<_EpTermsMaxIni>::ForOrder(EpOrder, epBatch); // as ep, checked in PicoAnalyzer()
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdTable[EventTypeId].Load(mEpdRecenterInput[EventTypeId], mEpdShiftInput_sin[EventTypeId], mEpdShiftInput_cos[EventTypeId]);
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcTable[EventTypeId_tpc].Load(mTpcRecenterInput[EventTypeId_tpc], mTpcShiftInput_sin[EventTypeId_tpc],
+                                     mTpcShiftInput_cos[EventTypeId_tpc]);
+    }
+  }
+  // epcheck=1: the angles of the block against PicoEpEventAngles(), the event by event reference
+  Long64_t epCheckAngles = 0, epCheckMismatches = 0;
+  std::function<void(const char*, Int_t, const PicoEpAngles&, const PicoEpAngles&)> checkEpAngles =
+    [&](const char *subEvent, Int_t id, const PicoEpAngles &block, const PicoEpAngles &reference){
+    const Double_t blockPsi[3]     = {block.psiRaw, block.psiRecenter, block.psiShifted};
+    const Double_t referencePsi[3] = {reference.psiRaw, reference.psiRecenter, reference.psiShifted};
+    const Double_t AngleWrapAround = 2.0*TMath::Pi()/(Double_t)EpOrder;
+    for(int i=0; i<3; i++){
+      epCheckAngles++;
+      Double_t diff = TMath::Abs(blockPsi[i] - referencePsi[i]);
+      if(blockPsi[i] != -999.0 && referencePsi[i] != -999.0) diff = TMath::Min(diff, TMath::Abs(diff - AngleWrapAround));
+      else if(blockPsi[i] != referencePsi[i]) diff = 1.0;
+      if(diff < 1e-9) continue;
+      if(++epCheckMismatches <= 10){
+        if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+        std::cout << "epcheck: entry " << iEntry << " " << subEvent << id << ((i == 0) ? " raw" : (i == 1) ? " recentered" : " shifted")
+                  << " psi " << blockPsi[i] << " of the block, " << referencePsi[i] << " event by event" << std::endl;
+      }
+    }
+  };
+  // Runs the records of the block, kFALSE if one of them stops the event loop (the events before it are done)
+  std::function<Bool_t()> runEpBlock = [&](){
+    Bool_t stop = kFALSE;
+    Int_t nRun = 0; // events kept by the stages before the event planes
+    for(Int_t e=0; e<epBlockN; e++){
+      PicoEventRecord &record = epBlockRecords[e];
+      allocCounter.End(); // of the previous event
+      iEntry = record.entry;
+      if(record.status != PicoEventRecord::kRead && opt->skipBad){
+        skipLog.Add(mPicoDst, iEntry, record.status);
+        continue;
+      }
+      if(record.status == PicoSkipLog::kNoEvent){
+        std::cout << "Something went wrong, my Lord! Event is hiding from me..." << std::endl;
+        stop = kTRUE;
+        break;
+      }
+      if(record.status != PicoEventRecord::kRead){
+        std::cout << "Something went wrong, my Lord! Nothing to analyze..." << std::endl;
+        stop = kTRUE;
+        break;
+      }
+      eventInfo = record.info;
+      UnpackEventLeaves(record.leaves, tracks, epdHits);
+      if(!modules.Process(products, 0, epStages)){
+        if(tracksLost){
+          stop = kTRUE;
+          break;
+        }
+        continue;
+      }
+      EpBlockEvent &event = epBlockEvents[nRun++];
+      event.record     = e;
+      event.runId      = products.runId;
+      event.vertex     = products.vertex;
+      event.bField     = products.bField;
+      event.centrality = products.centrality;
+      event.goodTracks = vGoodTracks;
+      event.protons    = v_Proton_tracks;
+      event.kaonsPlus  = v_KaonPlus_tracks;
+      event.kaonsMinus = v_KaonMinus_tracks;
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+        event.nEpdEast[EventTypeId]       = N_Epd_east[EventTypeId];
+        event.qEpdEastRaw[EventTypeId][0] = QrawEastSide[EventTypeId][0];
+        event.qEpdEastRaw[EventTypeId][1] = QrawEastSide[EventTypeId][1];
+      }
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+        event.nTpc[EventTypeId_tpc]       = NTpcAll[EventTypeId_tpc];
+        event.qTpcRaw[EventTypeId_tpc][0] = QrawTpcAll[EventTypeId_tpc][0];
+        event.qTpcRaw[EventTypeId_tpc][1] = QrawTpcAll[EventTypeId_tpc][1];
+      }
+    }
+    allocCounter.End(); // the second pass below is not counted
+    // ----------------- Q-vectors of the block to event planes ----------------------
+    for(Int_t e=0; e<nRun; e++) epBlockCentBins[e] = PicoEpCorrectionTable<_EpTermsMaxIni>::Bin(epBlockEvents[e].centrality);
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      PicoEpSubBlock<_EpTermsMaxIni> &sub = epdBlock[EventTypeId];
+      sub.Resize(nRun);
+      for(Int_t e=0; e<nRun; e++){
+        const EpBlockEvent &event = epBlockEvents[e];
+        sub.good[e] = (event.nEpdEast[EventTypeId] >= 5) && (event.qEpdEastRaw[EventTypeId][0] || event.qEpdEastRaw[EventTypeId][1]);
+        sub.Qx[e]   = event.qEpdEastRaw[EventTypeId][0];
+        sub.Qy[e]   = event.qEpdEastRaw[EventTypeId][1];
+      }
+      epBatch.Run(nRun, epBlockCentBins.data(), epdTable[EventTypeId], sub);
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      PicoEpSubBlock<_EpTermsMaxIni> &sub = tpcBlock[EventTypeId_tpc];
+      sub.Resize(nRun);
+      for(Int_t e=0; e<nRun; e++){
+        const EpBlockEvent &event = epBlockEvents[e];
+        sub.good[e] = (event.nTpc[EventTypeId_tpc] >= 5) && (event.qTpcRaw[EventTypeId_tpc][0] || event.qTpcRaw[EventTypeId_tpc][1]);
+        sub.Qx[e]   = event.qTpcRaw[EventTypeId_tpc][0];
+        sub.Qy[e]   = event.qTpcRaw[EventTypeId_tpc][1];
+      }
+      epBatch.Run(nRun, epBlockCentBins.data(), tpcTable[EventTypeId_tpc], sub);
+    }
+    // ----------------- Event plane stages and observables, event by event ----------
+    for(Int_t e=0; e<nRun; e++){
+      const EpBlockEvent &event = epBlockEvents[e];
+      const PicoEventRecord &record = epBlockRecords[event.record];
+      iEntry    = record.entry;
+      eventInfo = record.info;
+      UnpackEventLeaves(record.leaves, tracks, epdHits);
+      tracks.Decode(event.vertex.X(), event.vertex.Y(), event.vertex.Z());
+      epdHits.Decode();
+      epdTiles.EtaPhi(epdHits, event.vertex, &epdEta[0], &epdPhi[0]); // sized by the first pass
+      products.runId      = event.runId;
+      products.vertex     = event.vertex;
+      products.bField     = event.bField;
+      products.centrality = event.centrality;
+      products.epdEta     = &epdEta[0];
+      products.epdPhi     = &epdPhi[0];
+      vGoodTracks        = event.goodTracks;
+      v_Proton_tracks    = event.protons;
+      v_KaonPlus_tracks  = event.kaonsPlus;
+      v_KaonMinus_tracks = event.kaonsMinus;
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+        N_Epd_east[EventTypeId]      = event.nEpdEast[EventTypeId];
+        QrawEastSide[EventTypeId][0] = event.qEpdEastRaw[EventTypeId][0];
+        QrawEastSide[EventTypeId][1] = event.qEpdEastRaw[EventTypeId][1];
+      }
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+        NTpcAll[EventTypeId_tpc]       = event.nTpc[EventTypeId_tpc];
+        QrawTpcAll[EventTypeId_tpc][0] = event.qTpcRaw[EventTypeId_tpc][0];
+        QrawTpcAll[EventTypeId_tpc][1] = event.qTpcRaw[EventTypeId_tpc][1];
+      }
+      if(opt->epBatchCheck){
+        PicoEpAngles block, reference;
+        for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+          epdBlock[EventTypeId].Get(e, block);
+          PicoEpEventAngles<_EpTermsMaxIni>(ep, N_Epd_east[EventTypeId], QrawEastSide[EventTypeId], mEpdRecenterInput[EventTypeId],
+                                            mEpdShiftInput_sin[EventTypeId], mEpdShiftInput_cos[EventTypeId], event.centrality, reference);
+          checkEpAngles("EPD", EventTypeId, block, reference);
+        }
+        for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+          tpcBlock[EventTypeId_tpc].Get(e, block);
+          PicoEpEventAngles<_EpTermsMaxIni>(ep, NTpcAll[EventTypeId_tpc], QrawTpcAll[EventTypeId_tpc], mTpcRecenterInput[EventTypeId_tpc],
+                                            mTpcShiftInput_sin[EventTypeId_tpc], mTpcShiftInput_cos[EventTypeId_tpc], event.centrality,
+                                            reference);
+          checkEpAngles("TPC", EventTypeId_tpc, block, reference);
+        }
+      }
+      products.epBlockEvent = e;
+      modules.Process(products, epStages);
+    }
+    products.epBlockEvent = -1;
+    epBlockN = 0;
+    return !stop;
+  };
+  // (3) =========================== Event loop ====================================
+  Long64_t firstEvent, endEvent;
+  AnalyzerEventRange(opt, events2read, firstEvent, endEvent);
+  TFile *checkpointOutputs[3] = {outputFile, mCorrectionOutputFile, PhiMesonAnaOutputFile};
+  Long64_t startEvent = firstEvent;
+  if(resumeCheckpoint){
+    if(!checkpoint.Restore(checkpointOutputs, mEvtcut, mTrkcut, skipLog)){
+      std::cout << "Checkpoint " << checkpoint.mFileName << " can not be restored, remove it to start over" << std::endl;
+      return kFALSE;
+    }
+    startEvent = checkpoint.mNextEvent;
+    std::cout << "Resuming from the checkpoint at event #" << startEvent << std::endl;
+  }
+  PicoEntryQueue wholeChain(startEvent, endEvent, events2read); // serial job: one block
+  if(!entryQueue) entryQueue = &wholeChain;
+  PicoWatchFolder *watchFolder = opt->watchFolder; // watch=DIR, serial job only
+  std::function<void()> publishOutputs = [&](){
+    TObject *etaWeights[2] = {&wt, v1WtaWt};
+    watchFolder->Publish(checkpointOutputs, 3, etaWeights, 2);
+  };
+  // ------------- Reading of the entries, on a producer thread with pipeline=N ------------
+  PicoEventReader eventReader;
+  eventReader.mChain        = mPicoDst;
+  eventReader.mPicoEvent    = mPicoEvent;
+  eventReader.mSkimEntry    = (opt->skimInput) ? &skimEntry : NULL;
+  eventReader.mEntryList    = mEntryList;
+  eventReader.mLazyReader   = (opt->lazyRead) ? &lazyReader : NULL;
+  eventReader.mCacheMonitor = (opt->cacheSize > 0) ? &cacheMonitor : NULL;
+  eventReader.mStageCache   = opt->stageCache;
+  cacheMonitor.mStageCache  = opt->stageCache; // the original file names in the statistics and the skip log
+  skipLog.mStageCache       = opt->stageCache;
+  eventReader.mNextFile     = opt->nextFileOpener;
+  eventReader.mReadTrace    = opt->readTrace;
+  eventReader.mInfo         = &eventInfo;
+  eventReader.mTracks       = &tracks;
+  eventReader.mEpdHits      = &epdHits;
+  PicoRecordQueue  *records = NULL;
+  PicoEventInfo     producerInfo;
+  PicoTrackColumns *producerTracks  = NULL;
+  EpdHitBuffer     *producerEpdHits = NULL;
+  std::thread producer;
+  if(opt->pipelineDepth > 0){ // the producer reads into its own buffers, the loop gets copies
+    producerTracks  = new PicoTrackColumns(mPicoDst);
+    producerEpdHits = new EpdHitBuffer(mPicoDst);
+    eventReader.mInfo    = &producerInfo;
+    eventReader.mTracks  = producerTracks;
+    eventReader.mEpdHits = producerEpdHits;
+    records  = new PicoRecordQueue(opt->pipelineDepth);
+    producer = std::thread(PicoEventProducer, &eventReader, entryQueue, records);
+  }
+  Long64_t iEventEnd = 0;
+  Bool_t complete = kTRUE; // kFALSE: the event loop is stopped by an unreadable event
+  for(Long64_t iEvent=0; ; iEvent++)
+  {
+    allocCounter.End(); // of the previous event
+    iEntry = -1;
+    Int_t readStatus = PicoEventRecord::kRead;
+    if(records){ // the next event of the producer
+      PicoEventRecord *record = records->ReadSlot();
+      if(record->status == PicoEventRecord::kEnd){
+        if(epBlockN > 0 && !runEpBlock()) complete = kFALSE;
+        break;
+      }
+      if(opt->epBatchSize > 0){ // epbatch=N: the record is kept for its block
+        iEvent = record->iEvent;
+        std::swap(epBlockRecords[epBlockN++], *record); // the producer refills every field of the slot
+        records->Pop();
+        if((iEvent+1)%100 == 0) {
+          if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+          std::cout << "Working on event #[" << (iEvent+1)<< "/" << events2read << "]" << std::endl;
+        }
+        if(epBlockN == opt->epBatchSize && !runEpBlock()){
+          complete = kFALSE;
+          break;
+        }
+        continue;
+      }
+      iEvent     = record->iEvent;
+      iEntry     = record->entry;
+      readStatus = record->status;
+      if(readStatus == PicoEventRecord::kRead){
+        eventInfo = record->info;
+        UnpackEventLeaves(record->leaves, tracks, epdHits);
+      }
+      records->Pop();
+    } else if(iEvent >= iEventEnd){ // take the next block of entries
+      Bool_t taken = entryQueue->Take(iEvent, iEventEnd);
+      std::vector<TString> newFiles;
+      while(!taken && watchFolder && watchFolder->WaitForFiles(newFiles, publishOutputs)){ // watch=DIR: new files
+        events2read = watchFolder->AddFiles(mPicoDst, newFiles);
+        wholeChain.Extend(events2read);
+        taken = entryQueue->Take(iEvent, iEventEnd);
+        newFiles.clear();
+      }
+      if(!taken) break;
+    }
+    if(watchFolder && iEvent % 1000 == 0 && watchFolder->PublishDue()) publishOutputs();
+    if(useCheckpoint && iEvent > startEvent && (iEvent - firstEvent) % opt->checkpointEvents == 0){
+      checkpoint.Write(iEvent, checkpointOutputs, mEvtcut, mTrkcut, mQvectorTree, skipLog);
+    }
+    // ---------------------- Event reading quality assurance ----------------------
+    if((iEvent+1)%100 == 0) {
+      // gRandom->SetSeed((unsigned)1 /*time(0)+iEvent*/);
+      // gRandom = new TRandom3(0);
+      if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+      std::cout << "Working on event #[" << (iEvent+1)<< "/" << events2read << "]" << std::endl;
+    }
+    if(!records) readStatus = eventReader.Read(iEvent, iEntry);
+    if( readStatus != PicoEventRecord::kRead && opt->skipBad ) {
+      skipLog.Add(mPicoDst, iEntry, readStatus);
+      continue;
+    }
+    if( readStatus == PicoSkipLog::kNoEvent ) {
+        std::cout << "Something went wrong, my Lord! Event is hiding from me..."
+        << std::endl;
+        complete = kFALSE;
+        break;
+    }
+    if( readStatus != PicoEventRecord::kRead ) {
+        std::cout << "Something went wrong, my Lord! Nothing to analyze..."
+        << std::endl;
+        complete = kFALSE;
+        break;
+    }
+    // (4) - (10) =============== Shared stages and observable modules ======================
+    if(!modules.Process(products) && tracksLost){ // the event is cut, or its tracks can not be read
+      complete = kFALSE;
+      break;
+    }
   }  // Event Loop
+  allocCounter.End();
+  if(opt->epBatchCheck && opt->epBatchSize > 0){
+    if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+    std::cout << "epcheck: " << epCheckMismatches << " of " << epCheckAngles
+              << " event plane angles of the blocks differ from the event by event correction" << std::endl;
+  }
   // subtraction
   for(int cent=0;cent<4;cent++){
     hist_SE_pt_y_Phi_tight_Sig[cent] = (TH2D*) hist_SE_pt_y_Phi_tight_SigBkg[cent]->Clone(Form("hist_SE_pt_y_Phi_tight_Sig_%d",cent));
@@ -3057,7 +3950,47 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
       mProfile_v2_reso_rapSetA_centSetB[rap][cent] = mHist_v2_reso_rapSetA_centSetB[rap][cent]->ProfileX();;
     }
   }
+  modules.Finish();
+  if(watchFolder) publishOutputs(); // the final histograms, with the ones derived above
+  if(records){ // the producer may be waiting for a free record
+    records->Stop();
+    producer.join();
+    delete records;
+    delete producerTracks;
+    delete producerEpdHits;
+  }
+  eventReader.EndEntry(); // the reads of the last entry
+  if(opt->readTotals) opt->readTotals->Add(eventReader.mBytesRead + eventReader.mFileBytes, eventReader.mEventsRead,
+                                           eventReader.mTreeLoads, eventReader.mTreeLoadSeconds);
+  allocCounter.Print(workerId);
+  if(opt->lazyRead) lazyReader.Print();
+  if(opt->cacheSize > 0) cacheMonitor.Print(mPicoDst);
+  if(mQvectorOutputFile){
+    mQvectorOutputFile->cd();
+    mQvectorTree->Write();
+    std::cout << "Q-vectors of " << mQvectorTree->GetEntries() << " events written to " << mQvectorOutputFile->GetName() << std::endl;
+    TString qvectorName = mQvectorOutputFile->GetName();
+    if(!complete && !useCheckpoint) KeepPartialOutput(mQvectorOutputFile); // a checkpoint resumes it as it is
+    else mQvectorOutputFile->Close();
+    delete mQvectorOutputFile;
+  }
   outputFile->cd();
+  if(opt->skipBad){
+    if(workerId >= 0) std::cout << "[worker " << workerId << "] ";
+    std::cout << "Skipped " << skipLog.NEntries() << " entries in " << skipLog.mRanges.size() << " ranges, see SkippedEntries" << std::endl;
+    skipLog.MakeTree(); // in outputFile, the trees of the workers are merged
+  }
+  if(workerId >= 0){ // worker thread: histograms are merged and written by PicoAnalyzer()
+    // eta weights are configuration, not counts: every worker has them, the merge keeps one copy
+    ((TH2D*)wt.Clone())->SetDirectory(outputFile);
+    v1WtaWt->SetDirectory(outputFile);
+    workerOutput[0] = outputFile;
+    workerOutput[1] = mCorrectionOutputFile;
+    workerOutput[2] = PhiMesonAnaOutputFile;
+    if(opt->skimInput) delete mPicoDst;
+    delete picoReader;
+    return complete;
+  }
   wt.Write();
   // wt_tpc.Write();
   v1WtaWt->Write();
@@ -3068,6 +4001,721 @@ void PicoAnalyzer(const Char_t *inFile = "/star/data01/pwg/dchen/Ana/fxtPicoAna/
   // }
   mCorrectionOutputFile->Write();
   PhiMesonAnaOutputFile->Write();
+  if(!complete){ // a checkpoint is kept to resume from
+    for(int iOutput=0; iOutput<3; iOutput++) KeepPartialOutput(checkpointOutputs[iOutput]);
+    return kFALSE;
+  }
+  if(useCheckpoint) checkpoint.Remove(); // the job is complete
+  return kTRUE;
+}
+
+// =========================== Run options =============================================
+PicoAnalyzerOptions ParseAnalyzerOptions(TString options){
+  PicoAnalyzerOptions opt;
+  TObjArray *tokens = options.Tokenize(",");
+  for(int i=0; i<tokens->GetEntries(); i++){
+    TString token = ((TObjString*)tokens->At(i))->GetString();
+    token = token.Strip(TString::kBoth);
+    if(token.IsNull()) continue;
+    TString key = token, value = "";
+    Int_t eq = token.Index("=");
+    if(eq >= 0){
+      key = token(0,eq);
+      value = token(eq+1,token.Length()-eq-1);
+    }
+    if(key == "threads") opt.nThreads = value.Atoi();
+    else if(key == "block") opt.blockSize = value.Atoll();
+    else if(key == "lazy") opt.lazyRead = (value.IsNull() || value.Atoi() != 0);
+    else if(key == "seed") opt.randomSeed = (UInt_t)value.Atoll();
+    else if(key == "trace") opt.traceFile = value;
+    else if(key == "tracen") opt.traceEntries = value.Atoll();
+    else if(key == "profile") opt.profileFile = value;
+    else if(key == "cache") opt.cacheSize = (Long64_t)(value.Atof()*1024*1024);
+    else if(key == "learn") opt.cacheLearnEntries = value.Atoi();
+    else if(key == "prefetch") opt.asyncPrefetch = (value.IsNull() || value.Atoi() != 0);
+    else if(key == "tags") opt.tagFile = value;
+    else if(key == "skim") opt.skimFile = value;
+    else if(key == "input") opt.skimInput = (value == "skim");
+    else if(key == "qvec") opt.qvectorTree = (value.IsNull() || value.Atoi() != 0);
+    else if(key == "first") opt.firstEntry = value.Atoll();
+    else if(key == "last") opt.lastEntry = value.Atoll();
+    else if(key == "manifest") opt.manifestFile = value;
+    else if(key == "job") opt.shardJob = value.Atoi();
+    else if(key == "checkpoint") opt.checkpointEvents = value.Atoll();
+    else if(key == "skipbad") opt.skipBad = (value.IsNull() || value.Atoi() != 0);
+    else if(key == "pipeline") opt.pipelineDepth = value.Atoi();
+    else if(key == "watch") opt.watchDir = value;
+    else if(key == "settle") opt.watchSettle = value.Atoi();
+    else if(key == "publish") opt.publishSeconds = value.Atoi();
+    else if(key == "publishdir") opt.publishDir = value;
+    else if(key == "stage") opt.stageDir = value;
+    else if(key == "stagegb") opt.stageGB = value.Atof();
+    else if(key == "stageahead") opt.stageAhead = value.Atoi();
+    else if(key == "openahead") opt.openAhead = (value.IsNull() || value.Atoi() != 0);
+    else if(key == "epbatch") opt.epBatchSize = value.Atoi();
+    else if(key == "epcheck") opt.epBatchCheck = (value.IsNull() || value.Atoi() != 0);
+    else std::cout << "Unknown run option \"" << token << "\" is ignored" << std::endl;
+  }
+  delete tokens;
+  if(opt.blockSize < 1) opt.blockSize = 1;
+  return opt;
+}
+
+void AnalyzerEventRange(const PicoAnalyzerOptions *opt, Long64_t events2read, Long64_t &first, Long64_t &end){
+  first = TMath::Max(opt->firstEntry, (Long64_t)0);
+  end   = (opt->lastEntry >= 0) ? TMath::Min(opt->lastEntry + 1, events2read) : events2read;
+  if(end < first) end = first;
+}
+
+// =========================== Branch status ================================================
+void SetAnalyzerBranchStatus(StPicoDstReader *picoReader, const PicoAnalyzerOptions *opt){
+  picoReader->SetStatus("*",0);
+  picoReader->SetStatus("Event",1);
+  picoReader->SetStatus("Track",1);
+  picoReader->SetStatus("BTofHit",1);
+  picoReader->SetStatus("BTofPidTraits",1);
+  picoReader->SetStatus("EpdHit",1);
+  if(!picoReader->chain()) return;
+  unsigned int found;
+  picoReader->chain()->SetBranchStatus("EpdHit*",1,&found);   // note you need the asterisk
+  std::cout << "EpdHit Branch returned found= " << found << std::endl; // ? What is the EpdHit branch ? Check it on StRoot.
+  for(unsigned int i=0; i<opt->disabledBranches.size(); i++){ // read profile
+    picoReader->chain()->SetBranchStatus(opt->disabledBranches[i],0);
+  }
+}
+
+// =========================== Tag index =====================================================
+TEntryList* LoadTagEntryList(const Char_t *inFile, const TString &tagFile, Int_t sys_cutN, Int_t sys_varN){
+  std::lock_guard<std::mutex> lock(gReaderInitMutex);
+  StPicoDstReader* tagReader = new StPicoDstReader(inFile);
+  tagReader->Init();
+  TEntryList *entryList = (tagReader->chain()) ? MakeTagEntryList(tagReader->chain(), tagFile, sys_cutN, sys_varN) : NULL;
+  if(!entryList) std::cout << "Tag index " << tagFile << " is not used, reading the whole chain" << std::endl;
+  delete tagReader;
+  return entryList;
+}
+
+TEntryList* LoadShardEntryList(const Char_t *inFile, const TString &manifestFile, Int_t job){
+  std::vector<PicoShardUnit> units;
+  if(!ReadShardManifest(manifestFile, job, units)) return NULL;
+  std::lock_guard<std::mutex> lock(gReaderInitMutex);
+  StPicoDstReader* shardReader = new StPicoDstReader(inFile);
+  shardReader->Init();
+  TEntryList *entryList = (shardReader->chain()) ? MakeShardEntryList(shardReader->chain(), units) : NULL;
+  if(entryList){
+    std::cout << "Shard job " << job << ": " << units.size() << " work units, " << entryList->GetN() << " entries" << std::endl;
+  }
+  delete shardReader;
+  return entryList;
+}
+
+// =========================== Flow skim =====================================================
+// Events passing the loosest variation of every event cut, so that the skim serves all
+// sys_cutN/sys_varN: trigger, vz (sys 3 var 2), vr (sys 4 var 2), pile up and low multiplicity.
+Bool_t WriteFlowSkim(const Char_t *inFile, const PicoAnalyzerOptions &opt){
+  StPicoDstReader* picoReader = new StPicoDstReader(inFile);
+  picoReader->Init();
+  SetAnalyzerBranchStatus(picoReader, &opt);
+  TChain *mPicoDst = picoReader->chain();
+  if( !mPicoDst ) {
+      std::cout << "No chain has been found." << std::endl;
+      delete picoReader;
+      return kFALSE;
+  }
+  if(opt.cacheSize > 0) SetupAnalyzerCache(mPicoDst, &opt);
+  TClonesArray * mPicoEvent = new TClonesArray("StPicoEvent");
+  mPicoDst->SetBranchAddress("Event",&mPicoEvent);
+  EpdHitBuffer epdHits(mPicoDst);
+  PicoTrackColumns tracks(mPicoDst);
+  PicoEventInfo eventInfo;
+  Long64_t events2read = mPicoDst->GetEntries();
+  std::cout << "Number of events to skim: " << events2read << std::endl;
+
+  TFile *skimFile = new TFile(opt.skimFile,"RECREATE");
+  TTree *skimTree = new TTree("FlowSkim","Flow skim of the picoDst, see PicoFlowSkim.h");
+  PicoFlowSkimEntry skimEntry;
+  skimEntry.Branch(skimTree);
+  Bool_t complete = kTRUE; // kFALSE: an entry can not be read, the skim is written as .partial
+  for(Long64_t iEvent=0; iEvent<events2read; iEvent++){
+    if((iEvent+1)%10000 == 0) std::cout << "Working on event #[" << (iEvent+1)<< "/" << events2read << "]" << std::endl;
+    if(mPicoDst->LoadTree(iEvent) < 0){
+      complete = kFALSE;
+      break;
+    }
+    epdHits.Update();
+    tracks.Update();
+    mPicoDst->GetEntry(iEvent);
+    StPicoEvent *event = (mPicoEvent->GetEntriesFast() > 0) ? (StPicoEvent*)mPicoEvent->UncheckedAt(0) : NULL;
+    if( !event ) {
+        std::cout << "Something went wrong, my Lord! Event is hiding from me..."
+        << std::endl;
+        complete = kFALSE;
+        break;
+    }
+    eventInfo.Fill(event);
+    Bool_t isTriggered = kFALSE;
+    for(unsigned int i=0; i < eventInfo.triggerIds.size(); i++){
+      if(eventInfo.triggerIds[i] == _goodTriggerId) isTriggered = kTRUE;
+    }
+    const TVector3 &pVtx = eventInfo.primaryVertex;
+    if(!isTriggered || IsBadZVertex(pVtx.z(), 3, 2) || IsBadRVertex(VertexR(pVtx.x(), pVtx.y()), 4, 2)) continue;
+    tracks.Decode(pVtx.x(), pVtx.y(), pVtx.z());
+    Int_t nFXTMult = 0;
+    for(Int_t iTrk=0; iTrk<tracks.nTracks; iTrk++){
+      if(tracks.isPrimary[iTrk]) nFXTMult++;
+    }
+    if(IsPileUp(nFXTMult) || IsLowMult(nFXTMult)) continue;
+    epdHits.Decode();
+    skimEntry.Set(eventInfo, tracks, epdHits);
+    skimTree->Fill();
+  }
+  skimFile->cd();
+  skimTree->Write();
+  std::cout << "Flow skim " << opt.skimFile << ": " << skimTree->GetEntries() << " of " << events2read
+            << " events, " << skimFile->GetBytesWritten() << " bytes" << std::endl;
+  if(complete) skimFile->Close();
+  else KeepPartialOutput(skimFile);
+  delete picoReader;
+  return complete;
+}
+
+// =========================== Read profile ==================================================
+// The trace run is the event loop of the job over its first tracen=N entries, with the default
+// branch status. Every enabled (sub)branch that holds no entry at the end was never read and
+// is marked off; the leaves EpdHitBuffer and PicoTrackColumns switch off are not listed.
+void PicoReadTrace::Collect(TObjArray *branches){
+  TIter next(branches);
+  while(TBranch *branch = (TBranch*)next()){
+    std::string name = branch->GetName();
+    if(!branch->TestBit(kDoNotProcess) && mEnabled.insert(name).second) mOrder.push_back(name);
+    if(branch->GetReadEntry() >= 0) mRead.insert(name);
+    TIter nextLeaf(branch->GetListOfBranches());
+    while(TBranch *leaf = (TBranch*)nextLeaf()) mParentOf[leaf->GetName()] = name;
+    Collect(branch->GetListOfBranches());
+  }
+}
+
+Bool_t TraceReadProfile(const Char_t *inFile, TString outFile, Int_t inputp1, Int_t inputp2, Int_t inputp3, Int_t inputp4,
+                        const PicoAnalyzerOptions &opt){
+  PicoAnalyzerOptions traceOpt = opt;
+  traceOpt.disabledBranches.clear();
+  traceOpt.nThreads = 1;
+  traceOpt.pipelineDepth = 0;     // the reads are collected on the thread of the event loop
+  traceOpt.epBatchSize = 0;
+  traceOpt.checkpointEvents = 0;
+  traceOpt.qvectorTree = kFALSE;
+  PicoReadTrace  trace;
+  PicoReadTotals totals;
+  traceOpt.readTrace  = &trace;
+  traceOpt.readTotals = &totals;
+  Long64_t events2read = 0;
+  {
+    std::lock_guard<std::mutex> lock(gReaderInitMutex);
+    StPicoDstReader* countReader = new StPicoDstReader(inFile);
+    countReader->Init();
+    if(countReader->chain()) events2read = countReader->chain()->GetEntries();
+    delete countReader;
+  }
+  Long64_t firstEvent, endEvent;
+  AnalyzerEventRange(&traceOpt, events2read, firstEvent, endEvent);
+  endEvent = TMath::Min(endEvent, firstEvent + TMath::Max(traceOpt.traceEntries, (Long64_t)1));
+  if(endEvent <= firstEvent){
+    std::cout << "No chain has been found." << std::endl;
+    return kFALSE;
+  }
+  std::cout << "Tracing the reads of the event loop over the entries " << firstEvent << " to " << endEvent - 1 << std::endl;
+  PicoEntryQueue traceQueue(firstEvent, endEvent, endEvent - firstEvent);
+  TFile *traceOutput[3] = {NULL, NULL, NULL};
+  Bool_t complete = PicoAnalyzerWorker(inFile, outFile, inputp1, inputp2, inputp3, inputp4, &traceOpt, 0, &traceQueue, traceOutput);
+  for(int i=0; i<3; i++) delete traceOutput[i]; // in memory, not written
+  if(!complete){
+    std::cout << "The trace run did not finish its event loop, no read profile is written" << std::endl;
+    return kFALSE;
+  }
+  Bool_t readOthers = kFALSE; // with lazy=1, only events passing the event cuts read past Event
+  for(std::set<std::string>::const_iterator it=trace.mRead.begin(); it!=trace.mRead.end(); ++it){
+    if(*it != "Event" && trace.mParentOf.find(*it) == trace.mParentOf.end()) readOthers = kTRUE;
+  }
+  if(!readOthers || totals.mEvents == 0){
+    std::cout << "No event of the trace run was read past the Event branch, no read profile is written. "
+              << "Trace more entries with tracen=N" << std::endl;
+    return kFALSE;
+  }
+  // ------------------ Write the read profile --------------------------------------------
+  Double_t bytesPerEvent = (Double_t)totals.mBytes / totals.mEvents;
+  std::ofstream profile(traceOpt.traceFile.Data());
+  profile << "# PicoAnalyzer read profile of " << inFile << ", traced over " << totals.mEvents << " events" << std::endl;
+  profile << "# off: enabled, but not read by the event loop, on: read" << std::endl;
+  profile << "# bytes: bytes read from the input files per event, without the profile" << std::endl;
+  profile << "bytes " << bytesPerEvent << std::endl;
+  Int_t nOff = 0;
+  for(unsigned int i=0; i<trace.mOrder.size(); i++){
+    const std::string &name = trace.mOrder[i];
+    std::map<std::string,std::string>::const_iterator parent = trace.mParentOf.find(name);
+    Bool_t isTop = (parent == trace.mParentOf.end());
+    if(!isTop && !trace.mRead.count(parent->second)) continue; // off with its branch
+    if(trace.mRead.count(name)){
+      profile << "on " << name << std::endl;
+      continue;
+    }
+    profile << "off " << name << (isTop ? "*" : "") << std::endl; // note you need the asterisk
+    nOff++;
+  }
+  profile.close();
+  std::cout << "Read profile written to " << traceOpt.traceFile << ": " << nOff << " branches/leaves were not read, "
+            << bytesPerEvent << " bytes per event" << std::endl;
+  return kTRUE;
+}
+
+Bool_t LoadReadProfile(const TString &profileFile, std::vector<TString> &disabledBranches, Double_t &baseBytes){
+  std::ifstream profile(profileFile.Data());
+  if(!profile.is_open()){
+    std::cout << "Read profile " << profileFile << " not found" << std::endl;
+    return kFALSE;
+  }
+  std::string line;
+  while(std::getline(profile, line)){
+    TString entry(line.c_str());
+    entry = entry.Strip(TString::kBoth);
+    if(entry.BeginsWith("bytes ")) baseBytes = TString(entry(6, entry.Length())).Atof();
+    if(!entry.BeginsWith("off ")) continue; // comments and branches in use
+    entry.Remove(0,4);
+    disabledBranches.push_back(entry.Strip(TString::kBoth));
+  }
+  std::cout << "Read profile " << profileFile << ": " << disabledBranches.size() << " branches/leaves switched off" << std::endl;
+  return kTRUE;
+}
+
+void PrintReadBytes(const PicoAnalyzerOptions &opt){
+  if(!opt.readTotals || opt.readTotals->mEvents == 0) return;
+  if(opt.readTotals->mTreeLoads > 0){ // the stall that openahead=1 takes off the event loop
+    std::cout << "File boundaries: " << opt.readTotals->mTreeLoads << " next files loaded in " << opt.readTotals->mTreeLoadSeconds
+              << " s, " << 1000*opt.readTotals->mTreeLoadSeconds/opt.readTotals->mTreeLoads << " ms per file, "
+              << (opt.openAhead ? "with" : "without") << " openahead" << std::endl;
+  }
+  std::cout << "Read: " << opt.readTotals->mBytes << " bytes of the input files for " << opt.readTotals->mEvents << " events, "
+            << (Double_t)opt.readTotals->mBytes / opt.readTotals->mEvents << " bytes per event";
+  if(!opt.profileFile.IsNull() && opt.profileBaseBytes > 0){
+    std::cout << ", " << opt.profileBaseBytes << " without the read profile (its trace run)";
+  } else if(!opt.profileFile.IsNull()){
+    std::cout << " with the read profile";
+  }
+  std::cout << std::endl;
+}
+
+// =========================== TTreeCache =====================================================
+// Enabled branches, sub-branches included, i.e. the read-set of the analysis
+void CollectEnabledBranches(TObjArray *branches, std::vector<TString> &names){
+  TIter next(branches);
+  while(TBranch *branch = (TBranch*)next()){
+    if(branch->TestBit(kDoNotProcess)) continue;
+    names.push_back(branch->GetName());
+    CollectEnabledBranches(branch->GetListOfBranches(), names);
+  }
+}
+
+void SetupAnalyzerCache(TChain *chain, const PicoAnalyzerOptions *opt){
+  if(chain->LoadTree(0) < 0) return;
+  chain->SetCacheSize(opt->cacheSize);
+  chain->SetCacheLearnEntries(opt->cacheLearnEntries); // the learning phase adds what is read besides the read-set
+  std::vector<TString> names;
+  CollectEnabledBranches(chain->GetTree()->GetListOfBranches(), names);
+  for(unsigned int i=0; i<names.size(); i++) chain->AddBranchToCache(names[i], kFALSE);
+  std::cout << "TTreeCache: " << opt->cacheSize/(1024*1024) << " MB for " << names.size() << " branches, "
+            << opt->cacheLearnEntries << " learning entries, asynchronous prefetching "
+            << (opt->asyncPrefetch ? "on" : "off") << std::endl;
+}
+
+// The TTreeCache belongs to the file, a new one is created for every file of the chain,
+// so its counters are taken per file and summed by EndFile()
+void PicoCacheMonitor::Update(TChain *chain){
+  TFile *file = chain->GetCurrentFile();
+  if(!file) return;
+  if(chain->GetTreeNumber() != mTreeNumber){ // next file of the chain
+    EndFile();
+    mTreeNumber = chain->GetTreeNumber();
+    mFileName   = (mStageCache) ? mStageCache->Source(file->GetName()) : TString(file->GetName());
+  }
+  mFileBytes     = file->GetBytesRead();
+  mFileReadCalls = file->GetReadCalls();
+  TTreeCache *cache = dynamic_cast<TTreeCache*>(file->GetCacheRead(chain->GetTree()));
+  if(!cache) return;
+  mFileCacheBytes = cache->GetBytesRead();
+  mFileCacheCalls = cache->GetReadCalls();
+  mFileMissBytes  = cache->GetNoCacheBytesRead();
+  mFileMissCalls  = cache->GetNoCacheReadCalls();
+}
+
+void PicoCacheMonitor::EndFile(){
+  if(mTreeNumber < 0) return;
+  std::cout << "TTreeCache: " << mFileName << ": " << mFileBytes << " bytes in " << mFileReadCalls << " read calls, "
+            << mFileMissCalls << " reads (" << mFileMissBytes << " bytes) missed the cache" << std::endl;
+  mNFiles++;
+  mTotalBytes      += mFileBytes;
+  mTotalReadCalls  += mFileReadCalls;
+  mTotalCacheBytes += mFileCacheBytes;
+  mTotalCacheCalls += mFileCacheCalls;
+  mTotalMissBytes  += mFileMissBytes;
+  mTotalMissCalls  += mFileMissCalls;
+  mFileCacheBytes = mFileMissBytes = 0;
+  mFileCacheCalls = mFileMissCalls = 0;
+  mTreeNumber = -1;
+}
+
+void PicoCacheMonitor::Print(TChain *chain){
+  EndFile();
+  std::cout << "TTreeCache: " << mNFiles << " files, " << mTotalBytes << " bytes in " << mTotalReadCalls << " read calls";
+  if(mTotalReadCalls > 0) std::cout << " (" << mTotalBytes/mTotalReadCalls << " bytes per call)";
+  std::cout << std::endl;
+  std::cout << "TTreeCache: " << mTotalCacheBytes << " bytes in " << mTotalCacheCalls << " reads through the cache, "
+            << mTotalMissCalls << " reads (" << mTotalMissBytes << " bytes) missed it";
+  if(mTotalCacheBytes + mTotalMissBytes > 0){
+    std::cout << ", " << 100.0*mTotalCacheBytes/(mTotalCacheBytes + mTotalMissBytes) << "% of the bytes from the cache";
+  }
+  std::cout << std::endl;
+}
+
+// =========================== Lazy branch reading ===========================================
+Bool_t PicoLazyReader::ReadEvent(Long64_t entry){
+  mLocalEntry = mChain->LoadTree(entry);
+  if(mLocalEntry < 0) return kFALSE;
+  if(mChain->GetTreeNumber() != mTreeNumber){ // new file in the chain: branch pointers changed
+    mTreeNumber  = mChain->GetTreeNumber();
+    mEventBranch = mChain->GetTree()->GetBranch("Event");
+    mOtherBranches.clear();
+    TIter next(mChain->GetTree()->GetListOfBranches());
+    while(TBranch *branch = (TBranch*)next()){
+      if(branch == mEventBranch || branch->TestBit(kDoNotProcess)) continue; // disabled by SetStatus
+      mOtherBranches.push_back(branch);
+    }
+  }
+  if(!mEventBranch) return kFALSE;
+  Int_t nBytes = mEventBranch->GetEntry(mLocalEntry);
+  mNEventReads++;
+  mEventBytes += nBytes;
+  return (nBytes > 0);
+}
+
+Bool_t PicoLazyReader::ReadOthers(){
+  for(unsigned int i=0; i<mOtherBranches.size(); i++){
+    Int_t nBytes = mOtherBranches[i]->GetEntry(mLocalEntry);
+    if(nBytes < 0) return kFALSE;
+    mOtherBytes += nBytes;
+  }
+  mNFullReads++;
+  return kTRUE;
+}
+
+void PicoLazyReader::Print() const {
+  std::cout << "Lazy read: " << mNFullReads << " of " << mNEventReads << " events passed the event cuts and were fully read" << std::endl;
+  std::cout << "Lazy read: " << mEventBytes << " bytes from the Event branch, " << mOtherBytes << " bytes from the other branches" << std::endl;
+}
+
+// ======================= Reading of an entry ===============================================
+Int_t PicoEventReader::Read(Long64_t iEvent, Long64_t &iEntry){
+  iEntry = (mEntryList) ? mChain->GetEntryNumber(iEvent) : iEvent;
+  if(iEntry >= mBadFileFirst && iEntry < mBadFileEnd) return PicoSkipLog::kBadFile; // not tried again
+  if(mStageCache && mTreeNumber == -2){ // the first file is read from its copy if an earlier pass staged it
+    mTreeNumber = PicoSkipLog::TreeOf(mChain, iEntry) - 1;
+    mStageCache->Use(mChain, mTreeNumber);
+  }
+  EndEntry(); // before LoadTree() closes the file
+  // A next file is opened by LoadTree(), which is timed: with openahead=1 it should not wait
+  TTree *tree = mChain->GetTree();
+  Bool_t nextFile = (tree && mTreeNumber >= 0 &&
+                     (iEntry < mChain->GetChainOffset() || iEntry >= mChain->GetChainOffset() + tree->GetEntries()));
+  TStopwatch loadTimer;
+  // readPicoEvent() reads its own running entry counter, workers need the entry of their block
+  Long64_t localEntry = mChain->LoadTree(iEntry);
+  if(nextFile){
+    loadTimer.Stop();
+    mTreeLoads++;
+    mTreeLoadSeconds += loadTimer.RealTime();
+  }
+  if(localEntry < 0){
+    mBadFileFirst = iEntry;
+    mBadFileEnd   = PicoSkipLog::NextFileEntry(mChain, iEntry);
+    return PicoSkipLog::kBadFile;
+  }
+  if(mChain->GetTreeNumber() != mTreeNumber){ // new file: switch the next one to its copy and open it ahead
+    mTreeNumber = mChain->GetTreeNumber();
+    mBytesRead += mFileBytes;
+    mFileBytes  = 0;
+    if(mStageCache) mStageCache->Use(mChain, mTreeNumber);
+    if(mNextFile) mNextFile->Next(mChain, mTreeNumber);
+  }
+  if(!mSkimEntry){ // new tree: bind the EpdHit and Track leaves before reading
+    mEpdHits->Update();
+    mTracks->Update();
+  } else {
+    mSkimEntry->Update(mChain);
+  }
+  Bool_t readEvent = (mLazyReader) ? mLazyReader->ReadEvent(iEntry) : (mChain->GetEntry(iEntry) > 0);
+  if(!readEvent) return PicoSkipLog::kReadError;
+  if(mCacheMonitor) mCacheMonitor->Update(mChain);
+  if(mSkimEntry){
+    mSkimEntry->Get(*mInfo, *mTracks, *mEpdHits);
+    mEventsRead++;
+    return PicoEventRecord::kRead;
+  }
+  StPicoEvent *event = (mPicoEvent->GetEntriesFast() > 0) ? (StPicoEvent*)mPicoEvent->UncheckedAt(0) : NULL;
+  if(!event) return PicoSkipLog::kNoEvent;
+  mInfo->Fill(event);
+  mEventsRead++;
+  return PicoEventRecord::kRead;
+}
+void PicoEventReader::EndEntry(){
+  TFile *file = mChain->GetCurrentFile();
+  if(!file || mTreeNumber < 0) return;
+  mFileBytes = file->GetBytesRead();
+  if(mReadTrace) mReadTrace->Collect(mChain->GetTree());
+}
+
+void PicoEventProducer(PicoEventReader *reader, PicoEntryQueue *entryQueue, PicoRecordQueue *records){
+  Long64_t first, end;
+  while(!records->Stopped() && entryQueue->Take(first, end)){
+    for(Long64_t iEvent=first; iEvent<end; iEvent++){
+      PicoEventRecord *record = records->WriteSlot();
+      if(!record) return; // the event loop has ended
+      record->iEvent = iEvent;
+      record->status = reader->Read(iEvent, record->entry);
+      if(record->status == PicoEventRecord::kRead){
+        record->info = *reader->mInfo;
+        PackEventLeaves(*reader->mTracks, *reader->mEpdHits, record->leaves);
+      }
+      records->Push();
+    }
+  }
+  PicoEventRecord *record = records->WriteSlot();
+  if(!record) return;
+  record->status = PicoEventRecord::kEnd;
+  records->Push();
+}
+
+// ======================= Output files of the event loop ===================================
+TFile* OpenAnalyzerOutput(const TString &name, Int_t workerId){
+  if(workerId < 0) return new TFile(name,"RECREATE");
+  return new TMemFile(name,"RECREATE"); // worker thread, merged by MergeWorkerOutputs()
+}
+
+// Output of an event loop that did not finish: closed and renamed to <name>.partial, so the
+// drivers (PicoParallel.sh, PicoIncremental.sh) do not take it for a complete one
+void KeepPartialOutput(TFile *file){
+  TString name = file->GetName();
+  file->Close();
+  if(gSystem->Rename(name, name + ".partial") == 0) std::cout << "The event loop did not finish, " << name << " is written as " << name << ".partial" << std::endl;
+  else std::cout << "The event loop did not finish, " << name << " can not be renamed to " << name << ".partial" << std::endl;
+}
+
+// =========================== Checkpoint ====================================================
+Bool_t PicoCheckpoint::Open(){
+  if(gSystem->AccessPathName(mFileName)) return kFALSE; // no snapshot, fresh start
+  TDirectory *savedDir = gDirectory;
+  TFile *file = TFile::Open(mFileName,"READ");
+  TObjString *signature = (file && !file->IsZombie()) ? (TObjString*)file->Get("signature") : NULL;
+  TParameter<Long64_t> *nextEvent = (signature) ? (TParameter<Long64_t>*)file->Get("nextEvent") : NULL;
+  TParameter<Long64_t> *qvectorEntries = (signature) ? (TParameter<Long64_t>*)file->Get("qvectorEntries") : NULL;
+  TObjString *fileList = (signature && !mFileList.IsNull()) ? (TObjString*)file->Get("fileList") : NULL;
+  Bool_t found = kFALSE;
+  if(!nextEvent || !qvectorEntries){
+    std::cout << "Checkpoint " << mFileName << " can not be read, the job starts over" << std::endl;
+  } else if(signature->GetString() != mSignature){
+    std::cout << "Checkpoint " << mFileName << " belongs to a job with other arguments, the job starts over" << std::endl;
+  } else if(!mFileList.IsNull() && (!fileList || !FileListText().BeginsWith(fileList->GetString()))){
+    std::cout << "Checkpoint " << mFileName << ": " << mFileList << " does not begin with its files, the job starts over" << std::endl;
+  } else {
+    mNextEvent = nextEvent->GetVal();
+    mQvectorEntries = qvectorEntries->GetVal();
+    found = kTRUE;
+  }
+  delete file;
+  savedDir->cd();
+  return found;
+}
+
+// The snapshot is written next to the old one and then renamed, so a job stopped while
+// writing it still finds the previous one
+Bool_t PicoCheckpoint::Write(Long64_t nextEvent, TFile **outputs, const int *evtcut, const int *trkcut,
+                             TTree *qvectorTree, const PicoSkipLog &skipLog){
+  TDirectory *savedDir = gDirectory;
+  Long64_t qvectorEntries = -1;
+  if(qvectorTree){ // the tree must not be behind the snapshot
+    qvectorTree->AutoSave("SaveSelf");
+    qvectorEntries = qvectorTree->GetEntries();
+  }
+  TString tmpName = mFileName + ".tmp";
+  TFile *file = new TFile(tmpName,"RECREATE");
+  if(file->IsZombie()){
+    std::cout << "Checkpoint " << tmpName << " can not be written" << std::endl;
+    delete file;
+    savedDir->cd();
+    return kFALSE;
+  }
+  TObjString signature(mSignature);
+  file->WriteTObject(&signature,"signature");
+  if(!mFileList.IsNull()){ // the chain of the snapshot, later runs only append to the list
+    TObjString fileList(FileListText());
+    file->WriteTObject(&fileList,"fileList");
+  }
+  TParameter<Long64_t> nextEventPar("nextEvent",nextEvent);
+  file->WriteTObject(&nextEventPar);
+  TParameter<Long64_t> qvectorEntriesPar("qvectorEntries",qvectorEntries);
+  file->WriteTObject(&qvectorEntriesPar);
+  for(int i=0; i<kNEvtcut; i++){
+    TParameter<Int_t> cut(Form("evtcut%d",i),evtcut[i]);
+    file->WriteTObject(&cut);
+  }
+  for(int i=0; i<kNTrkcut; i++){
+    TParameter<Int_t> cut(Form("trkcut%d",i),trkcut[i]);
+    file->WriteTObject(&cut);
+  }
+  file->cd();
+  skipLog.MakeTree()->Write();
+  for(int iOutput=0; iOutput<3; iOutput++){ // by name, the booked names of an output are unique
+    TDirectory *dir = file->mkdir(Form("output%d",iOutput));
+    TIter next(outputs[iOutput]->GetList());
+    while(TObject *obj = next()){
+      if(obj->InheritsFrom(TH1::Class())) dir->WriteTObject(obj);
+    }
+  }
+  file->Close();
+  delete file;
+  Bool_t written = (gSystem->Rename(tmpName, mFileName) == 0);
+  savedDir->cd();
+  if(written) std::cout << "Checkpoint at event #" << nextEvent << " written to " << mFileName << std::endl;
+  else std::cout << "Checkpoint " << tmpName << " can not be renamed to " << mFileName << std::endl;
+  return written;
+}
+
+// Histograms are reset and the snapshot added, 0 + x keeps every bin exactly as saved
+Bool_t PicoCheckpoint::Restore(TFile **outputs, int *evtcut, int *trkcut, PicoSkipLog &skipLog){
+  TDirectory *savedDir = gDirectory;
+  TFile *file = TFile::Open(mFileName,"READ");
+  Bool_t restored = (file && !file->IsZombie());
+  for(int i=0; restored && i<kNEvtcut; i++){
+    TParameter<Int_t> *cut = (TParameter<Int_t>*)file->Get(Form("evtcut%d",i));
+    if(cut) evtcut[i] = cut->GetVal();
+    else restored = kFALSE;
+  }
+  for(int i=0; restored && i<kNTrkcut; i++){
+    TParameter<Int_t> *cut = (TParameter<Int_t>*)file->Get(Form("trkcut%d",i));
+    if(cut) trkcut[i] = cut->GetVal();
+    else restored = kFALSE;
+  }
+  TTree *skipTree = (restored) ? (TTree*)file->Get("SkippedEntries") : NULL;
+  if(skipTree) skipLog.ReadTree(skipTree);
+  else restored = kFALSE;
+  for(int iOutput=0; restored && iOutput<3; iOutput++){
+    TDirectory *dir = file->GetDirectory(Form("output%d",iOutput));
+    TIter next(outputs[iOutput]->GetList());
+    while(restored && dir){
+      TObject *obj = next();
+      if(!obj) break;
+      if(obj->InheritsFrom(TH1::Class())){
+        TH1 *saved = (TH1*)dir->Get(obj->GetName());
+        if(saved){
+          ((TH1*)obj)->Reset();
+          ((TH1*)obj)->Add(saved);
+        } else {
+          std::cout << "Checkpoint: " << obj->GetName() << " is missing" << std::endl;
+          restored = kFALSE;
+        }
+        delete saved;
+      }
+    }
+    if(!dir) restored = kFALSE;
+  }
+  delete file;
+  savedDir->cd();
+  return restored;
+}
+
+TString PicoCheckpoint::FileListText() const {
+  TString text;
+  std::ifstream list(mFileList.Data());
+  std::string line;
+  while(std::getline(list, line)) text += TString(line.c_str()) + "\n";
+  return text;
+}
+
+void PicoCheckpoint::Remove(){
+  gSystem->Unlink(mFileName);
+}
+
+// Configuration, the same in every worker: taken from worker 0 instead of being summed
+const char* const kUnmergedWorkerObjects[] = {"Order1etaWeight", "v1WtaWt"};
+
+// Objects of an output by name, kFALSE if a name is booked twice
+Bool_t MapWorkerObjects(TFile *output, std::map<std::string,TObject*> &objects){
+  TIter next(output->GetList());
+  while(TObject *obj = next()){
+    if(!objects.insert(std::make_pair(std::string(obj->GetName()), obj)).second){
+      std::cout << output->GetName() << " has two objects named " << obj->GetName() << std::endl;
+      return kFALSE;
+    }
+  }
+  return kTRUE;
+}
+
+// Every worker books the same objects, they are merged by name, each output is mapped once.
+// If the workers do not have the same objects, or an object is neither a histogram nor a tree,
+// nothing is merged: each worker output is written as <mergedName>.worker<i> and kFALSE returned.
+Bool_t MergeWorkerOutputs(const std::vector<TFile*> &outputs, const TString &mergedName){
+  std::vector<std::map<std::string,TObject*> > objects(outputs.size());
+  Bool_t match = kTRUE;
+  for(unsigned int iWorker=0; iWorker<outputs.size() && match; iWorker++) match = MapWorkerObjects(outputs[iWorker], objects[iWorker]);
+  for(unsigned int iWorker=1; iWorker<outputs.size() && match; iWorker++){
+    if(objects[iWorker].size() != objects[0].size()){
+      std::cout << "Worker " << iWorker << " has " << objects[iWorker].size() << " output objects, worker 0 "
+                << objects[0].size() << std::endl;
+      match = kFALSE;
+    }
+  }
+  for(std::map<std::string,TObject*>::const_iterator it=objects[0].begin(); it!=objects[0].end() && match; ++it){
+    TObject *obj = it->second;
+    if(!obj->InheritsFrom(TH1::Class()) && !obj->InheritsFrom(TTree::Class())){
+      std::cout << "Worker output " << obj->GetName() << " (" << obj->ClassName() << ") can not be merged" << std::endl;
+      match = kFALSE;
+    }
+    for(unsigned int iWorker=1; iWorker<outputs.size() && match; iWorker++){
+      std::map<std::string,TObject*>::const_iterator other = objects[iWorker].find(it->first);
+      if(other == objects[iWorker].end() || strcmp(other->second->ClassName(),obj->ClassName()) != 0){
+        std::cout << "Worker " << iWorker << " has no " << obj->ClassName() << " " << obj->GetName() << std::endl;
+        match = kFALSE;
+      }
+    }
+  }
+  if(!match){
+    for(unsigned int iWorker=0; iWorker<outputs.size(); iWorker++){
+      TString workerName = TString::Format("%s.worker%u", mergedName.Data(), iWorker);
+      outputs[iWorker]->Write();
+      TMemFile *memFile = dynamic_cast<TMemFile*>(outputs[iWorker]);
+      if(memFile && memFile->CopyTo(workerName) > 0) std::cout << "Worker " << iWorker << " output written unmerged to " << workerName << std::endl;
+    }
+    return kFALSE;
+  }
+  TFile *mergedFile = new TFile(mergedName,"RECREATE");
+  TIter next(outputs[0]->GetList()); // in booking order
+  while(TObject *obj = next()){
+    Bool_t once = kFALSE;
+    for(unsigned int i=0; i<sizeof(kUnmergedWorkerObjects)/sizeof(kUnmergedWorkerObjects[0]); i++){
+      if(strcmp(obj->GetName(), kUnmergedWorkerObjects[i]) == 0) once = kTRUE;
+    }
+    TList others;
+    for(unsigned int iWorker=1; iWorker<outputs.size() && !once; iWorker++) others.Add(objects[iWorker][obj->GetName()]);
+    if(obj->InheritsFrom(TTree::Class())){ // SkippedEntries: rows of all workers
+      mergedFile->cd();
+      others.AddFirst(obj);
+      TTree *mergedTree = TTree::MergeTrees(&others);
+      if(mergedTree) mergedTree->Write();
+      continue;
+    }
+    if(others.GetSize() > 0) ((TH1*)obj)->Merge(&others);
+    mergedFile->WriteTObject(obj);
+  }
+  mergedFile->Close();
+  delete mergedFile;
+  return kTRUE;
 }
 
 // =========================== Get Psi from Q vector =============================================
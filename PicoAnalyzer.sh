@@ -5,19 +5,31 @@
 cut=0
 var=0
 iter=1
+options=""
 if [ $# -ge 1 ]
 then
         cut=$1
 	var=$2
 	iter=$3
 fi
+#Run options of PicoAnalyzer, e.g. "threads=8,block=2000", see README.md
+if [ $# -ge 4 ]
+then
+	options=$4
+fi
 source /afs/rhic/rhstar/group/star_cshrc.csh
 wait
 #echo "Hello, world!"
 stardev
 wait
-root4star -b -q -l RunAnalyzer.C+
-wait
-root4star -b -q -l PicoAnalyzer.cxx+\(\"st_physics_adc_19158057_raw_3500002.picoDst.root\",\"test\",1,$cut,$var,$iter\)
+#The executable built by make is used if it is there, see Makefile
+if [ -x ./PicoAnalyzer ]
+then
+	./PicoAnalyzer st_physics_adc_19158057_raw_3500002.picoDst.root test 1 $cut $var $iter "$options"
+else
+	root4star -b -q -l RunAnalyzer.C+
+	wait
+	root4star -b -q -l PicoAnalyzer.cxx+\(\"st_physics_adc_19158057_raw_3500002.picoDst.root\",\"test\",1,$cut,$var,$iter,\"$options\"\)
+fi
 wait
 # chmod u+x
@@ -0,0 +1,34 @@
+/**
+ * \brief main() of the compiled PicoAnalyzer executable, see Makefile
+ *
+ * Takes the arguments of the PicoAnalyzer() macro in the same order:
+ *   ./PicoAnalyzer inFile outFile [order [cut [var [iter [options]]]]]
+ *   e.g. ./PicoAnalyzer file.list test 1 0 0 1 "threads=8,cache=30"
+ * The macro itself stays usable with ACLiC (PicoAnalyzer.cxx+).
+ * The exit status is 1 if PicoAnalyzer() fails, e.g. its event loop does not finish.
+ */
+
+// C++ headers
+#include <cstdlib>
+#include <iostream>
+
+// ROOT headers
+#include "TROOT.h"
+#include "TString.h"
+
+Bool_t PicoAnalyzer(const Char_t *inFile, TString outFile, Int_t inputp1, Int_t inputp2, Int_t inputp3, Int_t inputp4,
+                  TString options);
+
+int main(int argc, char **argv){
+  if(argc < 3){
+    std::cout << "usage: " << argv[0] << " inFile outFile [order [cut [var [iter [options]]]]]" << std::endl;
+    return 1;
+  }
+  gROOT->SetBatch(kTRUE);
+  Int_t inputp1 = (argc > 3) ? atoi(argv[3]) : 1;
+  Int_t inputp2 = (argc > 4) ? atoi(argv[4]) : 0;
+  Int_t inputp3 = (argc > 5) ? atoi(argv[5]) : 0;
+  Int_t inputp4 = (argc > 6) ? atoi(argv[6]) : 0;
+  TString options = (argc > 7) ? argv[7] : "";
+  return PicoAnalyzer(argv[1], argv[2], inputp1, inputp2, inputp3, inputp4, options) ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+/**
+ * \brief Event plane corrections of a block of events at once
+ *
+ * QvectorCalib.cxx, and the event loop of PicoAnalyzer() with epbatch=N,
+ * gather the raw Q-vectors of a block of events into one PicoEpSubBlock per
+ * sub-event, with one array per quantity (structure of arrays). Recentering, the EP angles and the shift correction then run
+ * as loops over the events of the block, with the shift terms outermost, so
+ * the innermost loops have no dependency between events. The histograms are
+ * filled afterwards, event by event in the original order.
+ * The recenter and shift inputs are read from their TProfile2D once per
+ * pass into a PicoEpCorrectionTable by centrality bin, instead of twice
+ * per event and term with GetBinContent().
+ * Every event gets the same result as with the event by event code of
+ * PicoEpKernels.h: the terms are added in the same order.
+ * PicoEpEventAngles() is that event by event code, the reference the block
+ * is checked against (epcheck=1), and PicoEpSubBlock::Get() gives the angles
+ * of one event of a block in the same form.
+ */
+
+#ifndef PicoEpBatch_h
+#define PicoEpBatch_h
+
+#include "TProfile2D.h"
+
+#include <vector>
+
+#include "PicoEpKernels.h"
+
+// Corrections of one sub-event by centrality bin, including under- and overflow
+template<Int_t NTerms> struct PicoEpCorrectionTable {
+  static const Int_t kNCentBins = 11; // 0 ... 9 centralities + 1 (overflow)
+  Bool_t   hasRecenter, hasShift;
+  Double_t recenter[kNCentBins][2];      // <Qx>, <Qy>
+  Double_t sinAve[kNCentBins][NTerms];   // <sin(order*i*psi)>
+  Double_t cosAve[kNCentBins][NTerms];   // <cos(order*i*psi)>
+
+  // Missing profiles: that correction is not applied
+  void Load(const TProfile2D *recenterInput, const TProfile2D *shiftSin, const TProfile2D *shiftCos){
+    hasRecenter = (recenterInput != 0);
+    hasShift    = (shiftSin != 0 && shiftCos != 0);
+    for(Int_t cent=0; cent<kNCentBins; cent++){
+      recenter[cent][0] = (hasRecenter) ? recenterInput->GetBinContent(1,cent) : 0.0;
+      recenter[cent][1] = (hasRecenter) ? recenterInput->GetBinContent(2,cent) : 0.0;
+      for(Int_t i=1; i<=NTerms; i++){
+        sinAve[cent][i-1] = (hasShift) ? shiftSin->GetBinContent(i,cent) : 0.0;
+        cosAve[cent][i-1] = (hasShift) ? shiftCos->GetBinContent(i,cent) : 0.0;
+      }
+    }
+  }
+  static Int_t Bin(Int_t centrality){ return (centrality < 0) ? 0 : (centrality >= kNCentBins) ? kNCentBins-1 : centrality; }
+};
+
+// Event plane angles of one sub-event of an event
+struct PicoEpAngles {
+  Bool_t   good;         // enough hits or tracks and a non-zero Q-vector
+  Double_t qRecenter[2]; // the raw Q-vector without recenter input
+  Double_t psiRaw, psiRecenter, psiShifted; // -999 if not good
+};
+
+// One sub-event of the events of a block
+template<Int_t NTerms> struct PicoEpSubBlock {
+  Int_t                 n;          // events
+  std::vector<Char_t>   good;       // enough hits or tracks and a non-zero Q-vector
+  std::vector<Double_t> Qx, Qy;     // raw, recentered by PicoEpRecenter()
+  std::vector<Double_t> psiRaw, psiRecenter, psiShifted; // -999 if not good
+  std::vector<Double_t> sinTerms, cosTerms; // [term][event], of psiRecenter, for the shift output
+
+  PicoEpSubBlock() : n(0) {}
+  void Resize(Int_t nEvents){
+    n = nEvents;
+    good.resize(n); Qx.resize(n); Qy.resize(n);
+    psiRaw.resize(n); psiRecenter.resize(n); psiShifted.resize(n);
+    sinTerms.resize(NTerms*n); cosTerms.resize(NTerms*n);
+  }
+  // Of event e, after PicoEpBatchKernels::Run()
+  void Get(Int_t e, PicoEpAngles &angles) const {
+    angles.good         = good[e];
+    angles.qRecenter[0] = Qx[e];
+    angles.qRecenter[1] = Qy[e];
+    angles.psiRaw       = psiRaw[e];
+    angles.psiRecenter  = psiRecenter[e];
+    angles.psiShifted   = psiShifted[e];
+  }
+  void Terms(Int_t e, Double_t *sinOut, Double_t *cosOut) const {
+    for(Int_t i=0; i<NTerms; i++){
+      sinOut[i] = sinTerms[i*n + e];
+      cosOut[i] = cosTerms[i*n + e];
+    }
+  }
+};
+
+// The same angles event by event, with the corrections of the profiles at centrality
+template<Int_t NTerms> void PicoEpEventAngles(const PicoEpKernels &ep, Int_t nHits, const Double_t *qRaw, const TProfile2D *recenterInput,
+                                              const TProfile2D *shiftSin, const TProfile2D *shiftCos, Int_t centrality,
+                                              PicoEpAngles &angles){
+  angles.good = (nHits >= 5) && (qRaw[0] || qRaw[1]);
+  angles.qRecenter[0] = qRaw[0];
+  angles.qRecenter[1] = qRaw[1];
+  angles.psiRaw = angles.psiRecenter = angles.psiShifted = -999.0;
+  if(!angles.good) return;
+  angles.psiRaw = ep.psi(qRaw[0], qRaw[1]);
+  if(recenterInput){
+    angles.qRecenter[0] = qRaw[0] - recenterInput->GetBinContent(1,centrality);
+    angles.qRecenter[1] = qRaw[1] - recenterInput->GetBinContent(2,centrality);
+  }
+  angles.psiRecenter = ep.psi(angles.qRecenter[0], angles.qRecenter[1]);
+  angles.psiShifted  = angles.psiRecenter;
+  if(angles.psiRecenter == -999.0 || !shiftSin || !shiftCos) return;
+  Double_t sinAve[NTerms], cosAve[NTerms];
+  PicoEpKernels::ShiftAverages(shiftSin, shiftCos, centrality, NTerms, sinAve, cosAve);
+  angles.psiShifted = ep.shift(angles.psiRecenter, sinAve, cosAve);
+}
+
+template<Int_t Order, Int_t NTerms> struct PicoEpBatchOrderKernels {
+  typedef PicoEpOrderKernels<Order,NTerms> Kernels;
+
+  static void Psi(Int_t n, const Char_t *good, const Double_t *Qx, const Double_t *Qy, Double_t *psi){
+    for(Int_t e=0; e<n; e++) psi[e] = (good[e]) ? Kernels::Psi(Qx[e],Qy[e]) : -999.0;
+  }
+
+  // psiShifted of psiRecenter, -999 stays -999; unchanged without shift input
+  static void Shift(Int_t n, const Int_t *centBin, const Double_t *psi, const PicoEpCorrectionTable<NTerms> &table,
+                    Double_t *shifted){
+    for(Int_t e=0; e<n; e++) shifted[e] = psi[e];
+    if(!table.hasShift) return;
+    for(Int_t i=1; i<=NTerms; i++){
+      const Double_t tmp = (Double_t)(Order*i);
+      for(Int_t e=0; e<n; e++){
+        shifted[e] += 2.0*(table.cosAve[centBin[e]][i-1]*sin(tmp*psi[e]) - table.sinAve[centBin[e]][i-1]*cos(tmp*psi[e]))/tmp;
+      }
+    }
+    const Double_t AngleWrapAround = 2.0*TMath::Pi()/(Double_t)Order;
+    for(Int_t e=0; e<n; e++){
+      if(psi[e] == -999.0) shifted[e] = -999.0;
+      else if(shifted[e]<0) shifted[e] += AngleWrapAround;
+      else if(shifted[e]>AngleWrapAround) shifted[e] -= AngleWrapAround;
+    }
+  }
+
+  static void ShiftTerms(Int_t n, const Double_t *psi, Double_t *sinTerms, Double_t *cosTerms){
+    for(Int_t i=1; i<=NTerms; i++){
+      const Double_t tmp = (Double_t)(Order*i);
+      for(Int_t e=0; e<n; e++){
+        sinTerms[(i-1)*n + e] = sin(tmp*psi[e]);
+        cosTerms[(i-1)*n + e] = cos(tmp*psi[e]);
+      }
+    }
+  }
+};
+
+// Q -= <Q> of the centrality of the event
+template<Int_t NTerms> inline void PicoEpRecenter(Int_t n, const Int_t *centBin, const PicoEpCorrectionTable<NTerms> &table,
+                                                  Double_t *Qx, Double_t *Qy){
+  if(!table.hasRecenter) return;
+  for(Int_t e=0; e<n; e++){
+    Qx[e] -= table.recenter[centBin[e]][0];
+    Qy[e] -= table.recenter[centBin[e]][1];
+  }
+}
+
+template<Int_t NTerms> struct PicoEpBatchKernels {
+  Int_t order;
+  void (*psi)(Int_t n, const Char_t *good, const Double_t *Qx, const Double_t *Qy, Double_t *psi);
+  void (*shift)(Int_t n, const Int_t *centBin, const Double_t *psi, const PicoEpCorrectionTable<NTerms> &table, Double_t *shifted);
+  void (*shiftTerms)(Int_t n, const Double_t *psi, Double_t *sinTerms, Double_t *cosTerms);
+
+  template<Int_t Order> void Set(){
+    order      = Order;
+    psi        = &PicoEpBatchOrderKernels<Order,NTerms>::Psi;
+    shift      = &PicoEpBatchOrderKernels<Order,NTerms>::Shift;
+    shiftTerms = &PicoEpBatchOrderKernels<Order,NTerms>::ShiftTerms;
+  }
+
+  // kFALSE for an order without instantiation
+  static Bool_t ForOrder(Int_t epOrder, PicoEpBatchKernels &kernels){
+    switch(epOrder){
+      case 1: kernels.template Set<1>(); return kTRUE;
+      case 2: kernels.template Set<2>(); return kTRUE;
+      case 3: kernels.template Set<3>(); return kTRUE;
+      default: return kFALSE;
+    }
+  }
+
+  // Recentered and shifted EP angles and shift terms of a sub-event, Qx, Qy are raw on input
+  void Run(Int_t n, const Int_t *centBin, const PicoEpCorrectionTable<NTerms> &table, PicoEpSubBlock<NTerms> &sub) const {
+    psi(n, sub.good.data(), sub.Qx.data(), sub.Qy.data(), sub.psiRaw.data());
+    PicoEpRecenter(n, centBin, table, sub.Qx.data(), sub.Qy.data());
+    psi(n, sub.good.data(), sub.Qx.data(), sub.Qy.data(), sub.psiRecenter.data());
+    shift(n, centBin, sub.psiRecenter.data(), table, sub.psiShifted.data());
+    shiftTerms(n, sub.psiRecenter.data(), sub.sinTerms.data(), sub.cosTerms.data());
+  }
+};
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * \brief Event plane kernels specialized on the harmonic order
+ *
+ * The event plane order of a job (inputp1 of PicoAnalyzer()) is 1, 2 or 3.
+ * The Q-vector harmonic, the EP angle of a Q-vector (GetPsi) and the shift
+ * correction are templates on the order and on the # of shift terms, so the
+ * order*i factors, their inverses and the wrap-around angle are constants and
+ * the shift sums are unrolled by the compiler. PicoEpKernels::ForOrder() picks
+ * the instantiation once per event loop worker:
+ *   PicoEpKernels ep;
+ *   PicoEpKernels::ForOrder<_EpTermsMaxIni>(EpOrder, ep);
+ *   ep.harmonic(phi, Cosine, Sine);             // cos(order*phi), sin(order*phi)
+ *   Psi = ep.psi(Qx, Qy);                       // as GetPsi(Qx, Qy, order)
+ *   PsiShifted = ep.shift(Psi, sinAve, cosAve); // <sin>, <cos> of the terms 1 ... NTerms, see ShiftAverages()
+ *   ep.shiftTerms(Psi, sinTerms, cosTerms);     // sin(order*i*Psi), cos(order*i*Psi), for the shift output
+ * These go through a function pointer, so they are for the once per event
+ * quantities. The loops over the EPD hits and TPC tracks of an event call
+ * the loop versions instead, whose bodies are compiled with the order:
+ *   ep.harmonics(nHits, phi, cosine, sine);
+ *   ep.psis(n, Qx, Qy, psi);
+ *   ep.shifts(n, psi, sinAve, cosAve, shifted);
+ * The results are the same as those of the generic code, term by term.
+ */
+
+#ifndef PicoEpKernels_h
+#define PicoEpKernels_h
+
+#include "TMath.h"
+
+#include <cmath>
+
+template<Int_t Order, Int_t NTerms> struct PicoEpOrderKernels {
+  static void Harmonic(Double_t phi, Double_t &cosine, Double_t &sine){
+    cosine = cos(phi*(Double_t)Order);
+    sine   = sin(phi*(Double_t)Order);
+  }
+
+  static Double_t Psi(Double_t Qx, Double_t Qy){
+    if((Qx==0.0) && (Qy==0.0)) return -999.0;
+    Double_t psi = TMath::ATan2(Qy,Qx)/(Double_t)Order;
+    const Double_t AngleWrapAround = 2.0*TMath::Pi()/(Double_t)Order;
+    if(psi<0.0) psi += AngleWrapAround;
+    else if(psi>AngleWrapAround) psi -= AngleWrapAround;
+    return psi;
+  }
+
+  static Double_t Shift(Double_t psi, const Double_t *sinAve, const Double_t *cosAve){
+    Double_t shifted = psi;
+    for(Int_t i=1; i<=NTerms; i++){
+      const Double_t tmp = (Double_t)(Order*i);
+      shifted += 2.0*(cosAve[i-1]*sin(tmp*psi) - sinAve[i-1]*cos(tmp*psi))/tmp;
+    }
+    const Double_t AngleWrapAround = 2.0*TMath::Pi()/(Double_t)Order;
+    if(shifted<0) shifted += AngleWrapAround;
+    else if(shifted>AngleWrapAround) shifted -= AngleWrapAround;
+    return shifted;
+  }
+
+  static void ShiftTerms(Double_t psi, Double_t *sinTerms, Double_t *cosTerms){
+    for(Int_t i=1; i<=NTerms; i++){
+      const Double_t tmp = (Double_t)(Order*i);
+      sinTerms[i-1] = sin(tmp*psi);
+      cosTerms[i-1] = cos(tmp*psi);
+    }
+  }
+
+  static void Harmonics(Int_t n, const Double_t *phi, Double_t *cosine, Double_t *sine){
+    for(Int_t i=0; i<n; i++) Harmonic(phi[i], cosine[i], sine[i]);
+  }
+
+  static void Psis(Int_t n, const Double_t *Qx, const Double_t *Qy, Double_t *psi){
+    for(Int_t i=0; i<n; i++) psi[i] = Psi(Qx[i], Qy[i]);
+  }
+
+  // Of n angles with the same shift averages, -999 stays -999
+  static void Shifts(Int_t n, const Double_t *psi, const Double_t *sinAve, const Double_t *cosAve, Double_t *shifted){
+    for(Int_t i=0; i<n; i++) shifted[i] = (psi[i] == -999.0) ? -999.0 : Shift(psi[i], sinAve, cosAve);
+  }
+};
+
+struct PicoEpKernels {
+  Int_t    order;
+  void     (*harmonic)(Double_t phi, Double_t &cosine, Double_t &sine);
+  Double_t (*psi)(Double_t Qx, Double_t Qy);
+  Double_t (*shift)(Double_t psi, const Double_t *sinAve, const Double_t *cosAve);
+  void     (*shiftTerms)(Double_t psi, Double_t *sinTerms, Double_t *cosTerms);
+  void     (*harmonics)(Int_t n, const Double_t *phi, Double_t *cosine, Double_t *sine);
+  void     (*psis)(Int_t n, const Double_t *Qx, const Double_t *Qy, Double_t *psi);
+  void     (*shifts)(Int_t n, const Double_t *psi, const Double_t *sinAve, const Double_t *cosAve, Double_t *shifted);
+
+  template<Int_t Order, Int_t NTerms> void Set(){
+    order      = Order;
+    harmonic   = &PicoEpOrderKernels<Order,NTerms>::Harmonic;
+    psi        = &PicoEpOrderKernels<Order,NTerms>::Psi;
+    shift      = &PicoEpOrderKernels<Order,NTerms>::Shift;
+    shiftTerms = &PicoEpOrderKernels<Order,NTerms>::ShiftTerms;
+    harmonics  = &PicoEpOrderKernels<Order,NTerms>::Harmonics;
+    psis       = &PicoEpOrderKernels<Order,NTerms>::Psis;
+    shifts     = &PicoEpOrderKernels<Order,NTerms>::Shifts;
+  }
+
+  // <sin>, <cos> of the shift terms 1 ... n at centrality, from the shift input profiles
+  template<class Profile> static void ShiftAverages(const Profile *sinInput, const Profile *cosInput, Int_t centrality, Int_t n,
+                                                    Double_t *sinAve, Double_t *cosAve){
+    for(Int_t i=1; i<=n; i++){
+      sinAve[i-1] = sinInput->GetBinContent(i,centrality);
+      cosAve[i-1] = cosInput->GetBinContent(i,centrality);
+    }
+  }
+
+  // kFALSE for an order without instantiation
+  template<Int_t NTerms> static Bool_t ForOrder(Int_t order, PicoEpKernels &kernels){
+    switch(order){
+      case 1: kernels.Set<1,NTerms>(); return kTRUE;
+      case 2: kernels.Set<2,NTerms>(); return kTRUE;
+      case 3: kernels.Set<3,NTerms>(); return kTRUE;
+      default: return kFALSE;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * \brief EPD tile centers as flat arrays, and eta, phi of all hits of an event
+ *
+ * The 744 tile centers of StEpdGeom are read once per job into one x, y and
+ * z array (structure of arrays), indexed by side, supersector and tile.
+ * EtaPhi() then computes eta and phi of the straight lines from the primary
+ * vertex to the tiles of all EPD hits of the event in one loop over the
+ * hits, without a TVector3 and a TileCenter() call per hit and loop. The EPD
+ * loops of the event only read the results.
+ * eta and phi are the same as TVector3::Eta() and Phi() of
+ * TileCenter(id) - vertex: the same formulas in the same order.
+ */
+
+#ifndef PicoEpdTileTable_h
+#define PicoEpdTileTable_h
+
+#include "TMath.h"
+#include "TVector3.h"
+
+#include "StRoot/StEpdUtil/StEpdGeom.h"
+#include "EpdHitBuffer.h"
+
+struct PicoEpdTileTable {
+  static const Int_t kNTiles = 744; // 2 sides x 12 supersectors x 31 tiles
+  Double_t x[kNTiles+1], y[kNTiles+1], z[kNTiles+1]; // [kNTiles]: ids outside the EPD, at the origin
+
+  // ew 0: east, 1: west, as in EpdHitBuffer
+  static Int_t Index(Int_t ew, Int_t position, Int_t tile){
+    if(position < 1 || position > 12 || tile < 1 || tile > 31) return kNTiles;
+    return (ew*12 + position-1)*31 + tile-1;
+  }
+
+  void Load(StEpdGeom *geom){
+    for(Int_t ew=0; ew<2; ew++){
+      for(Int_t position=1; position<=12; position++){
+        for(Int_t tile=1; tile<=31; tile++){
+          Short_t tileId = (ew == 0) ? -(100*position + tile) : 100*position + tile;
+          TVector3 center = geom->TileCenter(tileId);
+          Int_t i = Index(ew, position, tile);
+          x[i] = center.X();
+          y[i] = center.Y();
+          z[i] = center.Z();
+        }
+      }
+    }
+    x[kNTiles] = y[kNTiles] = z[kNTiles] = 0.0;
+  }
+
+  // eta and phi (0 to 2pi) of every hit, hits.Decode() done
+  void EtaPhi(const EpdHitBuffer &hits, const TVector3 &vertex, Double_t *eta, Double_t *phi) const {
+    const Int_t n = hits.nHits;
+    const Double_t vx = vertex.X(), vy = vertex.Y(), vz = vertex.Z();
+    const Double_t twoPi = 2.0*TMath::Pi();
+    for(Int_t iHit=0; iHit<n; iHit++){
+      Int_t i = Index(hits.ew[iHit], hits.position[iHit], hits.tile[iHit]);
+      Double_t dx = x[i] - vx;
+      Double_t dy = y[i] - vy;
+      Double_t dz = z[i] - vz;
+      // TVector3::Phi()
+      Double_t p = (dx == 0.0 && dy == 0.0) ? 0.0 : TMath::ATan2(dy, dx);
+      if(p < 0.0  ) p += twoPi;
+      if(p > twoPi) p -= twoPi;
+      phi[iHit] = p;
+      // TVector3::PseudoRapidity(), without its warning for lines along z
+      Double_t mag = TMath::Sqrt(dx*dx + dy*dy + dz*dz);
+      Double_t cosTheta = (mag == 0.0) ? 1.0 : dz/mag;
+      if(cosTheta*cosTheta < 1) eta[iHit] = -0.5*TMath::Log((1.0-cosTheta)/(1.0+cosTheta));
+      else if(dz == 0) eta[iHit] = 0.0;
+      else eta[iHit] = (dz > 0) ? 10e10 : -10e10;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * \brief Event cuts of the FXT 7.2 (26.5) GeV Run 18 analysis
+ *
+ * Shared by PicoAnalyzer.cxx and TagIndexBuilder.cxx, so that an event
+ * tag index selects exactly the events the analysis keeps.
+ * sys_cutN/sys_varN are the systematic cut index/variation of PicoAnalyzer():
+ *   sys_cutN == 3: vz, sys_cutN == 4: vr
+ */
+
+#ifndef PicoEventCuts_h
+#define PicoEventCuts_h
+
+#include "TMath.h"
+
+const UInt_t _goodTriggerId = 630052; // bbce_tofmult1 7.2GeV
+const Int_t  _cenSection[9] = {6,12,22,39,64,100,154,191,241}; // From UC Davis, cut on nFXTMult
+
+// --------------------------- Vertex cut -----------------------------------
+inline Bool_t IsBadZVertex(Double_t d_zvtx, Int_t sys_cutN, Int_t sys_varN){
+  bool b_bad_zvtx   =  ((d_zvtx < 198.0) || (d_zvtx > 202.0)); //FXT_26p5_2018
+  // # Systematic Analysis
+  // sys_cutN == 3; // vz
+  if(sys_cutN == 3){
+    if(sys_varN == 1){
+      b_bad_zvtx   =  ((d_zvtx < 198.4) || (d_zvtx > 201.6));
+    } else if(sys_varN == 2){
+      b_bad_zvtx   =  ((d_zvtx < 197.6) || (d_zvtx > 202.4));
+    }
+  }
+  return b_bad_zvtx;
+}
+
+// Transverse distance of the vertex from the target center at (0,-2)
+inline Double_t VertexR(Double_t d_xvtx, Double_t d_yvtx){
+  return sqrt(pow(d_xvtx,2)+pow(d_yvtx+2,2));
+}
+
+inline Bool_t IsBadRVertex(Double_t d_rvtx, Int_t sys_cutN, Int_t sys_varN){
+  bool b_bad_rvtx   =   d_rvtx > 2.0;
+  // # Systematic Analysis
+  // sys_cutN == 4; // vr
+  if(sys_cutN == 4){
+    if(sys_varN == 1){
+      b_bad_rvtx   =   d_rvtx > 1.6;
+    } else if(sys_varN == 2){
+      b_bad_rvtx   =   d_rvtx > 2.4;
+    }
+  }
+  return b_bad_rvtx;
+}
+
+// ---------------- Centrality from the # of primary tracks -------------------
+inline Bool_t IsPileUp(Int_t nFXTMult)  { return (nFXTMult >= _cenSection[8]); }
+inline Bool_t IsLowMult(Int_t nFXTMult) { return (nFXTMult < 2); }
+
+// 1 (0-5%) ... 9 (70-80%), 0 for pile up and low multiplicity events
+inline Int_t FXTMultCentrality(Int_t nFXTMult){
+  if(IsPileUp(nFXTMult) || IsLowMult(nFXTMult)) return 0;
+  for(int i=8; i>=1; i--){
+    if(nFXTMult >= _cenSection[i-1]) return 9 - i; // [cenSection[i-1], cenSection[i])
+  }
+  return 9; // 70 - 80% 5 - 2
+}
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ * \brief Events read ahead by a producer thread, for PicoAnalyzer(...,"pipeline=N")
+ *
+ * The producer thread reads and decompresses the entries into its own
+ * PicoTrackColumns/EpdHitBuffer and copies the leaves of the event into a
+ * PicoEventRecord: the PicoEventInfo and only the filled part of the track
+ * and EPD leaf arrays, as one byte block. The event loop unpacks the record
+ * into its own buffers and decodes them as for a direct read, so reading
+ * event N+1 overlaps with the analysis of event N.
+ * PicoRecordQueue is a ring of N records with one writer and one reader
+ * thread; the records are reused, so their byte blocks keep their capacity.
+ * A thread that finds the ring full (writer) or empty (reader) yields for
+ * kSpins tries and then sleeps on a condition variable until the other one
+ * moves on, so a long I/O stall does not keep a core busy.
+ */
+
+#ifndef PicoEventPipeline_h
+#define PicoEventPipeline_h
+
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "EpdHitBuffer.h"
+#include "PicoTrackColumns.h"
+#include "PicoFlowSkim.h"
+
+struct PicoEventRecord {
+  enum { kRead = 0, kEnd = -1 }; // otherwise the PicoSkipLog reason the entry could not be read for
+  Long64_t iEvent; // of the event loop
+  Long64_t entry;  // of the chain
+  Int_t    status;
+  PicoEventInfo     info;
+  std::vector<char> leaves; // see PackEventLeaves()
+};
+
+class PicoRecordQueue {
+public:
+  static const Int_t kSpins = 64; // yields before a waiting thread sleeps
+
+  PicoRecordQueue(Int_t depth) : mSlots(depth + 1), mHead(0), mTail(0), mStop(kFALSE) {}
+
+  // Producer: the record to fill, NULL once the event loop has stopped
+  PicoEventRecord* WriteSlot(){
+    for(Int_t spin=0; Full(); spin++){
+      if(mStop.load(std::memory_order_acquire)) return NULL;
+      if(spin < kSpins){
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mMutex);
+      mMoved.wait(lock, [this]{ return !Full() || mStop.load(std::memory_order_acquire); });
+    }
+    if(mStop.load(std::memory_order_acquire)) return NULL;
+    return &mSlots[mHead.load(std::memory_order_relaxed)];
+  }
+  void Push(){
+    mHead.store((mHead.load(std::memory_order_relaxed) + 1) % mSlots.size(), std::memory_order_release);
+    Wake();
+  }
+  // Event loop: the next record, waits for the producer
+  PicoEventRecord* ReadSlot(){
+    for(Int_t spin=0; Empty(); spin++){
+      if(spin < kSpins){
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mMutex);
+      mMoved.wait(lock, [this]{ return !Empty(); });
+    }
+    return &mSlots[mTail.load(std::memory_order_relaxed)];
+  }
+  void Pop(){
+    mTail.store((mTail.load(std::memory_order_relaxed) + 1) % mSlots.size(), std::memory_order_release);
+    Wake();
+  }
+  // Event loop ended: the producer gives up at the next record
+  void Stop(){
+    mStop.store(kTRUE, std::memory_order_release);
+    Wake();
+  }
+  Bool_t Stopped() const { return mStop.load(std::memory_order_acquire); }
+
+private:
+  std::vector<PicoEventRecord> mSlots; // one slot stays empty to tell full from empty
+  std::atomic<size_t> mHead;           // next slot to write
+  std::atomic<size_t> mTail;           // next slot to read
+  std::atomic<Bool_t> mStop;
+  std::mutex mMutex;                   // for the sleeping thread only
+  std::condition_variable mMoved;      // head, tail or stop changed
+
+  Bool_t Full() const { return (mHead.load(std::memory_order_relaxed) + 1) % mSlots.size() == mTail.load(std::memory_order_acquire); }
+  Bool_t Empty() const { return mTail.load(std::memory_order_relaxed) == mHead.load(std::memory_order_acquire); }
+  // The lock orders the change before the check of a thread about to sleep, so no wake-up is lost
+  void Wake(){
+    { std::lock_guard<std::mutex> lock(mMutex); }
+    mMoved.notify_one();
+  }
+};
+
+template<class T> inline void PackColumn(std::vector<char> &buffer, const T *column, Int_t n){
+  size_t pos = buffer.size();
+  buffer.resize(pos + n*sizeof(T));
+  if(n > 0) memcpy(buffer.data() + pos, column, n*sizeof(T));
+}
+
+template<class T> inline void UnpackColumn(const std::vector<char> &buffer, size_t &pos, T *column, Int_t n){
+  if(n > 0) memcpy(column, buffer.data() + pos, n*sizeof(T));
+  pos += n*sizeof(T);
+}
+
+// Leaves of the current entry, the arrays only up to the # of tracks, traits and hits
+inline void PackEventLeaves(const PicoTrackColumns &tracks, const EpdHitBuffer &epdHits, std::vector<char> &buffer){
+  buffer.clear();
+  Int_t nTracks = tracks.nTracks;
+  Int_t nTraits = tracks.nTraits;
+  Int_t nHits   = epdHits.nHits;
+  PackColumn(buffer, &tracks.nTracks, 1);
+  PackColumn(buffer, &tracks.nTraits, 1);
+  const std::vector<Float_t>* floatColumns[] = {&tracks.pMomX, &tracks.pMomY, &tracks.pMomZ, &tracks.gMomX, &tracks.gMomY, &tracks.gMomZ,
+                                                &tracks.originX, &tracks.originY, &tracks.originZ, &tracks.dEdx};
+  for(unsigned int i=0; i<sizeof(floatColumns)/sizeof(floatColumns[0]); i++) PackColumn(buffer, &(*floatColumns[i])[0], nTracks);
+  const std::vector<Short_t>* shortColumns[] = {&tracks.nSigmaPionRaw, &tracks.nSigmaKaonRaw, &tracks.nSigmaProtonRaw,
+                                                &tracks.nSigmaElectronRaw, &tracks.bTofPidTraitsIndex};
+  for(unsigned int i=0; i<sizeof(shortColumns)/sizeof(shortColumns[0]); i++) PackColumn(buffer, &(*shortColumns[i])[0], nTracks);
+  PackColumn(buffer, &tracks.nHitsFitCharge[0], nTracks);
+  PackColumn(buffer, &tracks.nHitsPoss[0], nTracks);
+  PackColumn(buffer, &tracks.nHitsDedx[0], nTracks);
+  PackColumn(buffer, &tracks.bTofBetaRaw[0], nTraits);
+  PackColumn(buffer, &epdHits.nHits, 1);
+  PackColumn(buffer, &epdHits.id[0], nHits);
+  PackColumn(buffer, &epdHits.qtData[0], nHits);
+  PackColumn(buffer, &epdHits.nMip[0], nHits);
+}
+
+inline void UnpackEventLeaves(const std::vector<char> &buffer, PicoTrackColumns &tracks, EpdHitBuffer &epdHits){
+  size_t pos = 0;
+  UnpackColumn(buffer, pos, &tracks.nTracks, 1);
+  UnpackColumn(buffer, pos, &tracks.nTraits, 1);
+  Int_t nTracks = tracks.nTracks;
+  Int_t nTraits = tracks.nTraits;
+  tracks.Reserve(nTracks, nTraits); // the buffers of the event loop are not bound to the chain
+  std::vector<Float_t>* floatColumns[] = {&tracks.pMomX, &tracks.pMomY, &tracks.pMomZ, &tracks.gMomX, &tracks.gMomY, &tracks.gMomZ,
+                                          &tracks.originX, &tracks.originY, &tracks.originZ, &tracks.dEdx};
+  for(unsigned int i=0; i<sizeof(floatColumns)/sizeof(floatColumns[0]); i++) UnpackColumn(buffer, pos, &(*floatColumns[i])[0], nTracks);
+  std::vector<Short_t>* shortColumns[] = {&tracks.nSigmaPionRaw, &tracks.nSigmaKaonRaw, &tracks.nSigmaProtonRaw,
+                                          &tracks.nSigmaElectronRaw, &tracks.bTofPidTraitsIndex};
+  for(unsigned int i=0; i<sizeof(shortColumns)/sizeof(shortColumns[0]); i++) UnpackColumn(buffer, pos, &(*shortColumns[i])[0], nTracks);
+  UnpackColumn(buffer, pos, &tracks.nHitsFitCharge[0], nTracks);
+  UnpackColumn(buffer, pos, &tracks.nHitsPoss[0], nTracks);
+  UnpackColumn(buffer, pos, &tracks.nHitsDedx[0], nTracks);
+  UnpackColumn(buffer, pos, &tracks.bTofBetaRaw[0], nTraits);
+  UnpackColumn(buffer, pos, &epdHits.nHits, 1);
+  Int_t nHits = epdHits.nHits;
+  epdHits.Reserve(nHits);
+  UnpackColumn(buffer, pos, &epdHits.id[0], nHits);
+  UnpackColumn(buffer, pos, &epdHits.qtData[0], nHits);
+  UnpackColumn(buffer, pos, &epdHits.nMip[0], nHits);
+}
+
+#endif
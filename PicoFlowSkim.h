@@ -0,0 +1,302 @@
+/**
+ * \brief Flow skim: good events with their primary tracks and east EPD hits
+ *
+ * Written by PicoAnalyzer(...,"skim=FILE") and read back with
+ * PicoAnalyzer("FILE or list of FILEs",...,"input=skim"). The tree "FlowSkim"
+ * holds the events passing the loosest event cuts of all systematic
+ * variations, so one skim serves every sys_cutN/sys_varN and iteration:
+ *   event  : runId, eventId, bField, vertex, refMult, grefMult, nBTOFMatch
+ *   tracks : primary tracks only. Momenta and dE/dx as Float16 (12 bit mantissa),
+ *            origin as Float_t (for gDCA and the helices), nSigma x1000 and
+ *            beta x20000 as in the picoDst, and the hit counts, charge and TOF
+ *            flag bit-packed in one word:
+ *            bits 0-7 nHitsFit, 8-15 nHitsPoss, 16-23 nHitsDedx, 24 positive, 25 TOF
+ *   EPD    : east side hits, position*100+tile and nMIP (Float16)
+ * PicoFlowSkimEntry::Get() fills the same PicoTrackColumns/EpdHitBuffer the
+ * picoDst is read into, so the analysis runs unchanged on either input.
+ * The arrays grow with the events written, and when reading with the largest
+ * nTracks and nEpdHits of the tree (TLeaf::GetMaximum(), as in MakeClass).
+ */
+
+#ifndef PicoFlowSkim_h
+#define PicoFlowSkim_h
+
+#include "TChain.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TVector3.h"
+#include "TString.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "StRoot/StPicoEvent/StPicoEvent.h"
+#include "EpdHitBuffer.h"
+#include "PicoTrackColumns.h"
+#include "PicoEventCuts.h"
+
+// Event quantities used by the analysis, from StPicoEvent or from the skim
+struct PicoEventInfo {
+  Int_t    runId;
+  Int_t    eventId;
+  Float_t  bField;
+  TVector3 primaryVertex;
+  std::vector<unsigned int> triggerIds;
+  Int_t    refMult;
+  Int_t    grefMult;
+  Int_t    nBTOFMatch;
+
+  void Fill(const StPicoEvent *event){
+    runId         = event->runId();
+    eventId       = event->eventId();
+    bField        = event->bField();
+    primaryVertex = event->primaryVertex();
+    triggerIds    = event->triggerIds();
+    refMult       = event->refMult();
+    grefMult      = event->grefMult();
+    nBTOFMatch    = event->nBTOFMatch();
+  }
+};
+
+// Event, track and EPD hit buffers of one skim entry
+class PicoFlowSkimEntry {
+public:
+  static const Int_t kMaxTracks  = PicoTrackColumns::kMaxTracks; // initial size of the arrays
+  static const Int_t kMaxEpdHits = EpdHitBuffer::kMaxHits;
+
+  Int_t   runId, eventId;
+  Float_t bField;
+  Float_t vx, vy, vz;
+  Short_t refMult, grefMult, nBTOFMatch;
+
+  Int_t nTracks;
+  std::vector<Float_t>  pMomX, pMomY, pMomZ;
+  std::vector<Float_t>  gMomX, gMomY, gMomZ;
+  std::vector<Float_t>  originX, originY, originZ;
+  std::vector<Float_t>  dEdx;
+  std::vector<Short_t>  nSigmaPion, nSigmaKaon, nSigmaProton, nSigmaElectron;
+  std::vector<UShort_t> tofBeta;
+  std::vector<UInt_t>   quality;
+
+  Int_t nEpdHits;
+  std::vector<Short_t>  epdTile;
+  std::vector<Float_t>  epdNMip;
+
+  PicoFlowSkimEntry() : nTracks(0), nEpdHits(0), mTree(NULL), mTreeNumber(-1) { Reserve(kMaxTracks, kMaxEpdHits); }
+
+  // Room for tracks and hits, the branches of the tree are set to the arrays again if they have moved
+  void Reserve(Int_t tracks, Int_t hits){
+    Bool_t moved = kFALSE;
+    if(tracks > (Int_t)pMomX.size()){
+      std::vector<Float_t>* floatColumns[] = {&pMomX, &pMomY, &pMomZ, &gMomX, &gMomY, &gMomZ, &originX, &originY, &originZ, &dEdx};
+      for(unsigned int i=0; i<sizeof(floatColumns)/sizeof(floatColumns[0]); i++) floatColumns[i]->resize(tracks);
+      std::vector<Short_t>* shortColumns[] = {&nSigmaPion, &nSigmaKaon, &nSigmaProton, &nSigmaElectron};
+      for(unsigned int i=0; i<sizeof(shortColumns)/sizeof(shortColumns[0]); i++) shortColumns[i]->resize(tracks);
+      tofBeta.resize(tracks);
+      quality.resize(tracks);
+      moved = kTRUE;
+    }
+    if(hits > (Int_t)epdTile.size()){
+      epdTile.resize(hits);
+      epdNMip.resize(hits);
+      moved = kTRUE;
+    }
+    if(moved && mTree) SetAddress(mTree);
+  }
+
+  // Reading: room for the largest entry of the tree the chain has moved to, before it is read
+  void Update(TChain *chain){
+    if(chain->GetTreeNumber() == mTreeNumber) return;
+    mTreeNumber = chain->GetTreeNumber();
+    TTree *tree = chain->GetTree();
+    TLeaf *tracksLeaf = (tree) ? tree->GetLeaf("nTracks") : NULL;
+    TLeaf *hitsLeaf   = (tree) ? tree->GetLeaf("nEpdHits") : NULL;
+    Reserve((tracksLeaf) ? tracksLeaf->GetMaximum() : 0, (hitsLeaf) ? hitsLeaf->GetMaximum() : 0);
+  }
+
+  void Branch(TTree *tree){
+    mTree = tree;
+    tree->Branch("runId",      &runId,      "runId/I");
+    tree->Branch("eventId",    &eventId,    "eventId/I");
+    tree->Branch("bField",     &bField,     "bField/F");
+    tree->Branch("vx",         &vx,         "vx/F");
+    tree->Branch("vy",         &vy,         "vy/F");
+    tree->Branch("vz",         &vz,         "vz/F");
+    tree->Branch("refMult",    &refMult,    "refMult/S");
+    tree->Branch("grefMult",   &grefMult,   "grefMult/S");
+    tree->Branch("nBTOFMatch", &nBTOFMatch, "nBTOFMatch/S");
+    tree->Branch("nTracks",    &nTracks,    "nTracks/I");
+    tree->Branch("pMomX",      &pMomX[0],   "pMomX[nTracks]/f");
+    tree->Branch("pMomY",      &pMomY[0],   "pMomY[nTracks]/f");
+    tree->Branch("pMomZ",      &pMomZ[0],   "pMomZ[nTracks]/f");
+    tree->Branch("gMomX",      &gMomX[0],   "gMomX[nTracks]/f");
+    tree->Branch("gMomY",      &gMomY[0],   "gMomY[nTracks]/f");
+    tree->Branch("gMomZ",      &gMomZ[0],   "gMomZ[nTracks]/f");
+    tree->Branch("originX",    &originX[0], "originX[nTracks]/F");
+    tree->Branch("originY",    &originY[0], "originY[nTracks]/F");
+    tree->Branch("originZ",    &originZ[0], "originZ[nTracks]/F");
+    tree->Branch("dEdx",       &dEdx[0],    "dEdx[nTracks]/f");
+    tree->Branch("nSigmaPion",     &nSigmaPion[0],     "nSigmaPion[nTracks]/S");
+    tree->Branch("nSigmaKaon",     &nSigmaKaon[0],     "nSigmaKaon[nTracks]/S");
+    tree->Branch("nSigmaProton",   &nSigmaProton[0],   "nSigmaProton[nTracks]/S");
+    tree->Branch("nSigmaElectron", &nSigmaElectron[0], "nSigmaElectron[nTracks]/S");
+    tree->Branch("tofBeta",    &tofBeta[0], "tofBeta[nTracks]/s");
+    tree->Branch("quality",    &quality[0], "quality[nTracks]/i");
+    tree->Branch("nEpdHits",   &nEpdHits,   "nEpdHits/I");
+    tree->Branch("epdTile",    &epdTile[0], "epdTile[nEpdHits]/S");
+    tree->Branch("epdNMip",    &epdNMip[0], "epdNMip[nEpdHits]/f");
+  }
+
+  void SetAddress(TTree *tree){
+    mTree = tree;
+    tree->SetBranchAddress("runId",      &runId);
+    tree->SetBranchAddress("eventId",    &eventId);
+    tree->SetBranchAddress("bField",     &bField);
+    tree->SetBranchAddress("vx",         &vx);
+    tree->SetBranchAddress("vy",         &vy);
+    tree->SetBranchAddress("vz",         &vz);
+    tree->SetBranchAddress("refMult",    &refMult);
+    tree->SetBranchAddress("grefMult",   &grefMult);
+    tree->SetBranchAddress("nBTOFMatch", &nBTOFMatch);
+    tree->SetBranchAddress("nTracks",    &nTracks);
+    tree->SetBranchAddress("pMomX",      &pMomX[0]);
+    tree->SetBranchAddress("pMomY",      &pMomY[0]);
+    tree->SetBranchAddress("pMomZ",      &pMomZ[0]);
+    tree->SetBranchAddress("gMomX",      &gMomX[0]);
+    tree->SetBranchAddress("gMomY",      &gMomY[0]);
+    tree->SetBranchAddress("gMomZ",      &gMomZ[0]);
+    tree->SetBranchAddress("originX",    &originX[0]);
+    tree->SetBranchAddress("originY",    &originY[0]);
+    tree->SetBranchAddress("originZ",    &originZ[0]);
+    tree->SetBranchAddress("dEdx",       &dEdx[0]);
+    tree->SetBranchAddress("nSigmaPion",     &nSigmaPion[0]);
+    tree->SetBranchAddress("nSigmaKaon",     &nSigmaKaon[0]);
+    tree->SetBranchAddress("nSigmaProton",   &nSigmaProton[0]);
+    tree->SetBranchAddress("nSigmaElectron", &nSigmaElectron[0]);
+    tree->SetBranchAddress("tofBeta",    &tofBeta[0]);
+    tree->SetBranchAddress("quality",    &quality[0]);
+    tree->SetBranchAddress("nEpdHits",   &nEpdHits);
+    tree->SetBranchAddress("epdTile",    &epdTile[0]);
+    tree->SetBranchAddress("epdNMip",    &epdNMip[0]);
+  }
+
+  // picoDst -> skim: the primary tracks and east EPD hits of the decoded event
+  void Set(const PicoEventInfo &info, const PicoTrackColumns &tracks, const EpdHitBuffer &epdHits){
+    runId      = info.runId;
+    eventId    = info.eventId;
+    bField     = info.bField;
+    vx         = info.primaryVertex.X();
+    vy         = info.primaryVertex.Y();
+    vz         = info.primaryVertex.Z();
+    refMult    = info.refMult;
+    grefMult   = info.grefMult;
+    nBTOFMatch = info.nBTOFMatch;
+    Reserve(tracks.nTracks, epdHits.nHits);
+    nTracks = 0;
+    for(Int_t iTrk=0; iTrk<tracks.nTracks; iTrk++){
+      if(!tracks.isPrimary[iTrk]) continue;
+      pMomX[nTracks]   = tracks.pMomX[iTrk];
+      pMomY[nTracks]   = tracks.pMomY[iTrk];
+      pMomZ[nTracks]   = tracks.pMomZ[iTrk];
+      gMomX[nTracks]   = tracks.gMomX[iTrk];
+      gMomY[nTracks]   = tracks.gMomY[iTrk];
+      gMomZ[nTracks]   = tracks.gMomZ[iTrk];
+      originX[nTracks] = tracks.originX[iTrk];
+      originY[nTracks] = tracks.originY[iTrk];
+      originZ[nTracks] = tracks.originZ[iTrk];
+      dEdx[nTracks]    = tracks.dEdx[iTrk];
+      nSigmaPion[nTracks]     = tracks.nSigmaPionRaw[iTrk];
+      nSigmaKaon[nTracks]     = tracks.nSigmaKaonRaw[iTrk];
+      nSigmaProton[nTracks]   = tracks.nSigmaProtonRaw[iTrk];
+      nSigmaElectron[nTracks] = tracks.nSigmaElectronRaw[iTrk];
+      Bool_t hasTof    = (tracks.tofBeta[iTrk] != -999.);
+      Int_t  iTrait    = tracks.bTofPidTraitsIndex[iTrk];
+      tofBeta[nTracks] = (hasTof) ? tracks.bTofBetaRaw[iTrait] : 0;
+      quality[nTracks] =  (UInt_t)(tracks.nHitsFit[iTrk]  & 0xFF)
+                       | ((UInt_t)(tracks.nHitsPoss[iTrk] & 0xFF) << 8)
+                       | ((UInt_t)(tracks.nHitsDedx[iTrk] & 0xFF) << 16)
+                       | ((tracks.charge[iTrk] > 0) ? (1u << 24) : 0u)
+                       | ((hasTof) ? (1u << 25) : 0u);
+      nTracks++;
+    }
+    nEpdHits = 0;
+    for(Int_t iHit=0; iHit<epdHits.nHits; iHit++){
+      if(epdHits.ew[iHit] != 0) continue; // east side only
+      epdTile[nEpdHits] = epdHits.position[iHit]*100 + epdHits.tile[iHit];
+      epdNMip[nEpdHits] = epdHits.nMip[iHit];
+      nEpdHits++;
+    }
+  }
+
+  // skim -> the event info and the raw leaves of PicoTrackColumns/EpdHitBuffer,
+  // to be decoded as for the picoDst
+  void Get(PicoEventInfo &info, PicoTrackColumns &tracks, EpdHitBuffer &epdHits) const {
+    info.runId         = runId;
+    info.eventId       = eventId;
+    info.bField        = bField;
+    info.primaryVertex.SetXYZ(vx, vy, vz);
+    info.triggerIds.assign(1, _goodTriggerId); // only triggered events are skimmed
+    info.refMult       = refMult;
+    info.grefMult      = grefMult;
+    info.nBTOFMatch    = nBTOFMatch;
+    tracks.Reserve(nTracks, nTracks);
+    tracks.nTracks = nTracks;
+    tracks.nTraits = nTracks; // BTofPidTraits i belongs to track i
+    for(Int_t iTrk=0; iTrk<nTracks; iTrk++){
+      tracks.pMomX[iTrk]   = pMomX[iTrk];
+      tracks.pMomY[iTrk]   = pMomY[iTrk];
+      tracks.pMomZ[iTrk]   = pMomZ[iTrk];
+      tracks.gMomX[iTrk]   = gMomX[iTrk];
+      tracks.gMomY[iTrk]   = gMomY[iTrk];
+      tracks.gMomZ[iTrk]   = gMomZ[iTrk];
+      tracks.originX[iTrk] = originX[iTrk];
+      tracks.originY[iTrk] = originY[iTrk];
+      tracks.originZ[iTrk] = originZ[iTrk];
+      tracks.dEdx[iTrk]    = dEdx[iTrk];
+      tracks.nSigmaPionRaw[iTrk]     = nSigmaPion[iTrk];
+      tracks.nSigmaKaonRaw[iTrk]     = nSigmaKaon[iTrk];
+      tracks.nSigmaProtonRaw[iTrk]   = nSigmaProton[iTrk];
+      tracks.nSigmaElectronRaw[iTrk] = nSigmaElectron[iTrk];
+      UInt_t word = quality[iTrk];
+      Int_t  nHitsFit = word & 0xFF;
+      tracks.nHitsFitCharge[iTrk]     = (word & (1u << 24)) ? nHitsFit : -nHitsFit;
+      tracks.nHitsPoss[iTrk]          = (word >> 8) & 0xFF;
+      tracks.nHitsDedx[iTrk]          = (word >> 16) & 0xFF;
+      tracks.bTofPidTraitsIndex[iTrk] = (word & (1u << 25)) ? iTrk : -1;
+      tracks.bTofBetaRaw[iTrk]        = tofBeta[iTrk];
+    }
+    epdHits.Reserve(nEpdHits);
+    epdHits.nHits = nEpdHits;
+    for(Int_t iHit=0; iHit<nEpdHits; iHit++){
+      epdHits.id[iHit]     = -epdTile[iHit]; // east
+      epdHits.qtData[iHit] = 0;
+      epdHits.nMip[iHit]   = epdNMip[iHit];
+    }
+  }
+
+private:
+  TTree *mTree;       // the arrays are set as branch addresses of
+  Int_t  mTreeNumber; // reading: tree of the chain the arrays are sized for
+};
+
+// Skim file or list of skim files (.list/.lis) as a chain
+inline TChain* MakeFlowSkimChain(const Char_t *inFile){
+  TChain *chain = new TChain("FlowSkim");
+  TString fileName(inFile);
+  if(fileName.EndsWith(".list") || fileName.EndsWith(".lis")){
+    std::ifstream list(inFile);
+    std::string line;
+    while(std::getline(list, line)){
+      TString skimFile(line.c_str());
+      skimFile = skimFile.Strip(TString::kBoth);
+      if(!skimFile.IsNull() && !skimFile.BeginsWith("#")) chain->Add(skimFile);
+    }
+  } else {
+    chain->Add(inFile);
+  }
+  return chain;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#!/bin/bash
+#  Incremental re-analysis of a file list with a cache of per-file outputs
+#
+#  usage: ./PicoIncremental.sh file.list nProc [cut var iter [options [outName]]]
+#    e.g. ./PicoIncremental.sh file.list 16 0 0 1 "cache=30" test
+#  Every file of the list is analysed on its own (PicoAnalyzer(file,...)) and
+#  its outputs (with qvec=1 also Qvector_OUTPUT_) are kept in $CACHEDIR/<key>/,
+#  where <key> is the md5 of
+#    - the file: name, size and modification time (CHECKSUM=md5: its content)
+#    - the analysis configuration: order, cut, var, iter, the options, without
+#      those that only change how a job runs, the content of the profile= and
+#      tags= files, and the source files
+#    - the calibration version: the EpCorrection_INPUT_ and Resolution_INPUT_
+#      files of $CALIB_DIR and $CALIB_VERSION
+#  A rerun only analyses the files without a cache entry for their key, up to
+#  nProc at a time, and then merges the entries of all files of the list with
+#  MergeAnalyzerOutputs.cxx into the files a single job with outName would
+#  write. A merge reads at most $MERGE_BATCH (default 100) files: longer lists
+#  are merged in batches, then the batches of the batches, in merge_<outName>.tmp/.
+#  Entries of files no longer in the list stay in the cache, until removed
+#  with rm -rf. Logs are in logs/.
+#  Run it in the STAR environment (stardev), as PicoAnalyzer.sh.
+
+list=$1
+nProc=${2:-4}
+cut=${3:-0}
+var=${4:-0}
+iter=${5:-1}
+options=${6:-""}
+out=${7:-test}
+cacheDir=${CACHEDIR:-resultcache}
+checksum=${CHECKSUM:-stat}
+calibDir=${CALIB_DIR:-/star/u/dchen/GitHub/EpdAna}
+mergeBatch=${MERGE_BATCH:-100}
+if [ -z "$list" ]
+then
+	echo "usage: $0 file.list nProc [cut var iter [options [outName]]]"
+	exit 1
+fi
+case ",$options," in
+	*,manifest=*|*,job=*|*,first=*|*,last=*|*,skim=*|*,trace=*)
+		echo "manifest, job, first, last, skim and trace select or replace the analysis of a file, they can not be cached"
+		exit 1;;
+esac
+mkdir -p logs $cacheDir
+
+# ------------------ Configuration and calibration part of the key ------------------
+# Options that do not change the outputs are left out, so e.g. threads=8 reuses the entries of threads=1
+keyOptions=$(echo "$options" | tr ',' '\n' | grep -v -E '^$|^(threads|block|cache|learn|prefetch|pipeline|checkpoint|lazy|stage|stagegb|stageahead|openahead)=' | sort | tr '\n' ',')
+sourceSum=$(cat PicoAnalyzer.cxx Pico*.h EpdHitBuffer.h | md5sum | cut -d' ' -f1)
+calibSum=$( (ls $calibDir/EpCorrection_INPUT_sys_* $calibDir/Resolution_INPUT_sys_* 2>/dev/null | sort | xargs -r md5sum; echo "$CALIB_VERSION") | md5sum | cut -d' ' -f1)
+# The read profile and the tag index change what is read, so a rewritten file of the same name is another configuration
+inputSums=""
+for option in $(echo "$options" | tr ',' '\n' | grep -E '^(profile|tags)=')
+do
+	sum=$(md5sum < "${option#*=}" 2>/dev/null | cut -d' ' -f1)
+	if [ -z "$sum" ]
+	then
+		echo "${option#*=} of $option can not be read"
+		exit 1
+	fi
+	inputSums="$inputSums ${option%%=*}:$sum"
+done
+configKey="1 $cut $var $iter $keyOptions $sourceSum $calibSum$inputSums"
+echo "configuration: order 1, cut $cut, var $var, iter $iter, options \"$keyOptions\""
+echo "source $sourceSum, calibration $calibSum"
+
+# Key of a file, empty if the file can not be found
+key_of() {
+	local id
+	if [ "$checksum" = "md5" ]
+	then
+		id=$(md5sum < "$1" 2>/dev/null | cut -d' ' -f1)
+	else
+		id=$(stat -L -c '%s %Y' "$1" 2>/dev/null)
+	fi
+	[ -n "$id" ] || return
+	echo "$1 $id $configKey" | md5sum | cut -d' ' -f1
+}
+
+files=()
+keys=()
+missing=()
+while read -r file
+do
+	[ -n "$file" ] || continue
+	[ "${file:0:1}" = "#" ] && continue
+	key=$(key_of "$file")
+	if [ -z "$key" ]
+	then
+		echo "$file can not be found, it is left out"
+		continue
+	fi
+	if [[ " ${keys[*]} " == *" $key "* ]]
+	then
+		echo "$file is listed twice, it is counted once"
+		continue
+	fi
+	files+=("$file")
+	keys+=("$key")
+	[ -d "$cacheDir/$key" ] || missing+=($((${#files[@]}-1)))
+done < "$list"
+echo "${#files[@]} files, ${#missing[@]} to analyse, $((${#files[@]}-${#missing[@]})) from $cacheDir"
+if [ ${#files[@]} -eq 0 ]
+then
+	exit 1
+fi
+
+# ------------------ Analyse the files without a cache entry ------------------------
+# Compile once, so the processes do not race on the ACLiC build (not needed with the executable of make)
+if [ ${#missing[@]} -gt 0 ] && [ ! -x ./PicoAnalyzer ]
+then
+	root4star -b -q -l RunAnalyzer.C+ > logs/${out}_compile.log 2>&1
+	root4star -b -q -l -e '.L PicoAnalyzer.cxx+' >> logs/${out}_compile.log 2>&1 || { echo "PicoAnalyzer.cxx does not compile, see logs/${out}_compile.log"; exit 1; }
+fi
+
+# Outputs of the file with key k: [prefix]sys_<cut name>_var<var>_iter<iter>_<out>_<k>.picoDst.result.root
+start_file() {
+	local i=$1
+	local key=${keys[$i]}
+	if [ -x ./PicoAnalyzer ]
+	then
+		./PicoAnalyzer "${files[$i]}" ${out}_$key 1 $cut $var $iter "$options" > logs/${out}_$key.log 2>&1 &
+	else
+		root4star -b -q -l -e '.L PicoAnalyzer.cxx+' \
+			-e "gSystem->Exit(PicoAnalyzer(\"${files[$i]}\",\"${out}_$key\",1,$cut,$var,$iter,\"$options\") ? 0 : 1)" \
+			> logs/${out}_$key.log 2>&1 &
+	fi
+	pids[$i]=$!
+}
+
+# Moves the outputs of file i into its cache entry, renamed to ..._partial.picoDst.result.root
+store_file() {
+	local key=${keys[$1]}
+	local result=$(ls sys_*_var${var}_iter${iter}_${out}_$key.picoDst.result.root 2>/dev/null | head -1)
+	[ -n "$result" ] || return 1
+	rm -rf $cacheDir/$key.tmp
+	mkdir -p $cacheDir/$key.tmp
+	for prefix in "" EpCorrection_OUTPUT_ PhiMesonAna_OUTPUT_ Qvector_OUTPUT_
+	do
+		[ -f "$prefix$result" ] || continue
+		mv "$prefix$result" $cacheDir/$key.tmp/${prefix}${result/_${out}_$key./_partial.}
+	done
+	echo "${files[$1]}" > $cacheDir/$key.tmp/source
+	mv $cacheDir/$key.tmp $cacheDir/$key
+}
+
+declare -a pids
+status=0
+running=()
+next=0
+while [ $next -lt ${#missing[@]} ] || [ ${#running[@]} -gt 0 ]
+do
+	while [ $next -lt ${#missing[@]} ] && [ ${#running[@]} -lt $nProc ]
+	do
+		start_file ${missing[$next]}
+		running+=(${missing[$next]})
+		next=$((next+1))
+	done
+	sleep 2
+	still=()
+	for i in "${running[@]}"
+	do
+		if kill -0 ${pids[$i]} 2>/dev/null
+		then
+			still+=($i)
+			continue
+		fi
+		wait ${pids[$i]}
+		rc=$?
+		if [ $rc -eq 0 ] && store_file $i
+		then
+			echo "${files[$i]} done"
+		else
+			echo "${files[$i]} failed (exit code $rc), see logs/${out}_${keys[$i]}.log"
+			status=1
+		fi
+	done
+	running=("${still[@]}")
+done
+if [ $status -ne 0 ]
+then
+	echo "Not all files were analysed, the outputs are not merged. The files done are cached for the next run."
+	exit 1
+fi
+
+# ------------------ Merge the cache entries of the list ----------------------------
+mergeDir=merge_${out}.tmp
+
+# Merges the files listed in $1 into $2. A list of more than mergeBatch files is
+# split into batches, each merged into a file of $mergeDir, and so on with the
+# list of those files, so no merge has more than mergeBatch files open.
+merge_list() {
+	local list=$1
+	local level=0
+	while [ $(wc -l < "$list") -gt $mergeBatch ]
+	do
+		level=$((level+1))
+		split -l $mergeBatch -d -a 5 --additional-suffix=.list "$list" $mergeDir/level${level}_
+		: > $mergeDir/level$level.list
+		for batch in $mergeDir/level${level}_*.list
+		do
+			root4star -b -q -l -e '.L MergeAnalyzerOutputs.cxx+' \
+				-e "gSystem->Exit(MergeAnalyzerOutputs(\"${batch%.list}.root\",\"$batch\") ? 0 : 1)" >> logs/${out}_merge.log 2>&1 || return 1
+			[ -f "${batch%.list}.root" ] || return 1
+			echo "${batch%.list}.root" >> $mergeDir/level$level.list
+		done
+		list=$mergeDir/level$level.list
+	done
+	root4star -b -q -l -e '.L MergeAnalyzerOutputs.cxx+' \
+		-e "gSystem->Exit(MergeAnalyzerOutputs(\"$2\",\"$list\") ? 0 : 1)" >> logs/${out}_merge.log 2>&1 || return 1
+	[ -f "$2" ]
+}
+
+rm -f logs/${out}_merge.log
+for prefix in "" EpCorrection_OUTPUT_ PhiMesonAna_OUTPUT_ Qvector_OUTPUT_
+do
+	partial=$(ls $cacheDir/${keys[0]}/${prefix}sys_*_partial.picoDst.result.root 2>/dev/null | head -1)
+	[ -n "$partial" ] || continue
+	partial=$(basename $partial)
+	merged=${partial/_partial./_${out}.}
+	rm -rf $mergeDir
+	mkdir -p $mergeDir
+	for key in "${keys[@]}"
+	do
+		echo "$cacheDir/$key/$partial"
+	done > $mergeDir/inputs.list
+	rm -f $merged
+	if merge_list $mergeDir/inputs.list $merged
+	then
+		echo "merged into $merged"
+	else
+		rm -f $merged
+		echo "merging into $merged failed, see logs/${out}_merge.log"
+		status=1
+	fi
+done
+rm -rf $mergeDir
+exit $status
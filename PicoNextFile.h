@@ -0,0 +1,112 @@
+/**
+ * \brief Opening of the next file of the chain ahead of the event loop, PicoAnalyzer(...,"openahead=1")
+ *
+ * At a file boundary TChain::LoadTree() opens the next file and reads its
+ * header, key list, streamer info and the TTree metadata with its many
+ * picoDst branches, while the event loop waits. When the reader enters a file,
+ * PicoNextFileOpener::Next() hands the following file of the chain to a
+ * thread, which opens it and reads the tree the same way. The chain then opens
+ * a file whose metadata blocks are already in the page cache of the node (or
+ * the caches of the storage and the open connection of an xrootd server), and
+ * the time of the thread is not on the critical path.
+ * The file of the thread is kept open until the next one is opened, so it is
+ * still open when the chain opens the same file.
+ */
+
+#ifndef PicoNextFile_h
+#define PicoNextFile_h
+
+#include "TChain.h"
+#include "TChainElement.h"
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TStopwatch.h"
+#include "TString.h"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+struct PicoNextFileOpener {
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::thread mThread;
+  Bool_t   mStop;
+  std::deque<std::string> mPending; // files to open, chain order
+  std::set<std::string>   mQueued;  // every file queued so far, each is opened once
+  TString  mTreeName;
+  TFile   *mOpen;       // the last file opened ahead
+  Int_t    mNOpened, mNFailed;
+  Double_t mSeconds;    // spent by the thread opening files
+  PicoNextFileOpener() : mStop(kFALSE), mOpen(NULL), mNOpened(0), mNFailed(0), mSeconds(0) {}
+  ~PicoNextFileOpener(){ Stop(); }
+
+  // A reader entered tree treeNumber of chain: open the next tree ahead
+  void Next(TChain *chain, Int_t treeNumber){
+    TChainElement *element = (TChainElement*)chain->GetListOfFiles()->At(treeNumber + 1);
+    if(!element) return;
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(!mQueued.insert(element->GetTitle()).second) return;
+    if(!mThread.joinable()){
+      mTreeName = chain->GetName();
+      mThread = std::thread(&PicoNextFileOpener::Run, this);
+    }
+    mPending.push_back(element->GetTitle());
+    mWake.notify_one();
+  }
+
+  void Run(){
+    std::unique_lock<std::mutex> lock(mMutex);
+    while(!mStop){
+      if(mPending.empty()){
+        mWake.wait(lock);
+        continue;
+      }
+      TString name = mPending.front().c_str();
+      mPending.pop_front();
+      lock.unlock();
+      TStopwatch timer;
+      TDirectory *savedDir = gDirectory;
+      TFile *file = TFile::Open(name,"READ");
+      Bool_t opened = (file && !file->IsZombie() && file->Get(mTreeName));
+      savedDir->cd();
+      timer.Stop();
+      if(!opened){
+        std::cout << "Open ahead: " << name << " can not be opened" << std::endl;
+        delete file;
+        file = NULL;
+      }
+      delete mOpen; // the chain has its own handle of it by now
+      mOpen = file;
+      lock.lock();
+      if(opened) mNOpened++;
+      else mNFailed++;
+      mSeconds += timer.RealTime();
+    }
+  }
+
+  void Stop(){
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if(mStop) return;
+      mStop = kTRUE;
+    }
+    mWake.notify_one();
+    if(mThread.joinable()) mThread.join();
+    delete mOpen;
+    mOpen = NULL;
+  }
+
+  void Print(){
+    Stop();
+    std::cout << "Open ahead: " << mNOpened << " files opened by the thread in " << mSeconds << " s";
+    if(mNFailed > 0) std::cout << ", " << mNFailed << " failed";
+    std::cout << std::endl;
+  }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#!/bin/bash
+#  Runs PicoAnalyzer.cxx in nProc processes on this node and merges their outputs
+#
+#  usage: ./PicoParallel.sh file.list nProc [cut var iter [options [outName]]]
+#    e.g. ./PicoParallel.sh file.list 16 0 0 1 "cache=30"
+#  The list is cut into nProc balanced jobs by ShardFileList.cxx, job i runs as
+#  PicoAnalyzer(...,"<outName>_proc<i>",...,"manifest=...,job=i,<options>").
+#  A process that fails (non-zero exit or no output file) is started again, up
+#  to MAXRETRIES times (default 2). When all jobs are done, the three outputs of
+#  the processes are merged by MergeAnalyzerOutputs.cxx into the files a single
+#  PicoAnalyzer job with outName would write. Logs are in logs/.
+#  Run it in the STAR environment (stardev), as PicoAnalyzer.sh. The processes
+#  run the PicoAnalyzer executable of make if it is there, ACLiC otherwise.
+
+list=$1
+nProc=${2:-4}
+cut=${3:-0}
+var=${4:-0}
+iter=${5:-1}
+options=${6:-""}
+out=${7:-test}
+maxRetries=${MAXRETRIES:-2}
+if [ -z "$list" ]
+then
+	echo "usage: $0 file.list nProc [cut var iter [options [outName]]]"
+	exit 1
+fi
+manifest="${out}.manifest"
+mkdir -p logs
+
+# Compile once, so the processes do not race on the ACLiC build (not needed with the executable of make)
+if [ ! -x ./PicoAnalyzer ]
+then
+	root4star -b -q -l RunAnalyzer.C+ > logs/${out}_compile.log 2>&1
+	root4star -b -q -l -e '.L PicoAnalyzer.cxx+' >> logs/${out}_compile.log 2>&1 || { echo "PicoAnalyzer.cxx does not compile, see logs/${out}_compile.log"; exit 1; }
+fi
+root4star -b -q -l ShardFileList.cxx+\(\"$list\",\"$manifest\",$nProc\) > logs/${out}_shard.log 2>&1
+if [ ! -f "$manifest" ]
+then
+	echo "No shard manifest, see logs/${out}_shard.log"
+	exit 1
+fi
+
+# Output of process i: sys_<cut name>_var<var>_iter<iter>_<out>_proc<i>.picoDst.result.root
+result_of() {
+	ls sys_*_var${var}_iter${iter}_${out}_proc$1.picoDst.result.root 2>/dev/null | head -1
+}
+
+start_proc() {
+	local i=$1
+	local procOptions="manifest=$manifest,job=$i"
+	if [ -n "$options" ]
+	then
+		procOptions="$procOptions,$options"
+	fi
+	if [ -x ./PicoAnalyzer ]
+	then
+		./PicoAnalyzer $list ${out}_proc$i 1 $cut $var $iter "$procOptions" > logs/${out}_proc$i.log.${tries[$i]} 2>&1 &
+	else
+		root4star -b -q -l -e '.L PicoAnalyzer.cxx+' \
+			-e "gSystem->Exit(PicoAnalyzer(\"$list\",\"${out}_proc$i\",1,$cut,$var,$iter,\"$procOptions\") ? 0 : 1)" \
+			> logs/${out}_proc$i.log.${tries[$i]} 2>&1 &
+	fi
+	pids[$i]=$!
+	echo "process $i started (pid ${pids[$i]}, attempt ${tries[$i]})"
+}
+
+declare -a pids tries state # state: run, done, failed
+for ((i=0; i<nProc; i++))
+do
+	tries[$i]=0
+	state[$i]=run
+	rm -f $(result_of $i)
+	start_proc $i
+done
+
+running=$nProc
+while [ $running -gt 0 ]
+do
+	sleep 10
+	for ((i=0; i<nProc; i++))
+	do
+		[ "${state[$i]}" = "run" ] || continue
+		kill -0 ${pids[$i]} 2>/dev/null && continue
+		wait ${pids[$i]}
+		rc=$?
+		if [ $rc -eq 0 ] && [ -n "$(result_of $i)" ]
+		then
+			state[$i]=done
+			running=$((running-1))
+			echo "process $i done"
+		elif [ ${tries[$i]} -lt $maxRetries ]
+		then
+			echo "process $i failed (exit code $rc), see logs/${out}_proc$i.log.${tries[$i]}"
+			tries[$i]=$((tries[$i]+1))
+			start_proc $i
+		else
+			state[$i]=failed
+			running=$((running-1))
+			echo "process $i failed $((maxRetries+1)) times, giving up"
+		fi
+	done
+done
+
+for ((i=0; i<nProc; i++))
+do
+	if [ "${state[$i]}" != "done" ]
+	then
+		echo "Not all processes succeeded, the outputs are not merged"
+		exit 1
+	fi
+done
+
+# Merge (.picoDst.result.root, EpCorrection_OUTPUT_, PhiMesonAna_OUTPUT_)
+status=0
+rm -f logs/${out}_merge.log
+for prefix in "" EpCorrection_OUTPUT_ PhiMesonAna_OUTPUT_
+do
+	first=$(ls ${prefix}sys_*_var${var}_iter${iter}_${out}_proc0.picoDst.result.root 2>/dev/null | head -1)
+	[ -n "$first" ] || continue
+	merged=${first/_proc0./.}
+	inputs=""
+	for ((i=0; i<nProc; i++))
+	do
+		inputs="$inputs ${first/_proc0./_proc$i.}"
+	done
+	rm -f $merged
+	root4star -b -q -l -e '.L MergeAnalyzerOutputs.cxx+' \
+		-e "gSystem->Exit(MergeAnalyzerOutputs(\"$merged\",\"${inputs# }\") ? 0 : 1)" >> logs/${out}_merge.log 2>&1
+	if [ $? -eq 0 ] && [ -f "$merged" ]
+	then
+		echo "merged into $merged"
+		rm -f $inputs
+	else
+		echo "merging into $merged failed, see logs/${out}_merge.log"
+		status=1
+	fi
+done
+exit $status
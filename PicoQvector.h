@@ -0,0 +1,56 @@
+/**
+ * \brief Raw event plane Q-vectors of one event, for offline calibration
+ *
+ * Written by PicoAnalyzer(...,"qvec=1") into the tree "Qvector" of
+ * Qvector_OUTPUT_<output name>, one row per event passing the event cuts,
+ * and read back by QvectorCalib.cxx, which recomputes the recenter and shift
+ * corrections, the event plane distributions and the sub-event correlations
+ * without going back to the picoDst.
+ * The Q-vectors are those of the event loop: the EPD east Q-vectors after the
+ * sign flip of the first order, the TPC ones with their eta and pT weights.
+ */
+
+#ifndef PicoQvector_h
+#define PicoQvector_h
+
+#include "TTree.h"
+
+struct PicoQvectorRecord {
+  static const Int_t kNEpdSub = 5; // EPD east eta ranges, _nEventTypeBins
+  static const Int_t kNTpcSub = 2; // TPC eta ranges, _nEventTypeBins_tpc
+
+  Int_t    runId;
+  Int_t    eventId;
+  Float_t  vz;
+  Int_t    centrality;           // 1 (0-5%) ... 9 (70-80%)
+  Int_t    order;                // event plane order of the Q-vectors
+  Int_t    nEpdEast[kNEpdSub];   // N_Epd_east
+  Double_t QEpdEast[kNEpdSub][2];// QrawEastSide [x,y]
+  Int_t    nTpc[kNTpcSub];       // NTpcAll
+  Double_t QTpc[kNTpcSub][2];    // QrawTpcAll [x,y]
+
+  void Branch(TTree *tree){
+    tree->Branch("runId",      &runId,      "runId/I");
+    tree->Branch("eventId",    &eventId,    "eventId/I");
+    tree->Branch("vz",         &vz,         "vz/F");
+    tree->Branch("centrality", &centrality, "centrality/I");
+    tree->Branch("order",      &order,      "order/I");
+    tree->Branch("nEpdEast",   nEpdEast,    "nEpdEast[5]/I");
+    tree->Branch("QEpdEast",   QEpdEast,    "QEpdEast[5][2]/D");
+    tree->Branch("nTpc",       nTpc,        "nTpc[2]/I");
+    tree->Branch("QTpc",       QTpc,        "QTpc[2][2]/D");
+  }
+  void SetAddress(TTree *tree){
+    tree->SetBranchAddress("runId",      &runId);
+    tree->SetBranchAddress("eventId",    &eventId);
+    tree->SetBranchAddress("vz",         &vz);
+    tree->SetBranchAddress("centrality", &centrality);
+    tree->SetBranchAddress("order",      &order);
+    tree->SetBranchAddress("nEpdEast",   nEpdEast);
+    tree->SetBranchAddress("QEpdEast",   QEpdEast);
+    tree->SetBranchAddress("nTpc",       nTpc);
+    tree->SetBranchAddress("QTpc",       QTpc);
+  }
+};
+
+#endif
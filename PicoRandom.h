@@ -0,0 +1,59 @@
+/**
+ * \brief Counter-based random numbers of the phi meson rotation background
+ *
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+ * SC'11): the random number of a K+K- pair is a function of
+ *   (seed, runId, eventId, pair index)
+ * alone, with no generator state. The rotation background is then the same
+ * for any # of threads, shards or checkpoint resume point, and no generator
+ * has to be shared between threads or saved in a checkpoint.
+ * The pair index of K+ i and K- j of an event is i*nKaonMinus + j.
+ * PicoPhilox::Uniform() fills the numbers of a whole event at once; the loop
+ * has no dependency from one pair to the next and is vectorized by the compiler.
+ */
+
+#ifndef PicoRandom_h
+#define PicoRandom_h
+
+#include "Rtypes.h"
+
+#include <stdint.h>
+
+struct PicoPhilox {
+  static const uint32_t kMul0  = 0xD2511F53;
+  static const uint32_t kMul1  = 0xCD9E8D57;
+  static const uint32_t kWeyl0 = 0x9E3779B9; // key increments, golden ratio
+  static const uint32_t kWeyl1 = 0xBB67AE85; // sqrt(3)-1
+  static const uint32_t kStreamRotation = 0x50484931; // "PHI1", counter word of the rotation background
+
+  // Philox4x32-10 of the counter ctr with key
+  static inline void Block(uint32_t ctr[4], uint32_t key0, uint32_t key1){
+    for(int round=0; round<10; round++){
+      uint64_t product0 = (uint64_t)kMul0 * ctr[0];
+      uint64_t product1 = (uint64_t)kMul1 * ctr[2];
+      uint32_t hi0 = (uint32_t)(product0 >> 32), lo0 = (uint32_t)product0;
+      uint32_t hi1 = (uint32_t)(product1 >> 32), lo1 = (uint32_t)product1;
+      ctr[0] = hi1 ^ ctr[1] ^ key0;
+      ctr[1] = lo1;
+      ctr[2] = hi0 ^ ctr[3] ^ key1;
+      ctr[3] = lo0;
+      key0 += kWeyl0;
+      key1 += kWeyl1;
+    }
+  }
+
+  // Uniform in [0,1), 53 bits
+  static inline Double_t Uniform(UInt_t seed, Int_t runId, Int_t eventId, UInt_t pair){
+    uint32_t ctr[4] = {pair, (uint32_t)eventId, (uint32_t)runId, kStreamRotation};
+    Block(ctr, seed, 0);
+    uint64_t bits = ((uint64_t)ctr[0] << 21) ^ (ctr[1] >> 11);
+    return (Double_t)bits * (1.0/9007199254740992.0); // 2^-53
+  }
+
+  // Uniform() of the pairs firstPair ... firstPair+n-1 of an event
+  static inline void Uniform(UInt_t seed, Int_t runId, Int_t eventId, UInt_t firstPair, Int_t n, Double_t *out){
+    for(Int_t i=0; i<n; i++) out[i] = Uniform(seed, runId, eventId, firstPair + (UInt_t)i);
+  }
+};
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * \brief Work units of a picoDst file list, balanced over batch jobs
+ *
+ * Written by ShardFileList.cxx. The manifest has one line per work unit:
+ *   job file firstEntry lastEntry
+ * (entries of the file, both included), the units of a job listed longest
+ * first. Next to it, <manifest>.job<N>.list holds the files of job N.
+ * PicoAnalyzer(...,"manifest=FILE,job=N") reads the list of job N and only
+ * the entries of its units, through a TEntryList.
+ */
+
+#ifndef PicoShardManifest_h
+#define PicoShardManifest_h
+
+#include "TChain.h"
+#include "TChainElement.h"
+#include "TEntryList.h"
+#include "TString.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct PicoShardUnit {
+  Int_t    job;
+  TString  file;
+  Long64_t firstEntry;
+  Long64_t lastEntry; // included
+  Long64_t Size() const { return lastEntry - firstEntry + 1; }
+};
+
+inline TString ShardJobListName(const TString &manifest, Int_t job){
+  return TString::Format("%s.job%d.list", manifest.Data(), job);
+}
+
+// Units of one job (job < 0: all units), kFALSE if the manifest can not be read
+inline Bool_t ReadShardManifest(const TString &manifest, Int_t job, std::vector<PicoShardUnit> &units){
+  std::ifstream in(manifest.Data());
+  if(!in.is_open()){
+    std::cout << "Shard manifest " << manifest << " not found" << std::endl;
+    return kFALSE;
+  }
+  std::string line;
+  while(std::getline(in, line)){
+    if(line.empty() || line[0] == '#') continue;
+    std::istringstream fields(line);
+    PicoShardUnit unit;
+    std::string file;
+    if(!(fields >> unit.job >> file >> unit.firstEntry >> unit.lastEntry)) continue;
+    unit.file = file.c_str();
+    if(job < 0 || unit.job == job) units.push_back(unit);
+  }
+  return kTRUE;
+}
+
+// Entry list of the chain entries in the units, NULL if a unit file is not in the chain
+inline TEntryList* MakeShardEntryList(TChain *chain, const std::vector<PicoShardUnit> &units){
+  TEntryList *entryList = new TEntryList("ShardEntryList", "work units of the shard manifest");
+  entryList->SetDirectory(0);
+  for(unsigned int iUnit=0; iUnit<units.size(); iUnit++){
+    Bool_t found = kFALSE;
+    TIter next(chain->GetListOfFiles());
+    while(TChainElement *element = (TChainElement*)next()){
+      if(units[iUnit].file == element->GetTitle()) found = kTRUE;
+    }
+    if(!found){
+      std::cout << "Shard manifest: " << units[iUnit].file << " is not in the file list" << std::endl;
+      delete entryList;
+      return NULL;
+    }
+    entryList->SetTree(chain->GetName(), units[iUnit].file);
+    for(Long64_t entry=units[iUnit].firstEntry; entry<=units[iUnit].lastEntry; entry++) entryList->Enter(entry);
+  }
+  return entryList;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/**
+ * \brief Chain entries skipped by the fault-tolerant event loop
+ *
+ * With PicoAnalyzer(...,"skipbad=1") an entry that can not be read is logged
+ * and skipped instead of ending the event loop:
+ *   kBadFile   the file of the entry can not be opened, the rest of the file is skipped
+ *   kReadError an I/O error while reading the entry (e.g. a corrupt basket)
+ *   kNoEvent   the entry has no StPicoEvent
+ * Consecutive entries of a file skipped for the same reason form one range.
+ * The ranges are written to the tree "SkippedEntries" of the .picoDst.result.root
+ * output, one row per range:
+ *   file                  name of the input file, the original one for a staged copy (stage=DIR)
+ *   firstEntry, lastEntry entries of the file, both included
+ *   chainFirst, chainLast entries of the chain
+ *   reason                kBadFile, kReadError or kNoEvent
+ * The tree is written, empty, also when nothing was skipped.
+ */
+
+#ifndef PicoSkipLog_h
+#define PicoSkipLog_h
+
+#include "TChain.h"
+#include "TChainElement.h"
+#include "TTree.h"
+#include "TString.h"
+
+#include "PicoStageCache.h"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+struct PicoSkippedRange {
+  TString  file;
+  Long64_t firstEntry, lastEntry; // of the file
+  Long64_t chainFirst, chainLast; // of the chain
+  Int_t    reason;
+};
+
+struct PicoSkipLog {
+  enum { kBadFile = 1, kReadError = 2, kNoEvent = 3 };
+  static const Int_t kMaxFileName = 1024;
+  std::vector<PicoSkippedRange> mRanges;
+  PicoStageCache *mStageCache; // of stage=DIR, NULL = no staging
+  PicoSkipLog() : mStageCache(NULL) {}
+
+  // Tree number of a chain entry, from the tree offsets (the tree itself may not load)
+  static Int_t TreeOf(TChain *chain, Long64_t chainEntry){
+    Long64_t *offset = chain->GetTreeOffset();
+    for(Int_t iTree=0; offset && iTree<chain->GetNtrees(); iTree++){
+      if(chainEntry >= offset[iTree] && chainEntry < offset[iTree+1]) return iTree;
+    }
+    return -1;
+  }
+  // Name of tree iTree of chain, the original one if the element was switched to a local copy
+  static TString FileOf(TChain *chain, Int_t iTree, PicoStageCache *stageCache){
+    TChainElement *element = (iTree >= 0) ? (TChainElement*)chain->GetListOfFiles()->At(iTree) : NULL;
+    if(!element) return "";
+    return (stageCache) ? stageCache->Source(element->GetTitle()) : TString(element->GetTitle());
+  }
+  // First chain entry after the file of chainEntry
+  static Long64_t NextFileEntry(TChain *chain, Long64_t chainEntry){
+    Int_t iTree = TreeOf(chain, chainEntry);
+    return (iTree >= 0) ? chain->GetTreeOffset()[iTree+1] : chainEntry + 1;
+  }
+
+  void Add(TChain *chain, Long64_t chainEntry, Int_t reason){
+    Int_t iTree = TreeOf(chain, chainEntry);
+    TString file = FileOf(chain, iTree, mStageCache);
+    Long64_t entry = (iTree >= 0) ? chainEntry - chain->GetTreeOffset()[iTree] : chainEntry;
+    if(!mRanges.empty()){
+      PicoSkippedRange &last = mRanges.back();
+      if(last.reason == reason && last.file == file && last.chainLast + 1 == chainEntry){
+        last.lastEntry = entry;
+        last.chainLast = chainEntry;
+        return;
+      }
+    }
+    PicoSkippedRange range;
+    range.file       = file;
+    range.firstEntry = range.lastEntry = entry;
+    range.chainFirst = range.chainLast = chainEntry;
+    range.reason     = reason;
+    mRanges.push_back(range);
+    std::cout << "Skipping entry " << entry << " of " << file << " (chain entry " << chainEntry << "): "
+              << ((reason == kBadFile) ? "file can not be opened" : (reason == kReadError) ? "read error" : "no event")
+              << std::endl;
+  }
+
+  Long64_t NEntries() const {
+    Long64_t nEntries = 0;
+    for(unsigned int i=0; i<mRanges.size(); i++) nEntries += mRanges[i].chainLast - mRanges[i].chainFirst + 1;
+    return nEntries;
+  }
+
+  // Tree "SkippedEntries" in the current directory
+  TTree* MakeTree() const {
+    Char_t   file[kMaxFileName];
+    Long64_t firstEntry, lastEntry, chainFirst, chainLast;
+    Int_t    reason;
+    TTree *tree = new TTree("SkippedEntries","Entries skipped by skipbad=1, see PicoSkipLog.h");
+    tree->Branch("file",       file,        "file/C");
+    tree->Branch("firstEntry", &firstEntry, "firstEntry/L");
+    tree->Branch("lastEntry",  &lastEntry,  "lastEntry/L");
+    tree->Branch("chainFirst", &chainFirst, "chainFirst/L");
+    tree->Branch("chainLast",  &chainLast,  "chainLast/L");
+    tree->Branch("reason",     &reason,     "reason/I");
+    for(unsigned int i=0; i<mRanges.size(); i++){
+      strncpy(file, mRanges[i].file.Data(), kMaxFileName-1);
+      file[kMaxFileName-1] = '\0';
+      firstEntry = mRanges[i].firstEntry;
+      lastEntry  = mRanges[i].lastEntry;
+      chainFirst = mRanges[i].chainFirst;
+      chainLast  = mRanges[i].chainLast;
+      reason     = mRanges[i].reason;
+      tree->Fill();
+    }
+    tree->ResetBranchAddresses(); // the buffers above go out of scope
+    return tree;
+  }
+
+  // Ranges of a tree written by MakeTree()
+  void ReadTree(TTree *tree){
+    Char_t   file[kMaxFileName];
+    Long64_t firstEntry, lastEntry, chainFirst, chainLast;
+    Int_t    reason;
+    tree->SetBranchAddress("file",       file);
+    tree->SetBranchAddress("firstEntry", &firstEntry);
+    tree->SetBranchAddress("lastEntry",  &lastEntry);
+    tree->SetBranchAddress("chainFirst", &chainFirst);
+    tree->SetBranchAddress("chainLast",  &chainLast);
+    tree->SetBranchAddress("reason",     &reason);
+    mRanges.clear();
+    for(Long64_t i=0; i<tree->GetEntries(); i++){
+      tree->GetEntry(i);
+      PicoSkippedRange range;
+      range.file       = file;
+      range.firstEntry = firstEntry;
+      range.lastEntry  = lastEntry;
+      range.chainFirst = chainFirst;
+      range.chainLast  = chainLast;
+      range.reason     = reason;
+      mRanges.push_back(range);
+    }
+    tree->ResetBranchAddresses();
+  }
+};
+
+#endif
@@ -0,0 +1,237 @@
+/**
+ * \brief Staging of the input picoDst files on node-local disk, PicoAnalyzer(...,"stage=DIR")
+ *
+ * A thread copies the next files of the chain (stageahead=N after the file
+ * being read) from the shared file system to DIR while the event loop reads
+ * the current one. When the reader enters a file, the chain element of the
+ * following file is switched to its local copy, if it is already there, so
+ * TChain opens the copy instead of the original. Files that are not copied
+ * in time are read from their original location.
+ * A copy is named by the md5 of the original name, size and modification time,
+ * so a later pass on the same node (another systematic variation or
+ * iteration, or another process sharing DIR) finds it again, and a rewritten
+ * original is copied anew. The copies of DIR are kept within stagegb=G GB. The
+ * least recently used copies are removed first, by their modification time,
+ * which is set whenever a copy is used. Copies used within the last
+ * kProtectSeconds are not removed, since a chain may be about to open them.
+ * Source() gives the original name of a copy a chain was switched to, so the
+ * skip log and the cache statistics name the original files.
+ */
+
+#ifndef PicoStageCache_h
+#define PicoStageCache_h
+
+#include "TChain.h"
+#include "TChainElement.h"
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TMD5.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PicoStagedFile {
+  std::string name;
+  Long64_t    size;
+  Long_t      lastUse; // modification time
+  bool operator<(const PicoStagedFile &other) const { return lastUse < other.lastUse; }
+};
+
+struct PicoStageCache {
+  static const Int_t kProtectSeconds = 600;
+  TString  mDir;
+  Long64_t mBudget; // bytes
+  Int_t    mAhead;  // files staged after the one being read
+  std::vector<TString> mSources; // chain order, from the first chain given to Use()
+  std::vector<TString> mStaged;  // local copy of each source, "" = not (yet) staged
+  std::vector<Char_t>  mTried;   // staging of the source was attempted
+  std::map<std::string,std::string> mSourceOf; // local copy -> source, of the switched chain elements
+  std::atomic<Int_t>   mPosition; // last file entered by a reader
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::thread mThread;
+  Bool_t   mStop;
+  Int_t    mNCopied, mNReused, mNEvicted, mNSwitched;
+  Long64_t mBytesCopied;
+  PicoStageCache(const TString &dir, Long64_t budget, Int_t ahead)
+    : mDir(dir), mBudget(budget), mAhead(ahead), mPosition(-1), mStop(kFALSE),
+      mNCopied(0), mNReused(0), mNEvicted(0), mNSwitched(0), mBytesCopied(0) {}
+  ~PicoStageCache(){ Stop(); }
+
+  // Local name of a source, "" if the source can not be found
+  TString LocalName(const TString &source) const {
+    FileStat_t stat;
+    if(gSystem->GetPathInfo(source, stat) != 0) return "";
+    TString id = TString::Format("%s %lld %ld", source.Data(), stat.fSize, stat.fMtime);
+    TMD5 md5;
+    md5.Update((const UChar_t*)id.Data(), id.Length());
+    md5.Final();
+    return mDir + "/" + md5.AsString() + "_" + gSystem->BaseName(source);
+  }
+
+  // Copies of DIR, least recently used first
+  void ListStaged(std::vector<PicoStagedFile> &staged, Long64_t &bytes) const {
+    bytes = 0;
+    void *dir = gSystem->OpenDirectory(mDir);
+    if(!dir) return;
+    while(const char *entry = gSystem->GetDirEntry(dir)){
+      TString name(entry);
+      if(name == "." || name == "..") continue;
+      PicoStagedFile file;
+      file.name = (mDir + "/" + name).Data();
+      FileStat_t stat;
+      if(gSystem->GetPathInfo(file.name.c_str(), stat) != 0) continue;
+      file.size    = stat.fSize;
+      file.lastUse = stat.fMtime;
+      bytes += file.size;
+      if(!name.EndsWith(".tmp")) staged.push_back(file); // copies in progress are not removed
+    }
+    gSystem->FreeDirectory(dir);
+    std::sort(staged.begin(), staged.end());
+  }
+
+  // Removes least recently used copies, except those in keep, until size more bytes fit,
+  // kFALSE if they do not
+  Bool_t MakeRoom(Long64_t size, const std::set<std::string> &keep){
+    std::vector<PicoStagedFile> staged;
+    Long64_t bytes;
+    ListStaged(staged, bytes);
+    Long_t now = (Long_t)time(0);
+    for(unsigned int i=0; i<staged.size() && bytes + size > mBudget; i++){
+      if(now - staged[i].lastUse < kProtectSeconds) break;
+      if(keep.count(staged[i].name)) continue;
+      if(gSystem->Unlink(staged[i].name.c_str()) != 0) continue;
+      bytes -= staged[i].size;
+      mNEvicted++;
+    }
+    return (bytes + size <= mBudget);
+  }
+
+  // Local copy of source i, "" if it can not be staged. keep: copies still to be read by the job
+  TString Stage(Int_t i, const std::set<std::string> &keep){
+    TString source = mSources[i];
+    TString local = LocalName(source);
+    if(local.IsNull()) return "";
+    if(!gSystem->AccessPathName(local)){ // from an earlier pass
+      gSystem->Utime(local, (Long_t)time(0), 0);
+      mNReused++;
+      return local;
+    }
+    FileStat_t stat;
+    gSystem->GetPathInfo(source, stat);
+    if(!MakeRoom(stat.fSize, keep)){
+      std::cout << "Stage: no room for " << source << " in " << mDir << ", it is read from its location" << std::endl;
+      return "";
+    }
+    TString tmpName = TString::Format("%s.%d.tmp", local.Data(), gSystem->GetPid());
+    TDirectory *savedDir = gDirectory;
+    Bool_t copied = TFile::Cp(source, tmpName, kFALSE);
+    savedDir->cd();
+    FileStat_t copyStat;
+    if(!copied || gSystem->GetPathInfo(tmpName, copyStat) != 0 || copyStat.fSize != stat.fSize
+       || gSystem->Rename(tmpName, local) != 0){
+      std::cout << "Stage: " << source << " can not be copied to " << mDir << std::endl;
+      gSystem->Unlink(tmpName);
+      return "";
+    }
+    mNCopied++;
+    mBytesCopied += stat.fSize;
+    return local;
+  }
+
+  // Stages the files from the one being read to mAhead after it, in chain order
+  void Run(){
+    std::unique_lock<std::mutex> lock(mMutex);
+    while(!mStop){
+      Int_t next = -1;
+      Int_t last = std::min((Int_t)mSources.size()-1, mPosition + mAhead);
+      for(Int_t i=std::max((Int_t)mPosition,0); i<=last && next<0; i++){
+        if(!mTried[i]) next = i;
+      }
+      if(next < 0){
+        mWake.wait(lock);
+        continue;
+      }
+      mTried[next] = 1;
+      std::set<std::string> keep;
+      for(unsigned int i=std::max((Int_t)mPosition,0); i<mStaged.size(); i++){
+        if(!mStaged[i].IsNull()) keep.insert(mStaged[i].Data());
+      }
+      lock.unlock();
+      TString local = Stage(next, keep);
+      lock.lock();
+      mStaged[next] = local;
+    }
+  }
+
+  // A reader entered tree treeNumber of chain (-1: before the first one). Switches
+  // the element of the next tree to its local copy, if there is one.
+  void Use(TChain *chain, Int_t treeNumber){
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mSources.empty()){ // first call: the chain order of the job, the staging thread starts
+      TIter next(chain->GetListOfFiles());
+      while(TChainElement *element = (TChainElement*)next()) mSources.push_back(element->GetTitle());
+      mStaged.assign(mSources.size(), "");
+      mTried.assign(mSources.size(), 0);
+      gSystem->mkdir(mDir, kTRUE);
+      for(unsigned int i=0; i<mSources.size(); i++){ // copies of earlier passes, usable right away
+        TString local = LocalName(mSources[i]);
+        if(local.IsNull() || gSystem->AccessPathName(local)) continue;
+        mStaged[i] = local;
+        mTried[i]  = 1;
+        mNReused++;
+      }
+      std::cout << "Staging " << mSources.size() << " files to " << mDir << ", " << mAhead << " ahead, at most "
+                << mBudget/(1024*1024*1024) << " GB" << std::endl;
+      mThread = std::thread(&PicoStageCache::Run, this);
+    }
+    if(treeNumber > mPosition) mPosition = treeNumber;
+    mWake.notify_one();
+    Int_t nextTree = treeNumber + 1;
+    if(nextTree < 0 || nextTree >= (Int_t)mStaged.size() || mStaged[nextTree].IsNull()) return;
+    TChainElement *element = (TChainElement*)chain->GetListOfFiles()->At(nextTree);
+    if(!element || mSources[nextTree] != element->GetTitle()) return; // switched already, or another list
+    if(gSystem->AccessPathName(mStaged[nextTree])) return; // removed by another process
+    gSystem->Utime(mStaged[nextTree], (Long_t)time(0), 0);
+    element->SetTitle(mStaged[nextTree]);
+    mSourceOf[mStaged[nextTree].Data()] = mSources[nextTree].Data();
+    mNSwitched++;
+  }
+
+  // Original name of a file a chain element was switched to, other names unchanged
+  TString Source(const TString &name){
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::map<std::string,std::string>::const_iterator it = mSourceOf.find(name.Data());
+    return (it != mSourceOf.end()) ? TString(it->second.c_str()) : name;
+  }
+
+  void Stop(){
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if(mStop) return;
+      mStop = kTRUE;
+    }
+    mWake.notify_one();
+    if(mThread.joinable()) mThread.join();
+  }
+
+  void Print(){
+    Stop();
+    std::cout << "Stage: " << mNCopied << " files copied (" << mBytesCopied/(1024*1024) << " MB), " << mNReused
+              << " found from earlier passes, " << mNSwitched << " chain files read from " << mDir << ", "
+              << mNEvicted << " copies removed" << std::endl;
+  }
+};
+
+#endif
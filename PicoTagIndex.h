@@ -0,0 +1,169 @@
+/**
+ * \brief Event tag index of a picoDst file list
+ *
+ * Written by TagIndexBuilder.cxx, one row per chain entry in the tree
+ * "TagIndex", and one row per picoDst file in the tree "TagFiles".
+ * Files are identified by their TUUID and checked against their size and
+ * # of entries, so an index stays valid for any file list made of the same
+ * files (in any order, or a subset), and a file that was rewritten is detected.
+ *
+ * MakeTagEntryList() turns the index into the TEntryList of the chain
+ * entries passing the event cuts of PicoEventCuts.h.
+ */
+
+#ifndef PicoTagIndex_h
+#define PicoTagIndex_h
+
+#include "TChain.h"
+#include "TChainElement.h"
+#include "TEntryList.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "TUUID.h"
+#include "TString.h"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "PicoEventCuts.h"
+
+// One entry of the chain
+struct PicoTagRecord {
+  Int_t    fileIndex;   // row of TagFiles
+  Long64_t entry;       // entry in the file
+  Int_t    runId;
+  Int_t    eventId;
+  Float_t  vx, vy, vz;  // primary vertex, as stored in StPicoEvent
+  Float_t  vr;          // VertexR(vx,vy)
+  UInt_t   triggerBits; // bit 0: _goodTriggerId
+  Short_t  nFXTMult;    // # of primary tracks
+  Char_t   centrality;  // FXTMultCentrality(nFXTMult)
+
+  void Branch(TTree *tree){
+    tree->Branch("fileIndex",   &fileIndex,   "fileIndex/I");
+    tree->Branch("entry",       &entry,       "entry/L");
+    tree->Branch("runId",       &runId,       "runId/I");
+    tree->Branch("eventId",     &eventId,     "eventId/I");
+    tree->Branch("vx",          &vx,          "vx/F");
+    tree->Branch("vy",          &vy,          "vy/F");
+    tree->Branch("vz",          &vz,          "vz/F");
+    tree->Branch("vr",          &vr,          "vr/F");
+    tree->Branch("triggerBits", &triggerBits, "triggerBits/i");
+    tree->Branch("nFXTMult",    &nFXTMult,    "nFXTMult/S");
+    tree->Branch("centrality",  &centrality,  "centrality/B");
+  }
+  void SetAddress(TTree *tree){
+    tree->SetBranchAddress("fileIndex",   &fileIndex);
+    tree->SetBranchAddress("entry",       &entry);
+    tree->SetBranchAddress("runId",       &runId);
+    tree->SetBranchAddress("eventId",     &eventId);
+    tree->SetBranchAddress("vx",          &vx);
+    tree->SetBranchAddress("vy",          &vy);
+    tree->SetBranchAddress("vz",          &vz);
+    tree->SetBranchAddress("vr",          &vr);
+    tree->SetBranchAddress("triggerBits", &triggerBits);
+    tree->SetBranchAddress("nFXTMult",    &nFXTMult);
+    tree->SetBranchAddress("centrality",  &centrality);
+  }
+  // Same event selection as the event loop of PicoAnalyzer()
+  Bool_t PassEventCuts(Int_t sys_cutN, Int_t sys_varN) const {
+    if(!(triggerBits & 1u)) return kFALSE;
+    if(IsBadZVertex(vz, sys_cutN, sys_varN) || IsBadRVertex(VertexR(vx, vy), sys_cutN, sys_varN)) return kFALSE;
+    return !(IsPileUp(nFXTMult) || IsLowMult(nFXTMult));
+  }
+};
+
+// One picoDst file of the index
+struct PicoTagFile {
+  Char_t   name[1024];
+  Char_t   uuid[40];
+  Long64_t size;     // bytes
+  Long64_t nEntries;
+  Long64_t firstTag; // first row of the file in TagIndex
+  Long64_t nTags;
+
+  void Branch(TTree *tree){
+    tree->Branch("name",     name,      "name/C");
+    tree->Branch("uuid",     uuid,      "uuid/C");
+    tree->Branch("size",     &size,     "size/L");
+    tree->Branch("nEntries", &nEntries, "nEntries/L");
+    tree->Branch("firstTag", &firstTag, "firstTag/L");
+    tree->Branch("nTags",    &nTags,    "nTags/L");
+  }
+  void SetAddress(TTree *tree){
+    tree->SetBranchAddress("name",     name);
+    tree->SetBranchAddress("uuid",     uuid);
+    tree->SetBranchAddress("size",     &size);
+    tree->SetBranchAddress("nEntries", &nEntries);
+    tree->SetBranchAddress("firstTag", &firstTag);
+    tree->SetBranchAddress("nTags",    &nTags);
+  }
+};
+
+// Entry list of the chain entries passing the event cuts, NULL if the index
+// does not describe the files of the chain (any more)
+inline TEntryList* MakeTagEntryList(TChain *chain, const TString &tagFileName, Int_t sys_cutN, Int_t sys_varN){
+  TFile *tagFile = TFile::Open(tagFileName, "READ");
+  if(!tagFile || tagFile->IsZombie()){
+    std::cout << "Tag index " << tagFileName << " can not be opened" << std::endl;
+    return NULL;
+  }
+  TTree *tagIndex = (TTree*)tagFile->Get("TagIndex");
+  TTree *tagFiles = (TTree*)tagFile->Get("TagFiles");
+  if(!tagIndex || !tagFiles){
+    std::cout << "Tag index " << tagFileName << " has no TagIndex/TagFiles tree" << std::endl;
+    delete tagFile;
+    return NULL;
+  }
+  PicoTagRecord tag;
+  PicoTagFile   file;
+  tag.SetAddress(tagIndex);
+  file.SetAddress(tagFiles);
+  std::map<std::string, Long64_t> fileByUUID;
+  for(Long64_t i=0; i<tagFiles->GetEntries(); i++){
+    tagFiles->GetEntry(i);
+    fileByUUID[file.uuid] = i;
+  }
+  TEntryList *entryList = new TEntryList("TagEntryList", tagFileName);
+  entryList->SetDirectory(0); // not owned by the tag file
+  TIter next(chain->GetListOfFiles());
+  Bool_t isValid = kTRUE;
+  while(TChainElement *element = (TChainElement*)next()){
+    TFile *picoFile = TFile::Open(element->GetTitle(), "READ");
+    TTree *picoTree = (picoFile && !picoFile->IsZombie()) ? (TTree*)picoFile->Get(chain->GetName()) : NULL;
+    if(!picoTree){
+      std::cout << "Tag index: " << element->GetTitle() << " can not be read" << std::endl;
+      isValid = kFALSE;
+      delete picoFile;
+      break;
+    }
+    std::string uuid = picoFile->GetUUID().AsString();
+    std::map<std::string, Long64_t>::iterator found = fileByUUID.find(uuid);
+    if(found != fileByUUID.end()) tagFiles->GetEntry(found->second);
+    if(found == fileByUUID.end() || file.size != picoFile->GetSize() || file.nEntries != picoTree->GetEntries()){
+      std::cout << "Tag index: " << element->GetTitle() << " is not in " << tagFileName
+                << " or has changed since, rebuild it with TagIndexBuilder.cxx" << std::endl;
+      isValid = kFALSE;
+      delete picoFile;
+      break;
+    }
+    delete picoFile;
+    entryList->SetTree(chain->GetName(), element->GetTitle());
+    for(Long64_t i=file.firstTag; i<file.firstTag+file.nTags; i++){
+      tagIndex->GetEntry(i);
+      if(tag.PassEventCuts(sys_cutN, sys_varN)) entryList->Enter(tag.entry);
+    }
+  }
+  delete tagFile;
+  if(!isValid){
+    delete entryList;
+    return NULL;
+  }
+  std::cout << "Tag index " << tagFileName << ": " << entryList->GetN() << " of " << chain->GetEntries()
+            << " entries pass the event cuts" << std::endl;
+  return entryList;
+}
+
+#endif
@@ -0,0 +1,187 @@
+/**
+ * \brief Tracks of the current event as columns, with the TOF beta joined
+ *
+ * The Track and BTofPidTraits branches are read in MakeClass mode straight
+ * into the leaf arrays below, so no StPicoTrack/StPicoBTofPidTraits objects
+ * are streamed. Decode() derives, once per event and track, the quantities
+ * the StPicoTrack accessors would compute on every call:
+ *   pMom()           = (mPMomentumX, mPMomentumY, mPMomentumZ), isPrimary() if |pMom| > 0
+ *   charge()         = sign of mNHitsFit, nHitsFit() = |mNHitsFit|, nHitsPoss() = mNHitsMax
+ *   nSigmaXxx()      = mNSigmaXxx / 1000
+ *   gDCA(vertex)     = |origin - vertex|
+ *   btofBeta()       = mBTofBeta / 20000 of the BTofPidTraits at mBTofPidTraitsIndex,
+ *                      -999 for tracks without TOF
+ *
+ * TChain sets the object addresses of the branches again for each new tree,
+ * so Update() has to be called after every LoadTree() and before the
+ * entry is read, as for EpdHitBuffer. It also grows the columns to the
+ * largest # of tracks and traits of an entry of the tree.
+ */
+
+#ifndef PicoTrackColumns_h
+#define PicoTrackColumns_h
+
+#include "TChain.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TBranchElement.h"
+#include "TObjArray.h"
+#include "TString.h"
+#include "TMath.h"
+#include "TVector3.h"
+
+#include "StRoot/StPicoEvent/StPicoTrack.h"
+#include "StRoot/StPicoEvent/StPicoPhysicalHelix.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+class PicoTrackColumns {
+public:
+  static const Int_t kMaxTracks = 10000; // initial size of the columns, picoDst tracks (global) of one event
+  static const Int_t kMaxTraits = 10000;
+
+  Int_t nTracks;
+  Int_t nTraits;
+  // Track leaves
+  std::vector<Float_t> pMomX, pMomY, pMomZ;
+  std::vector<Float_t> gMomX, gMomY, gMomZ;
+  std::vector<Float_t> originX, originY, originZ;
+  std::vector<Float_t> dEdx;
+  std::vector<Char_t>  nHitsFitCharge; // mNHitsFit: charge * nHitsFit
+  std::vector<UChar_t> nHitsPoss;
+  std::vector<UChar_t> nHitsDedx;
+  std::vector<Short_t> nSigmaPionRaw, nSigmaKaonRaw, nSigmaProtonRaw, nSigmaElectronRaw;
+  std::vector<Short_t> bTofPidTraitsIndex;
+  // BTofPidTraits leaves
+  std::vector<UShort_t> bTofBetaRaw;
+  // Decoded by Decode()
+  std::vector<Short_t>  charge;
+  std::vector<Int_t>    nHitsFit;
+  std::vector<Bool_t>   isPrimary;
+  std::vector<Float_t>  pt;   // as StPicoTrack::pPt()
+  std::vector<Float_t>  ptot; // as StPicoTrack::pPtot()
+  std::vector<Double_t> eta, phi; // of pMom(), phi in (-pi,pi]
+  std::vector<Float_t>  gDCA;
+  std::vector<Float_t>  nSigmaPion, nSigmaKaon, nSigmaProton, nSigmaElectron;
+  std::vector<Double_t> tofBeta;
+
+  PicoTrackColumns(TChain *chain) : nTracks(0), nTraits(0), mChain(chain), mTreeNumber(-1) {
+    Reserve(kMaxTracks, kMaxTraits);
+  }
+
+  Int_t TrackCapacity() const { return (Int_t)pMomX.size(); }
+  Int_t TraitCapacity() const { return (Int_t)bTofBetaRaw.size(); }
+
+  // Room for n tracks and traits. The leaves are bound again by the next Update() if the columns have moved.
+  void Reserve(Int_t tracks, Int_t traits){
+    if(tracks > TrackCapacity()){
+      std::vector<Float_t>* floatColumns[] = {&pMomX, &pMomY, &pMomZ, &gMomX, &gMomY, &gMomZ, &originX, &originY, &originZ,
+                                              &dEdx, &pt, &ptot, &gDCA, &nSigmaPion, &nSigmaKaon, &nSigmaProton, &nSigmaElectron};
+      for(unsigned int i=0; i<sizeof(floatColumns)/sizeof(floatColumns[0]); i++) floatColumns[i]->resize(tracks);
+      std::vector<Short_t>* shortColumns[] = {&nSigmaPionRaw, &nSigmaKaonRaw, &nSigmaProtonRaw, &nSigmaElectronRaw, &bTofPidTraitsIndex, &charge};
+      for(unsigned int i=0; i<sizeof(shortColumns)/sizeof(shortColumns[0]); i++) shortColumns[i]->resize(tracks);
+      nHitsFitCharge.resize(tracks);
+      nHitsPoss.resize(tracks);
+      nHitsDedx.resize(tracks);
+      nHitsFit.resize(tracks);
+      isPrimary.resize(tracks);
+      eta.resize(tracks);
+      phi.resize(tracks);
+      tofBeta.resize(tracks);
+      mTreeNumber = -1;
+    }
+    if(traits > TraitCapacity()){
+      bTofBetaRaw.resize(traits);
+      mTreeNumber = -1;
+    }
+  }
+
+  // Rebind the Track and BTofPidTraits leaves if the chain has moved to a new tree
+  Bool_t Update(){
+    if(mChain->GetTreeNumber() == mTreeNumber) return kTRUE;
+    mTreeNumber = mChain->GetTreeNumber();
+    nTracks = 0;
+    nTraits = 0;
+    TTree *tree = mChain->GetTree();
+    TBranchElement *trackBranch = (tree) ? (TBranchElement*)tree->GetBranch("Track") : NULL;
+    TBranchElement *traitBranch = (tree) ? (TBranchElement*)tree->GetBranch("BTofPidTraits") : NULL;
+    Reserve((trackBranch) ? trackBranch->GetMaximum() : 0, (traitBranch) ? traitBranch->GetMaximum() : 0);
+    mTreeNumber = mChain->GetTreeNumber(); // the addresses below are the ones after Reserve()
+    const char* trackLeaves[] = {"mPMomentumX", "mPMomentumY", "mPMomentumZ", "mGMomentumX", "mGMomentumY", "mGMomentumZ",
+                                 "mOriginX", "mOriginY", "mOriginZ", "mDedx", "mNHitsFit", "mNHitsMax", "mNHitsDedx",
+                                 "mNSigmaPion", "mNSigmaKaon", "mNSigmaProton", "mNSigmaElectron", "mBTofPidTraitsIndex"};
+    void* trackAddresses[] = {&pMomX[0], &pMomY[0], &pMomZ[0], &gMomX[0], &gMomY[0], &gMomZ[0],
+                              &originX[0], &originY[0], &originZ[0], &dEdx[0], &nHitsFitCharge[0], &nHitsPoss[0], &nHitsDedx[0],
+                              &nSigmaPionRaw[0], &nSigmaKaonRaw[0], &nSigmaProtonRaw[0], &nSigmaElectronRaw[0], &bTofPidTraitsIndex[0]};
+    const char* traitLeaves[] = {"mBTofBeta"};
+    void* traitAddresses[] = {&bTofBetaRaw[0]};
+    return BindLeaves(tree, "Track", &nTracks, 18, trackLeaves, trackAddresses) &&
+           BindLeaves(tree, "BTofPidTraits", &nTraits, 1, traitLeaves, traitAddresses);
+  }
+
+  // Derive the StPicoTrack quantities of the tracks of the current entry
+  void Decode(Float_t vertexX, Float_t vertexY, Float_t vertexZ){
+    for(Int_t iTrk=0; iTrk<nTracks; iTrk++){
+      charge[iTrk]    = (nHitsFitCharge[iTrk] > 0) ? 1 : -1;
+      nHitsFit[iTrk]  = (nHitsFitCharge[iTrk] > 0) ? (Int_t)nHitsFitCharge[iTrk] : (Int_t)(-1 * nHitsFitCharge[iTrk]);
+      TVector3 pMom(pMomX[iTrk], pMomY[iTrk], pMomZ[iTrk]);
+      pt[iTrk]        = TMath::Sqrt(pMomX[iTrk]*pMomX[iTrk] + pMomY[iTrk]*pMomY[iTrk]);
+      ptot[iTrk]      = pMom.Mag();
+      isPrimary[iTrk] = (pMom.Mag() > 0);
+      eta[iTrk]       = pMom.Eta();
+      phi[iTrk]       = pMom.Phi();
+      gDCA[iTrk]      = TMath::Sqrt( (originX[iTrk]-vertexX)*(originX[iTrk]-vertexX) +
+                                     (originY[iTrk]-vertexY)*(originY[iTrk]-vertexY) +
+                                     (originZ[iTrk]-vertexZ)*(originZ[iTrk]-vertexZ) );
+      nSigmaPion[iTrk]     = (Float_t)nSigmaPionRaw[iTrk] / 1000.f;
+      nSigmaKaon[iTrk]     = (Float_t)nSigmaKaonRaw[iTrk] / 1000.f;
+      nSigmaProton[iTrk]   = (Float_t)nSigmaProtonRaw[iTrk] / 1000.f;
+      nSigmaElectron[iTrk] = (Float_t)nSigmaElectronRaw[iTrk] / 1000.f;
+      Int_t iTrait = bTofPidTraitsIndex[iTrk];
+      tofBeta[iTrk]   = (iTrait >= 0 && iTrait < nTraits) ? (Float_t)bTofBetaRaw[iTrait] / 20000.f : -999.;
+    }
+  }
+
+  // Same helix as StPicoTrack::helix()
+  StPicoPhysicalHelix Helix(Int_t iTrk, Float_t magField){
+    mHelixTrack.setGlobalMomentum(gMomX[iTrk], gMomY[iTrk], gMomZ[iTrk]);
+    mHelixTrack.setOrigin(originX[iTrk], originY[iTrk], originZ[iTrk]);
+    mHelixTrack.setNHitsFit(nHitsFitCharge[iTrk]);
+    return mHelixTrack.helix(magField);
+  }
+
+private:
+  TChain     *mChain;
+  Int_t       mTreeNumber; // tree of the chain the addresses are set for
+  StPicoTrack mHelixTrack; // scratch track for Helix()
+
+  Bool_t BindLeaves(TTree *tree, const char *branchName, Int_t *count,
+                    Int_t nLeaves, const char **leaves, void **addresses){
+    TBranchElement *branch = (tree) ? (TBranchElement*)tree->GetBranch(branchName) : NULL;
+    if(!branch){
+      std::cout << "PicoTrackColumns: no " << branchName << " branch in tree " << mTreeNumber << std::endl;
+      return kFALSE;
+    }
+    branch->SetMakeClass(kTRUE);
+    branch->SetAddress(count); // the TClonesArray branch holds the # of objects in MakeClass mode
+    TIter next(branch->GetListOfBranches());
+    while(TBranchElement *leaf = (TBranchElement*)next()){
+      TString name = leaf->GetName();
+      void *address = NULL;
+      for(Int_t i=0; i<nLeaves; i++){
+        if(name == TString::Format("%s.%s", branchName, leaves[i])) address = addresses[i];
+      }
+      if(!address){ // not needed by the analysis
+        tree->SetBranchStatus(name, 0);
+        continue;
+      }
+      leaf->SetMakeClass(kTRUE);
+      leaf->SetAddress(address);
+    }
+    return kTRUE;
+  }
+};
+
+#endif
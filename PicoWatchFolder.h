@@ -0,0 +1,178 @@
+/**
+ * \brief Watch folder input of the streaming mode, PicoAnalyzer(...,"watch=DIR")
+ *
+ * During data taking the serial event loop does not end with the last entry
+ * of its chain. It waits for new picoDst files in DIR, adds them to the chain
+ * and goes on with their entries, so the histograms keep accumulating and no
+ * file is read twice. A file *.picoDst.root is complete when it has not been
+ * modified for settle seconds and opens as a ROOT file with a PicoDst tree,
+ * without recovery. A complete file that can not be read is tried again when
+ * it is modified.
+ * Every publish seconds, while analysing and while waiting, the histograms of
+ * the three output files are published to publishdir/ under the names of the
+ * outputs. Each file is written next to the old one and then renamed, so a
+ * reader always finds a whole file. The job ends, and writes its outputs as a
+ * job without watch would, when DIR/PicoAnalyzer.stop exists and all files
+ * are analysed.
+ * The files of the chain are listed in mListFile in chain order, the list is
+ * extended whenever files are added. A job restarted with checkpoint=N reads
+ * the chain from it, so the entries of its snapshot are those of the chain.
+ */
+
+#ifndef PicoWatchFolder_h
+#define PicoWatchFolder_h
+
+#include "TChain.h"
+#include "TDirectory.h"
+#include "TFile.h"
+#include "TH1.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct PicoWatchFolder {
+  static const Int_t kPollSeconds = 10;
+  TString mDir;
+  TString mPublishDir;
+  Int_t   mSettleSeconds;  // a file not modified for this long is complete
+  Int_t   mPublishSeconds; // between two publications
+  TString mListFile;       // files of the chain, in chain order
+  std::set<std::string>        mAdded;    // files handed out by WaitForFiles() or ReadList()
+  std::map<std::string,Long_t> mRejected; // complete but unreadable files, with their modification time
+  Long_t  mLastPublish;
+  Int_t   mNPublished;
+  PicoWatchFolder(const TString &dir, const TString &publishDir, Int_t settleSeconds, Int_t publishSeconds,
+                  const TString &listFile)
+    : mDir(dir), mPublishDir(publishDir), mSettleSeconds(settleSeconds), mPublishSeconds(publishSeconds),
+      mListFile(listFile), mLastPublish((Long_t)time(0)), mNPublished(0) {}
+
+  TString StopFile() const { return mDir + "/PicoAnalyzer.stop"; }
+  Bool_t  PublishDue() const { return (Long_t)time(0) - mLastPublish >= mPublishSeconds; }
+
+  static Bool_t Readable(const TString &name){
+    TDirectory *savedDir = gDirectory;
+    TFile *file = TFile::Open(name,"READ");
+    Bool_t readable = (file && !file->IsZombie() && !file->TestBit(TFile::kRecovered) && file->FindKey("PicoDst"));
+    delete file;
+    savedDir->cd();
+    return readable;
+  }
+
+  // Complete files of the directory not handed out yet, in name order
+  void Scan(std::vector<TString> &files){
+    void *dir = gSystem->OpenDirectory(mDir);
+    if(!dir){
+      std::cout << "Watch folder " << mDir << " can not be read" << std::endl;
+      return;
+    }
+    std::vector<std::string> names;
+    while(const char *entry = gSystem->GetDirEntry(dir)){
+      TString name(entry);
+      if(name.EndsWith(".picoDst.root")) names.push_back((mDir + "/" + name).Data());
+    }
+    gSystem->FreeDirectory(dir);
+    std::sort(names.begin(), names.end());
+    Long_t now = (Long_t)time(0);
+    for(unsigned int i=0; i<names.size(); i++){
+      if(mAdded.count(names[i])) continue;
+      FileStat_t stat;
+      if(gSystem->GetPathInfo(names[i].c_str(), stat) != 0) continue;
+      if(now - stat.fMtime < mSettleSeconds) continue; // may still be written
+      std::map<std::string,Long_t>::iterator rejected = mRejected.find(names[i]);
+      if(rejected != mRejected.end() && rejected->second == stat.fMtime) continue;
+      if(!Readable(names[i].c_str())){
+        std::cout << "Watch folder: " << names[i] << " can not be read, it is tried again when it changes" << std::endl;
+        mRejected[names[i]] = stat.fMtime;
+        continue;
+      }
+      mRejected.erase(names[i]);
+      mAdded.insert(names[i]);
+      files.push_back(names[i].c_str());
+    }
+  }
+
+  // Waits for new complete files, kFALSE if the stop file is found first.
+  // publish, if set, is called whenever a publication is due while waiting.
+  Bool_t WaitForFiles(std::vector<TString> &files, const std::function<void()> &publish){
+    for(;;){
+      Scan(files);
+      if(!files.empty()) return kTRUE;
+      if(!gSystem->AccessPathName(StopFile())){
+        std::cout << "Watch folder: " << StopFile() << " found, the job ends" << std::endl;
+        return kFALSE;
+      }
+      if(publish && PublishDue()) publish();
+      gSystem->Sleep(1000*kPollSeconds);
+    }
+  }
+
+  // The chain of an earlier run of the job from mListFile, marked as handed out. kFALSE if there is none.
+  Bool_t ReadList(std::vector<TString> &files){
+    std::ifstream list(mListFile.Data());
+    std::string line;
+    while(std::getline(list, line)){
+      if(line.empty()) continue;
+      mAdded.insert(line);
+      files.push_back(line.c_str());
+    }
+    return !files.empty();
+  }
+
+  // Files to mListFile, after the ones listed if append
+  void WriteList(const std::vector<TString> &files, Bool_t append){
+    std::ofstream list(mListFile.Data(), (append) ? std::ios::app : std::ios::trunc);
+    for(unsigned int i=0; i<files.size(); i++) list << files[i] << std::endl;
+  }
+
+  // Adds files to the chain and the list, returns the new # of entries of the chain
+  Long64_t AddFiles(TChain *chain, const std::vector<TString> &files){
+    std::vector<TString> added;
+    for(unsigned int i=0; i<files.size(); i++){
+      if(chain->Add(files[i], 0) == 0) std::cout << "Watch folder: " << files[i] << " can not be added" << std::endl;
+      else added.push_back(files[i]);
+    }
+    WriteList(added, kTRUE);
+    Long64_t entries = chain->GetEntries();
+    std::cout << "Watch folder: " << files.size() << " new files, " << entries << " entries in " << mAdded.size() << " files" << std::endl;
+    return entries;
+  }
+
+  // Histograms of the outputs, and extras in the first one, to publishdir/<output name>
+  void Publish(TFile **outputs, Int_t nOutputs, TObject **extras, Int_t nExtras){
+    TDirectory *savedDir = gDirectory;
+    gSystem->mkdir(mPublishDir, kTRUE);
+    for(Int_t iOutput=0; iOutput<nOutputs; iOutput++){
+      TString name = mPublishDir + "/" + gSystem->BaseName(outputs[iOutput]->GetName());
+      TString tmpName = name + ".tmp";
+      TFile *file = new TFile(tmpName,"RECREATE");
+      if(file->IsZombie()){
+        std::cout << "Watch folder: " << tmpName << " can not be written" << std::endl;
+        delete file;
+        continue;
+      }
+      TIter next(outputs[iOutput]->GetList());
+      while(TObject *obj = next()){
+        if(obj->InheritsFrom(TH1::Class())) file->WriteTObject(obj);
+      }
+      for(Int_t i=0; iOutput==0 && i<nExtras; i++) file->WriteTObject(extras[i]);
+      file->Close();
+      delete file;
+      if(gSystem->Rename(tmpName, name) != 0) std::cout << "Watch folder: " << tmpName << " can not be renamed to " << name << std::endl;
+    }
+    savedDir->cd();
+    mLastPublish = (Long_t)time(0);
+    mNPublished++;
+    std::cout << "Outputs published to " << mPublishDir << "/ (" << mNPublished << ")" << std::endl;
+  }
+};
+
+#endif
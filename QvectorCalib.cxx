@@ -0,0 +1,401 @@
+/**
+ * \brief Event plane calibration from the Q-vector tree of PicoAnalyzer(...,"qvec=1")
+ *
+ * Redoes the event plane part of the event loop on the stored raw Q-vectors:
+ * recenter and shift corrections, raw/recentered/shifted psi distributions
+ * and the EPD-EPD, EPD-TPC sub-event correlations for the resolution.
+ * The output has the histogram names of EpCorrection_OUTPUT_, so it can be used
+ * as EpCorrection_INPUT_ of the next iteration. With nPasses > 1 the output of
+ * a pass is applied as the input of the next one, e.g. nPasses = 3 goes from no
+ * correction to recenter + shift in one job.
+ * The events are corrected in blocks of blockSize events (PicoEpBatch.h);
+ * blockSize = 1 goes event by event, with the same output.
+ *
+ *   root -b -q -l QvectorCalib.cxx+\(\"Qvector_OUTPUT_*.root\",\"\",\"EpCorrection_OUTPUT_qvec.root\",3\)
+ */
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "TChain.h"
+#include "TString.h"
+#include "TMath.h"
+#include "TH1.h"
+#include "TH1D.h"
+#include "TH2D.h"
+#include "TProfile.h"
+#include "TProfile2D.h"
+
+#include "PicoQvector.h"
+#include "PicoEpBatch.h"
+
+const Int_t _Ncentralities = 9; // 9 centrality bins
+const Int_t _EpTermsMaxIni = 20; // Shift Order
+const Int_t _nEventTypeBins = PicoQvectorRecord::kNEpdSub;
+const Int_t _nEventTypeBins_tpc = PicoQvectorRecord::kNTpcSub;
+
+// Recenter and shift corrections, as in EpCorrection_INPUT_/EpCorrection_OUTPUT_
+struct EpCorrections {
+  TProfile2D *epdRecenter[_nEventTypeBins], *epdShiftSin[_nEventTypeBins], *epdShiftCos[_nEventTypeBins];
+  TProfile2D *tpcRecenter[_nEventTypeBins_tpc], *tpcShiftSin[_nEventTypeBins_tpc], *tpcShiftCos[_nEventTypeBins_tpc];
+
+  EpCorrections(){
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdRecenter[EventTypeId] = 0; epdShiftSin[EventTypeId] = 0; epdShiftCos[EventTypeId] = 0;
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcRecenter[EventTypeId_tpc] = 0; tpcShiftSin[EventTypeId_tpc] = 0; tpcShiftCos[EventTypeId_tpc] = 0;
+    }
+  }
+  void Book(){
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdRecenter[EventTypeId] = new TProfile2D(Form("EpdRecenterEW0Psi%d",EventTypeId),Form("EpdRecenterEW0Psi%d",EventTypeId),
+              2,0.5,1.0*2+.5, // (x,y)
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              "");
+      epdRecenter[EventTypeId]->BuildOptions(0.0,0.0,"");
+      epdShiftSin[EventTypeId] = new TProfile2D(Form("EpdShiftEW0Psi%d_sin",EventTypeId),Form("EpdShiftEW0Psi%d_sin",EventTypeId),
+              _EpTermsMaxIni,0.5,1.0*_EpTermsMaxIni+.5, // Shift order
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              -1.0,1.0);
+      epdShiftCos[EventTypeId] = new TProfile2D(Form("EpdShiftEW0Psi%d_cos",EventTypeId),Form("EpdShiftEW0Psi%d_cos",EventTypeId),
+              _EpTermsMaxIni,0.5,1.0*_EpTermsMaxIni+.5, // Shift order
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              -1.0,1.0);
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcRecenter[EventTypeId_tpc] = new TProfile2D(Form("mTpcRecenterOutput_%d",EventTypeId_tpc),Form("mTpcRecenterOutput_%d",EventTypeId_tpc),
+              2,0.5,1.0*2+.5, // (x,y)
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              "");
+      tpcRecenter[EventTypeId_tpc]->BuildOptions(0.0,0.0,"");
+      tpcShiftSin[EventTypeId_tpc] = new TProfile2D(Form("mTpcShiftOutput_%d_sin",EventTypeId_tpc),Form("mTpcShiftOutput_%d_sin",EventTypeId_tpc),
+              _EpTermsMaxIni,0.5,1.0*_EpTermsMaxIni+.5, // Shift order
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              -1.0,1.0);
+      tpcShiftCos[EventTypeId_tpc] = new TProfile2D(Form("mTpcShiftOutput_%d_cos",EventTypeId_tpc),Form("mTpcShiftOutput_%d_cos",EventTypeId_tpc),
+              _EpTermsMaxIni,0.5,1.0*_EpTermsMaxIni+.5, // Shift order
+              _Ncentralities,0.5,_Ncentralities+0.5, // Centrality
+              -1.0,1.0);
+    }
+  }
+  // Missing histograms stay 0, i.e. that correction is not applied
+  Bool_t Load(const TString &fileName){
+    TFile *file = new TFile(fileName,"READ");
+    if(file->IsZombie()){
+      std::cout << "Error opening file with correction histograms " << fileName << std::endl;
+      delete file;
+      return kFALSE;
+    }
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdRecenter[EventTypeId] = (TProfile2D*)file->Get(Form("EpdRecenterEW0Psi%d",EventTypeId));
+      epdShiftSin[EventTypeId] = (TProfile2D*)file->Get(Form("EpdShiftEW0Psi%d_sin",EventTypeId));
+      epdShiftCos[EventTypeId] = (TProfile2D*)file->Get(Form("EpdShiftEW0Psi%d_cos",EventTypeId));
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcRecenter[EventTypeId_tpc] = (TProfile2D*)file->Get(Form("mTpcRecenterOutput_%d",EventTypeId_tpc));
+      tpcShiftSin[EventTypeId_tpc] = (TProfile2D*)file->Get(Form("mTpcShiftOutput_%d_sin",EventTypeId_tpc));
+      tpcShiftCos[EventTypeId_tpc] = (TProfile2D*)file->Get(Form("mTpcShiftOutput_%d_cos",EventTypeId_tpc));
+    }
+    return kTRUE; // the file stays open, it owns the histograms
+  }
+  void Write(){
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdRecenter[EventTypeId]->Write(); epdShiftSin[EventTypeId]->Write(); epdShiftCos[EventTypeId]->Write();
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcRecenter[EventTypeId_tpc]->Write(); tpcShiftSin[EventTypeId_tpc]->Write(); tpcShiftCos[EventTypeId_tpc]->Write();
+    }
+  }
+  void Delete(){
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      delete epdRecenter[EventTypeId]; delete epdShiftSin[EventTypeId]; delete epdShiftCos[EventTypeId];
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      delete tpcRecenter[EventTypeId_tpc]; delete tpcShiftSin[EventTypeId_tpc]; delete tpcShiftCos[EventTypeId_tpc];
+    }
+  }
+};
+
+void QvectorCalib(const Char_t *inFile = "Qvector_OUTPUT_*.root", // file, wildcard or .list of Qvector trees
+                  TString corrInput = "", // EpCorrection_INPUT_ of the first pass, "" = no correction
+                  TString outFile = "EpCorrection_OUTPUT_qvec.root",
+                  Int_t nPasses = 1,
+                  Int_t blockSize = 256) // events corrected at a time
+{
+  Bool_t addDirectory = TH1::AddDirectoryStatus();
+  TH1::AddDirectory(kFALSE); // the histograms of all passes are owned here
+  TChain *chain = new TChain("Qvector");
+  TString inName(inFile);
+  if(inName.EndsWith(".list") || inName.EndsWith(".lis")){
+    std::ifstream list(inFile);
+    std::string line;
+    while(std::getline(list, line)){
+      TString qvecFile(line.c_str());
+      qvecFile = qvecFile.Strip(TString::kBoth);
+      if(!qvecFile.IsNull() && !qvecFile.BeginsWith("#")) chain->Add(qvecFile);
+    }
+  } else {
+    chain->Add(inFile);
+  }
+  Long64_t events2read = chain->GetEntries();
+  std::cout << "Number of events with Q-vectors: " << events2read << std::endl;
+  PicoQvectorRecord qvector;
+  qvector.SetAddress(chain);
+
+  EpCorrections input;
+  if(events2read == 0 || (!corrInput.IsNull() && !input.Load(corrInput))){
+    delete chain;
+    TH1::AddDirectory(addDirectory);
+    return;
+  }
+  Bool_t ownsInput = kFALSE; // after the first pass the input is the previous output
+  if(blockSize < 1) blockSize = 1;
+  // Block of events, see PicoEpBatch.h
+  std::vector<Int_t> centralities, centBins;
+  PicoEpSubBlock<_EpTermsMaxIni> epdBlock[_nEventTypeBins], tpcBlock[_nEventTypeBins_tpc];
+  std::vector<Double_t> rawEpd[_nEventTypeBins][2], rawTpc[_nEventTypeBins_tpc][2]; // [x,y], raw Q-vectors for the recenter output
+  for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+    rawEpd[EventTypeId][0].resize(blockSize); rawEpd[EventTypeId][1].resize(blockSize);
+  }
+  for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+    rawTpc[EventTypeId_tpc][0].resize(blockSize); rawTpc[EventTypeId_tpc][1].resize(blockSize);
+  }
+  for(int pass=0; pass<nPasses; pass++){
+    Bool_t lastPass = (pass == nPasses-1);
+    EpCorrections output;
+    output.Book();
+    // ------------------- psi distributions and correlations, as in the event loop ----------------------
+    TH1D *hist_Epd_east_psi_raw_ini[_nEventTypeBins], *hist_Epd_east_psi_recenter_ini[_nEventTypeBins], *hist_Epd_east_psi_Shifted_ini[_nEventTypeBins];
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      hist_Epd_east_psi_raw_ini[EventTypeId] = new TH1D(Form("hist_Epd_east_psi_raw_ini_%d",EventTypeId),Form("EPD east EP EventTypeId%d",EventTypeId),1024,-1.0,7.0);
+      hist_Epd_east_psi_recenter_ini[EventTypeId] = new TH1D(Form("hist_Epd_east_psi_recenter_ini%d",EventTypeId),Form("EPD east EP (Recentered) EventTypeId%d",EventTypeId),1024,-1.0,7.0);
+      hist_Epd_east_psi_Shifted_ini[EventTypeId] = new TH1D(Form("hist_Epd_east_psi_Shifted_ini_%d",EventTypeId),Form("EPD east EP (Shifted) EventTypeId%d",EventTypeId),1024,-1.0,7.0);
+    }
+    TH1D *hist_tpc_all_psi_raw[_nEventTypeBins_tpc], *hist_tpc_all_psi_recenter[_nEventTypeBins_tpc], *hist_tpc_all_psi_shifted[_nEventTypeBins_tpc];
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      hist_tpc_all_psi_raw[EventTypeId_tpc]= new TH1D(Form("hist_tpc_all_psi_raw_%d",EventTypeId_tpc),Form("TPC-sub%d event plane",EventTypeId_tpc),1024,-1.0,7.0);
+      hist_tpc_all_psi_recenter[EventTypeId_tpc]= new TH1D(Form("hist_tpc_all_psi_renter_%d",EventTypeId_tpc),Form("TPC-sub%d event plane (recentered)",EventTypeId_tpc),1024,-1.0,7.0);
+      hist_tpc_all_psi_shifted[EventTypeId_tpc] = new TH1D(Form("hist_tpc_all_psi_shifted_%d",EventTypeId_tpc),Form("TPC-sub%d EP (shifted)",EventTypeId_tpc),1024,-1.0,7.0);
+    }
+    TProfile *profile_correlation_epd_east[2][6], *profile_correlation_epd_tpc[2][4], *profile_correlation_epd_tpc_all[2];
+    int pairs = 0;
+    for(int i = 0; i<3;i++){ // Correlations between EPD EP 1, 2, 3, 4. 6 pairs of correlations
+      for(int j=i+1;j<4;j++){
+        for(int n=0; n<2; n++){
+          profile_correlation_epd_east[n][pairs]  =
+          new TProfile(Form("profile_correlation_n%d_epd_east%d",n+1,pairs),
+          Form("<cos(%d * (#psi^{EPD east}[%d] #minus #psi^{EPD east}[%d]))>",n+1,i+1,j+1),
+          _Ncentralities,0.5,_Ncentralities+0.5,-1.0,1.0,"");
+        }
+        pairs++;
+      }
+    }
+    for(int i=0;i<4;i++){// Correlaitons between TPC and 4 EPD event planes 1,2,3,4
+      for(int n=0; n<2; n++){
+        profile_correlation_epd_tpc[n][i]  =
+        new TProfile(Form("profile_correlation_n%d_epd%d_tpc",n+1,i+1),
+        Form("<cos(%d * (#psi^{EPD east}[%d] #minus #psi^{TPC}))>",n+1 ,i+1),
+        _Ncentralities,0.5,_Ncentralities+0.5,-1.0,1.0,"");
+      }
+    }
+    for(int n=0; n<2; n++){
+      profile_correlation_epd_tpc_all[n]  =
+      new TProfile(Form("profile_correlation_n%d_epd_tpc_all",n+1),
+      Form("<cos(%d * (#psi^{EPD east}[full] #minus #psi^{TPC}))>", n+1),
+      _Ncentralities,0.5,_Ncentralities+0.5,-1.0,1.0,"");
+    }
+
+    PicoEpCorrectionTable<_EpTermsMaxIni> epdTable[_nEventTypeBins], tpcTable[_nEventTypeBins_tpc];
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      epdTable[EventTypeId].Load(input.epdRecenter[EventTypeId],input.epdShiftSin[EventTypeId],input.epdShiftCos[EventTypeId]);
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      tpcTable[EventTypeId_tpc].Load(input.tpcRecenter[EventTypeId_tpc],input.tpcShiftSin[EventTypeId_tpc],input.tpcShiftCos[EventTypeId_tpc]);
+    }
+    PicoEpBatchKernels<_EpTermsMaxIni> ep;
+    ep.order = 0; // from the first event
+    Bool_t readError = kFALSE;
+    for(Long64_t blockStart=0; blockStart<events2read && !readError; blockStart+=blockSize){
+      // ---------------------------- gather the Q-vectors of the block -------------------
+      Int_t nBlock = (Int_t)TMath::Min((Long64_t)blockSize, events2read - blockStart);
+      centralities.resize(nBlock);
+      centBins.resize(nBlock);
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++) epdBlock[EventTypeId].Resize(nBlock);
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++) tpcBlock[EventTypeId_tpc].Resize(nBlock);
+      for(Int_t e=0; e<nBlock; e++){
+        if(chain->GetEntry(blockStart+e) <= 0){
+          nBlock = e;
+          readError = kTRUE;
+          break;
+        }
+        if(ep.order == 0 && !PicoEpBatchKernels<_EpTermsMaxIni>::ForOrder(qvector.order, ep)){
+          std::cout << "Event plane order " << qvector.order << " is not supported, only 1, 2 and 3" << std::endl;
+          nBlock = e;
+          readError = kTRUE;
+          break;
+        }
+        if(qvector.order != ep.order){
+          std::cout << "Event #" << blockStart+e << " has event plane order " << qvector.order << ", not " << ep.order
+                    << " as the events before, stopping" << std::endl;
+          nBlock = e;
+          readError = kTRUE;
+          break;
+        }
+        centralities[e] = qvector.centrality;
+        centBins[e]     = PicoEpCorrectionTable<_EpTermsMaxIni>::Bin(qvector.centrality);
+        for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+          PicoEpSubBlock<_EpTermsMaxIni> &sub = epdBlock[EventTypeId];
+          sub.Qx[e] = qvector.QEpdEast[EventTypeId][0];
+          sub.Qy[e] = qvector.QEpdEast[EventTypeId][1];
+          sub.good[e] = (qvector.nEpdEast[EventTypeId]>=5 && (sub.Qx[e] || sub.Qy[e]));
+        }
+        for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+          PicoEpSubBlock<_EpTermsMaxIni> &sub = tpcBlock[EventTypeId_tpc];
+          sub.Qx[e] = qvector.QTpc[EventTypeId_tpc][0];
+          sub.Qy[e] = qvector.QTpc[EventTypeId_tpc][1];
+          sub.good[e] = (qvector.nTpc[EventTypeId_tpc]>=5 && (sub.Qx[e] || sub.Qy[e])); // at least 5 tracks to get TPC event plane
+        }
+      }
+      if(nBlock == 0) break;
+      // ---------------------------- recenter, psi, shift of the whole block -------------
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+        for(Int_t e=0; e<nBlock; e++){ // the raw Q-vectors are filled into the recenter output
+          rawEpd[EventTypeId][0][e] = epdBlock[EventTypeId].Qx[e];
+          rawEpd[EventTypeId][1][e] = epdBlock[EventTypeId].Qy[e];
+        }
+        ep.Run(nBlock, centBins.data(), epdTable[EventTypeId], epdBlock[EventTypeId]);
+      }
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+        for(Int_t e=0; e<nBlock; e++){
+          rawTpc[EventTypeId_tpc][0][e] = tpcBlock[EventTypeId_tpc].Qx[e];
+          rawTpc[EventTypeId_tpc][1][e] = tpcBlock[EventTypeId_tpc].Qy[e];
+        }
+        ep.Run(nBlock, centBins.data(), tpcTable[EventTypeId_tpc], tpcBlock[EventTypeId_tpc]);
+      }
+      // ---------------------------- fill the histograms, event by event -----------------
+      for(Int_t e=0; e<nBlock; e++){
+        Int_t centrality = centralities[e];
+        // ---------------------------- EPD east ----------------------------------------
+        Double_t PsiEastRaw[_nEventTypeBins], PsiEastRecenter[_nEventTypeBins], PsiEastShifted[_nEventTypeBins];
+        for(int EventTypeId=0;EventTypeId<_nEventTypeBins;EventTypeId++){
+          PsiEastRaw[EventTypeId]      = epdBlock[EventTypeId].psiRaw[e];
+          PsiEastRecenter[EventTypeId] = epdBlock[EventTypeId].psiRecenter[e];
+          PsiEastShifted[EventTypeId]  = epdBlock[EventTypeId].psiShifted[e];
+          if(PsiEastRaw[EventTypeId]!=-999.0){
+            hist_Epd_east_psi_raw_ini[EventTypeId]->Fill(PsiEastRaw[EventTypeId]);
+            hist_Epd_east_psi_recenter_ini[EventTypeId]->Fill(PsiEastRecenter[EventTypeId]);
+            output.epdRecenter[EventTypeId]->Fill(1,centrality,rawEpd[EventTypeId][0][e]);
+            output.epdRecenter[EventTypeId]->Fill(2,centrality,rawEpd[EventTypeId][1][e]);
+          }
+        }
+        for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+          if(PsiEastShifted[EventTypeId]==-999.0) continue;
+          hist_Epd_east_psi_Shifted_ini[EventTypeId]->Fill(PsiEastShifted[EventTypeId]);
+        }
+        pairs = -1;
+        for(int i = 0; i<3;i++){
+          for(int j=i+1;j<4;j++){
+            pairs++;
+            if(PsiEastRaw[i+1]!=-999.0&&PsiEastRaw[j+1]!=-999.0){
+              for(int n=0; n<2; n++){
+                profile_correlation_epd_east[n][pairs]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiEastShifted[j+1] )));
+              }
+            }
+          }
+        }
+        for (int i=1; i<=_EpTermsMaxIni; i++){
+          for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+            if(PsiEastRecenter[EventTypeId]==-999.0) continue;
+            output.epdShiftSin[EventTypeId]->Fill(i,centrality,epdBlock[EventTypeId].sinTerms[(i-1)*nBlock + e]);
+            output.epdShiftCos[EventTypeId]->Fill(i,centrality,epdBlock[EventTypeId].cosTerms[(i-1)*nBlock + e]);
+          }
+        }
+        // ---------------------------- TPC ----------------------------------------------
+        Double_t PsiTpcAllRaw[_nEventTypeBins_tpc], PsiTpcAllRecenter[_nEventTypeBins_tpc], PsiTpcAllShifted[_nEventTypeBins_tpc];
+        for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
+          PsiTpcAllRaw[EventTypeId_tpc]      = tpcBlock[EventTypeId_tpc].psiRaw[e];
+          PsiTpcAllRecenter[EventTypeId_tpc] = tpcBlock[EventTypeId_tpc].psiRecenter[e];
+          PsiTpcAllShifted[EventTypeId_tpc]  = tpcBlock[EventTypeId_tpc].psiShifted[e];
+          if(PsiTpcAllRaw[EventTypeId_tpc]!=-999.0){
+            hist_tpc_all_psi_raw[EventTypeId_tpc]->Fill(PsiTpcAllRaw[EventTypeId_tpc]);
+            hist_tpc_all_psi_recenter[EventTypeId_tpc]->Fill(PsiTpcAllRecenter[EventTypeId_tpc]);
+            output.tpcRecenter[EventTypeId_tpc]->Fill(1,centrality,rawTpc[EventTypeId_tpc][0][e]);
+            output.tpcRecenter[EventTypeId_tpc]->Fill(2,centrality,rawTpc[EventTypeId_tpc][1][e]);
+          }
+        }
+        for(int EventTypeId_tpc=0;EventTypeId_tpc<_nEventTypeBins_tpc;EventTypeId_tpc++){
+          if(PsiTpcAllShifted[EventTypeId_tpc]==-999.0) continue;
+          hist_tpc_all_psi_shifted[EventTypeId_tpc]->Fill(PsiTpcAllShifted[EventTypeId_tpc]);
+        }
+        // ---------------------------- EPD - TPC correlations ---------------------------
+        for(int n=0; n<2; n++){ // filled for every event, as in PicoAnalyzer.cxx
+          profile_correlation_epd_tpc_all[n]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[0] - PsiTpcAllShifted[1])));
+        }
+        for(int i=0;i<4;i++){
+          if(PsiEastRaw[i+1]!=-999.0&&PsiTpcAllRaw[1]!=-999.0){
+            for(int n=0; n<2; n++){
+              profile_correlation_epd_tpc[n][i]->Fill(centrality,TMath::Cos((double)(n+1) * (PsiEastShifted[i+1] - PsiTpcAllShifted[1])));
+            }
+          }
+        }
+        for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+          if(PsiTpcAllRecenter[EventTypeId_tpc]==-999.0) continue;
+          for (int i=1; i<=_EpTermsMaxIni; i++){
+            output.tpcShiftSin[EventTypeId_tpc]->Fill(i,centrality,tpcBlock[EventTypeId_tpc].sinTerms[(i-1)*nBlock + e]);
+            output.tpcShiftCos[EventTypeId_tpc]->Fill(i,centrality,tpcBlock[EventTypeId_tpc].cosTerms[(i-1)*nBlock + e]);
+          }
+        }
+      } // events of the block
+    }
+    std::cout << "Pass " << pass << " done" << std::endl;
+
+    if(lastPass){
+      TFile *outputFile = new TFile(outFile,"RECREATE");
+      outputFile->cd();
+      output.Write();
+      for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+        hist_Epd_east_psi_raw_ini[EventTypeId]->Write();
+        hist_Epd_east_psi_recenter_ini[EventTypeId]->Write();
+        hist_Epd_east_psi_Shifted_ini[EventTypeId]->Write();
+      }
+      for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+        hist_tpc_all_psi_raw[EventTypeId_tpc]->Write();
+        hist_tpc_all_psi_recenter[EventTypeId_tpc]->Write();
+        hist_tpc_all_psi_shifted[EventTypeId_tpc]->Write();
+      }
+      for(int n=0; n<2; n++){
+        for(int p=0; p<6; p++) profile_correlation_epd_east[n][p]->Write();
+        for(int i=0; i<4; i++) profile_correlation_epd_tpc[n][i]->Write();
+        profile_correlation_epd_tpc_all[n]->Write();
+      }
+      outputFile->Close();
+      std::cout << "Corrections, event planes and correlations written to " << outFile << std::endl;
+    }
+    // ------------------- next pass: this output is the input ----------------------
+    for(int EventTypeId=0; EventTypeId<_nEventTypeBins; EventTypeId++){
+      delete hist_Epd_east_psi_raw_ini[EventTypeId];
+      delete hist_Epd_east_psi_recenter_ini[EventTypeId];
+      delete hist_Epd_east_psi_Shifted_ini[EventTypeId];
+    }
+    for(int EventTypeId_tpc=0; EventTypeId_tpc<_nEventTypeBins_tpc; EventTypeId_tpc++){
+      delete hist_tpc_all_psi_raw[EventTypeId_tpc];
+      delete hist_tpc_all_psi_recenter[EventTypeId_tpc];
+      delete hist_tpc_all_psi_shifted[EventTypeId_tpc];
+    }
+    for(int n=0; n<2; n++){
+      for(int p=0; p<6; p++) delete profile_correlation_epd_east[n][p];
+      for(int i=0; i<4; i++) delete profile_correlation_epd_tpc[n][i];
+      delete profile_correlation_epd_tpc_all[n];
+    }
+    if(ownsInput) input.Delete();
+    input = output;
+    ownsInput = kTRUE;
+  }
+  if(ownsInput) input.Delete();
+  delete chain;
+  TH1::AddDirectory(addDirectory);
+}
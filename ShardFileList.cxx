@@ -0,0 +1,108 @@
+/**
+ * \brief Balanced work units of a picoDst file list, see PicoShardManifest.h
+ *
+ * Reads the # of entries of every file of the list and cuts the files into
+ * units of at most maxUnitEntries entries (default: total / nJobs), so that a
+ * large file is shared by several jobs. The units are then scheduled longest
+ * first, each to the job with the fewest entries so far, which keeps the
+ * largest job within one unit of the average.
+ *
+ *   root -b -q -l ShardFileList.cxx+\(\"file.list\",\"shards.manifest\",100\)
+ *   ./PicoAnalyzer.sh 0 0 1 "manifest=shards.manifest,job=7"
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "TString.h"
+#include "TMath.h"
+
+#include "PicoShardManifest.h"
+
+bool LongerShardUnit(const PicoShardUnit &a, const PicoShardUnit &b){
+  if(a.Size() != b.Size()) return a.Size() > b.Size();
+  if(a.file != b.file) return a.file < b.file; // reproducible order for equal sizes
+  return a.firstEntry < b.firstEntry;
+}
+
+void ShardFileList(const Char_t *inFile = "test.list",
+                   TString manifestName = "shards.manifest",
+                   Int_t nJobs = 100,
+                   Long64_t maxUnitEntries = 0) // 0: total # of entries / nJobs
+{
+  if(nJobs < 1) nJobs = 1;
+  // ------------------ # of entries of every file --------------------------------
+  std::vector<TString> files;
+  std::vector<Long64_t> entries;
+  std::ifstream list(inFile);
+  std::string line;
+  Long64_t totalEntries = 0;
+  while(std::getline(list, line)){
+    TString fileName(line.c_str());
+    fileName = fileName.Strip(TString::kBoth);
+    if(fileName.IsNull() || fileName.BeginsWith("#")) continue;
+    TFile *picoFile = TFile::Open(fileName, "READ");
+    TTree *picoTree = (picoFile && !picoFile->IsZombie()) ? (TTree*)picoFile->Get("PicoDst") : NULL;
+    if(!picoTree){
+      std::cout << fileName << " can not be read, it is left out" << std::endl;
+      delete picoFile;
+      continue;
+    }
+    files.push_back(fileName);
+    entries.push_back(picoTree->GetEntries());
+    totalEntries += entries.back();
+    delete picoFile;
+  }
+  std::cout << files.size() << " files, " << totalEntries << " entries" << std::endl;
+  if(totalEntries == 0) return;
+  if(maxUnitEntries <= 0) maxUnitEntries = TMath::Max((Long64_t)1, totalEntries / nJobs);
+  // ------------------ Cut the files into units of similar size -------------------
+  std::vector<PicoShardUnit> units;
+  for(unsigned int iFile=0; iFile<files.size(); iFile++){
+    if(entries[iFile] == 0) continue;
+    Long64_t nUnits = (entries[iFile] + maxUnitEntries - 1) / maxUnitEntries;
+    for(Long64_t iUnit=0; iUnit<nUnits; iUnit++){
+      PicoShardUnit unit;
+      unit.job        = -1;
+      unit.file       = files[iFile];
+      unit.firstEntry = entries[iFile] * iUnit / nUnits;
+      unit.lastEntry  = entries[iFile] * (iUnit+1) / nUnits - 1;
+      units.push_back(unit);
+    }
+  }
+  // ------------------ Longest first, to the least loaded job ---------------------
+  std::sort(units.begin(), units.end(), LongerShardUnit);
+  std::vector<Long64_t> jobEntries(nJobs, 0);
+  for(unsigned int iUnit=0; iUnit<units.size(); iUnit++){
+    Int_t job = std::min_element(jobEntries.begin(), jobEntries.end()) - jobEntries.begin();
+    units[iUnit].job = job;
+    jobEntries[job] += units[iUnit].Size();
+  }
+  // ------------------ Manifest and the file list of every job --------------------
+  std::ofstream manifest(manifestName.Data());
+  manifest << "# " << units.size() << " work units of " << inFile << " for " << nJobs << " jobs, at most "
+           << maxUnitEntries << " entries each" << std::endl;
+  manifest << "# job file firstEntry lastEntry" << std::endl;
+  for(Int_t job=0; job<nJobs; job++){
+    std::vector<TString> jobFiles;
+    for(unsigned int iUnit=0; iUnit<units.size(); iUnit++){ // still longest first
+      if(units[iUnit].job != job) continue;
+      manifest << job << " " << units[iUnit].file << " " << units[iUnit].firstEntry << " " << units[iUnit].lastEntry << std::endl;
+      if(std::find(jobFiles.begin(), jobFiles.end(), units[iUnit].file) == jobFiles.end()) jobFiles.push_back(units[iUnit].file);
+    }
+    std::ofstream jobList(ShardJobListName(manifestName, job).Data());
+    for(unsigned int i=0; i<jobFiles.size(); i++) jobList << jobFiles[i] << std::endl;
+  }
+  manifest.close();
+  Long64_t largestJob = *std::max_element(jobEntries.begin(), jobEntries.end());
+  Long64_t smallestJob = *std::min_element(jobEntries.begin(), jobEntries.end());
+  std::cout << "Shard manifest " << manifestName << ": " << units.size() << " units, "
+            << smallestJob << " - " << largestJob << " entries per job (average "
+            << totalEntries / nJobs << ")" << std::endl;
+}
@@ -0,0 +1,110 @@
+/**
+ * \brief Event tag index of a picoDst file list, see PicoTagIndex.h
+ *
+ * Reads the Event branch and the primary momenta of the tracks only, and
+ * writes per chain entry the quantities of the event cuts of PicoAnalyzer.cxx.
+ * PicoAnalyzer(...,"tags=picoTagIndex.root") then reads only the entries
+ * passing the cuts of its sys_cutN/sys_varN.
+ *
+ * Run it like PicoAnalyzer.cxx, after RunAnalyzer.C:
+ *   root4star -b -q -l TagIndexBuilder.cxx+\(\"file.list\",\"picoTagIndex.root\"\)
+ */
+
+#include <iostream>
+#include <vector>
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "TChain.h"
+#include "TTree.h"
+#include "TClonesArray.h"
+#include "TString.h"
+
+#include "StRoot/StPicoEvent/StPicoDstReader.h"
+#include "StRoot/StPicoEvent/StPicoEvent.h"
+#include "PicoTrackColumns.h"
+#include "PicoEventCuts.h"
+#include "PicoTagIndex.h"
+
+void TagIndexBuilder(const Char_t *inFile = "test.list",
+                     TString tagFileName = "picoTagIndex.root")
+{
+  StPicoDstReader* picoReader = new StPicoDstReader(inFile);
+  picoReader->Init();
+  picoReader->SetStatus("*",0);
+  picoReader->SetStatus("Event",1);
+  picoReader->SetStatus("Track",1);
+  TChain *mPicoDst = picoReader->chain();
+  if( !mPicoDst ) {
+      std::cout << "No chain has been found." << std::endl;
+      return;
+  }
+  TClonesArray * mPicoEvent = new TClonesArray("StPicoEvent");
+  mPicoDst->SetBranchAddress("Event",&mPicoEvent);
+  PicoTrackColumns tracks(mPicoDst);
+  Long64_t events2read = mPicoDst->GetEntries();
+  std::cout << "Number of events to read: " << events2read << std::endl;
+
+  TFile *tagFile = new TFile(tagFileName,"RECREATE");
+  TTree *tagIndex = new TTree("TagIndex","picoDst event tags");
+  TTree *tagFiles = new TTree("TagFiles","picoDst files of the event tags");
+  PicoTagRecord tag;
+  PicoTagFile   file;
+  tag.Branch(tagIndex);
+  file.Branch(tagFiles);
+
+  Int_t treeNumber = -1;
+  for(Long64_t iEvent=0; iEvent<events2read; iEvent++){
+    if((iEvent+1)%10000 == 0) std::cout << "Working on event #[" << (iEvent+1)<< "/" << events2read << "]" << std::endl;
+    Long64_t localEntry = mPicoDst->LoadTree(iEvent);
+    if(localEntry < 0) break;
+    if(mPicoDst->GetTreeNumber() != treeNumber){ // next file: close the previous one in TagFiles
+      if(treeNumber >= 0) tagFiles->Fill();
+      treeNumber = mPicoDst->GetTreeNumber();
+      TFile *picoFile = mPicoDst->GetCurrentFile();
+      snprintf(file.name, sizeof(file.name), "%s", picoFile->GetName());
+      snprintf(file.uuid, sizeof(file.uuid), "%s", picoFile->GetUUID().AsString());
+      file.size     = picoFile->GetSize();
+      file.nEntries = mPicoDst->GetTree()->GetEntries();
+      file.firstTag = tagIndex->GetEntries();
+      file.nTags    = 0;
+      tracks.Update();
+    }
+    mPicoDst->GetEntry(iEvent);
+    StPicoEvent *event = (mPicoEvent->GetEntriesFast() > 0) ? (StPicoEvent*)mPicoEvent->UncheckedAt(0) : NULL;
+    if( !event ) {
+        std::cout << "Something went wrong, my Lord! Event is hiding from me..."
+        << std::endl;
+        break;
+    }
+    tag.fileIndex = tagFiles->GetEntries();
+    tag.entry     = localEntry;
+    tag.runId     = event->runId();
+    tag.eventId   = event->eventId();
+    tag.vx        = event->primaryVertex().X();
+    tag.vy        = event->primaryVertex().Y();
+    tag.vz        = event->primaryVertex().Z();
+    tag.vr        = VertexR(tag.vx, tag.vy);
+    tag.triggerBits = 0;
+    std::vector <unsigned int> triggerIDs = event->triggerIds();
+    for(unsigned int i=0; i < triggerIDs.size(); i++){
+      if(triggerIDs[i] == _goodTriggerId) tag.triggerBits |= 1u;
+    }
+    tracks.Decode(tag.vx, tag.vy, tag.vz);
+    Int_t nFXTMult = 0;
+    for(Int_t iTrk=0; iTrk<tracks.nTracks; iTrk++){
+      if(tracks.isPrimary[iTrk]) nFXTMult++;
+    }
+    tag.nFXTMult   = nFXTMult;
+    tag.centrality = FXTMultCentrality(nFXTMult);
+    tagIndex->Fill();
+    file.nTags++;
+  }
+  if(treeNumber >= 0) tagFiles->Fill();
+  tagFile->cd();
+  tagIndex->Write();
+  tagFiles->Write();
+  std::cout << "Tag index " << tagFileName << ": " << tagIndex->GetEntries() << " events of "
+            << tagFiles->GetEntries() << " files" << std::endl;
+  tagFile->Close();
+}